@@ -2,70 +2,54 @@
 #include "Executor.h"
 #include "TaskSystemImpl.h"
 #include "TaskSystem.h"
+#include "ParallelRange.h"
 #include <thread>
 namespace TaskSystem {
 	typedef TaskSystemExecutor::TaskID TaskID;
 
-	TaskID defaultId = { -1 };
-	std::vector < std::function<void(TaskID)>> emptyCallbackList;
+	/// <summary>
+	/// Calls a single callback of a finished task.
+	/// </summary>
+	struct CallbackBody {
+		/// <summary>
+		/// Task Context of completed task. Task map keeps it alive for as long as the callbacks task runs.
+		/// TODO: Executor knows about TaskSystemExecutorImpl
+		/// </summary>
+		TaskSystemExecutorImpl::TaskContext* tc = nullptr;
+
+		void operator()(int64_t callbackIndex, int threadIndex, int threadCount) const {
+			tc->onCompleteCallbacks[callbackIndex](tc->id);
+		}
+	};
 
 	/// <summary>
 	/// Special executor. Each step executes a callbacks of an already finished task.
 	/// A callbackExeutor task is only scheduled when a task has registered callbacks.
 	/// A callbackExecutor task should not have callbacks. 
 	/// </summary>
-	struct CallBackExecutor : TaskSystem::Executor {
+	struct CallBackExecutor : ParallelRangeExecutor<CallbackBody> {
 		CallBackExecutor(
 			std::unique_ptr<TaskSystem::Task> taskToExecute)
-			: Executor(std::move(taskToExecute)) {
-
-
+			: ParallelRangeExecutor(std::move(taskToExecute), 0, 0, 1, CallbackBody{}) {
 
-			tc = std::shared_ptr< TaskSystemExecutorImpl::TaskContext>(
-				(TaskSystemExecutorImpl::TaskContext*)(task->GetAnyParam("Context").value())
-			);
+			body.tc = (TaskSystemExecutorImpl::TaskContext*)(task->GetAnyParam("Context").value());
 
-			if (!tc) {
+			if (!body.tc) {
 				throw std::exception("No task context passed to CallBackExecutor");
 			}
 
-			callbackCount = tc->onCompleteCallbacks.size();
-			
+			// Callback list does not change once the task has completed
+			range.Reset(0, body.tc->onCompleteCallbacks.size(), 1);
 		}
 
 		virtual ~CallBackExecutor() {};
-		virtual ExecStatus ExecuteStep(int threadIndex, int threadCount);
 
-	private:
+	protected:
 		/// <summary>
-		/// Number of callbacks complete
+		/// All callbacks have returned - wake threads waiting for the task.
 		/// </summary>
-		std::atomic<int> completeC = 0;
-		/// <summary>
-		/// Task Context of completed task
-		/// TODO: Executor knows about TaskSystemExecutorImpl
-		/// </summary>
-		std::shared_ptr<TaskSystemExecutorImpl::TaskContext> tc;
-		/// <summary>
-		/// Total number of callbacks.
-		/// </summary>
-		unsigned int callbackCount = 0;
-
-		void setCallbacksComplete() {
-			{
-				std::lock_guard<std::mutex> l(tc->waitMutex);
-				tc->callbacksComplete->store(true);
-			}
-			tc->cv.notify_all();
-		}
+		virtual void OnRangeComplete(int threadIndex, int threadCount) override;
 	};
 
-	TaskSystem::Executor* ExecutorConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
-		return new CallBackExecutor(std::move(taskToExecute));
-	}
-
-	IMPLEMENT_ON_INIT() {
-
-		ts.Register("callbackExecutor", &ExecutorConstructorImpl);
-	}
-}
\ No newline at end of file
+	IMPLEMENT_EXECUTOR("CallbackExecutor", "callbackExecutor", CallBackExecutor);
+}
@@ -1,43 +1,30 @@
 #include "Task.h"
 #include "Executor.h"
 #include "TaskSystem.h"
+#include "ParallelRange.h"
 
 #include <chrono>
 #include <thread>
 #include <atomic>
 
-struct Printer : TaskSystem::Executor {
-    Printer(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
-        max = task->GetIntParam("max").value();
-        sleepMs = task->GetIntParam("sleep").value();
-        taskId = task->GetIntParam("taskId").value();
-    }
-
-    virtual ~Printer() {}
-
-    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) {
-        const int myValue = current.fetch_add(1);
-        if (myValue >= max) {
-            current.fetch_sub(1);
-            return ExecStatus::ES_Stop;
-        }
-
-        printf("TaskID: %d  - Printer [%d/%d]: %d\n", taskId, threadIndex, threadCount, myValue);
-        std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
-        return ExecStatus::ES_Continue;
-    };
-
-    std::atomic<int> current = 0;
-    int max = 0;
+struct PrintBody {
     int sleepMs = 0;
     int taskId = 0;
+
+    void operator()(int64_t value, int threadIndex, int threadCount) const {
+        printf("TaskID: %d  - Printer [%d/%d]: %d\n", taskId, threadIndex, threadCount, int(value));
+        std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
+    }
 };
 
-TaskSystem::Executor* ExecutorConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
-    return new Printer(std::move(taskToExecute));
-}
+struct Printer : TaskSystem::ParallelRangeExecutor<PrintBody> {
+    Printer(std::unique_ptr<TaskSystem::Task> taskToExecute) : ParallelRangeExecutor(std::move(taskToExecute), 0, 0, 1, PrintBody{}) {
+        range.Reset(0, task->GetIntParam("max").value(), 1);
+        body.sleepMs = task->GetIntParam("sleep").value();
+        body.taskId = task->GetIntParam("taskId").value();
+    }
 
-IMPLEMENT_ON_INIT() {
+    virtual ~Printer() {}
+};
 
-    ts.Register("printer", &ExecutorConstructorImpl);
-}
+IMPLEMENT_EXECUTOR("PrinterExecutor", "printer", Printer);
@@ -5,6 +5,7 @@
 #include "Task.h"
 #include "Executor.h"
 #include "TaskSystem.h"
+#include "ParallelRange.h"
 
 #include "Threading.hpp"
 #include "Material.h"
@@ -21,6 +22,14 @@
 #include <cmath>
 #include <iostream>
 #include <atomic>
+#include <mutex>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <array>
+#include <functional>
+#include <limits>
 
 /// Camera description, can be pointed at point, used to generate screen rays
 struct Camera {
@@ -30,8 +39,13 @@ struct Camera {
 	vec3 llc;
 	vec3 left;
 	vec3 up;
+	/// Arguments of the last lookAt, frame sequences orbit the target
+	float verticalFov = 90.f;
+	vec3 target;
 
 	void lookAt(float verticalFov, const vec3 &lookFrom, const vec3 &lookAt) {
+		this->verticalFov = verticalFov;
+		target = lookAt;
 		origin = lookFrom;
 		const float theta = degToRad(verticalFov);
 		float half_height = tan(theta / 2);
@@ -50,110 +64,621 @@ struct Camera {
 	}
 };
 
-vec3 raytrace(const Ray &r, Instancer &prims, int depth = 0) {
-	Intersection data;
-	if (prims.intersect(r, 0.001f, FLT_MAX, data)) {
+/// Compile a function for several instruction sets, the best one supported by the CPU is picked when the library loads
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define RT_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.1", "default")))
+#else
+#define RT_TARGET_CLONES
+#endif
+
+/// Primary rays of consecutive pixels in a tile row. All rays start at the camera origin, directions are stored
+/// as structure of arrays so they are generated in SIMD registers
+struct RayPacket {
+	static const int MaxSize = 16;
+	int size = 0;
+	alignas(64) float dirX[MaxSize];
+	alignas(64) float dirY[MaxSize];
+	alignas(64) float dirZ[MaxSize];
+
+	Ray getRay(const vec3 &origin, int lane) const {
+		return Ray(origin, vec3(dirX[lane], dirY[lane], dirZ[lane]));
+	}
+};
+
+/// Normalized directions through screen points (u[i], v[i]), same as Camera::getRay for each lane
+RT_TARGET_CLONES
+void generatePrimaryRays(const vec3 &llc, const vec3 &left, const vec3 &up, const vec3 &origin,
+                         const float *u, const float *v, int count, RayPacket &packet) {
+	for (int i = 0; i < count; i++) {
+		const float x = llc.x + u[i] * left.x + v[i] * up.x - origin.x;
+		const float y = llc.y + u[i] * left.y + v[i] * up.y - origin.y;
+		const float z = llc.z + u[i] * left.z + v[i] * up.z - origin.z;
+		const float invLength = 1.f / sqrtf(x * x + y * y + z * z);
+		packet.dirX[i] = x * invLength;
+		packet.dirY[i] = y * invLength;
+		packet.dirZ[i] = z * invLength;
+	}
+	packet.size = count;
+}
+
+/// PCG32 random number generator. Seeded per pixel and sample, so each sample draws the same numbers
+/// whichever thread renders it
+struct PathRng {
+	PathRng() = default;
+
+	PathRng(uint64_t seed, uint64_t sequence) {
+		increment = (sequence << 1u) | 1u;
+		nextUint();
+		state += seed;
+		nextUint();
+	}
+
+	uint32_t nextUint() {
+		const uint64_t old = state;
+		state = old * 6364136223846793005ULL + increment;
+		const uint32_t xorShifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+		const uint32_t rot = uint32_t(old >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+	}
+
+	/// Uniform in [0, 1)
+	float nextFloat() {
+		return (nextUint() >> 8) * (1.f / 16777216.f);
+	}
+
+private:
+	uint64_t state = 0;
+	uint64_t increment = 1;
+};
+
+/// Bounces after which paths are terminated with Russian roulette
+const int RouletteDepth = 3;
+
+vec3 skyColor(const Ray &r) {
+	const vec3 dir = r.dir;
+	const float f = 0.5f * (dir.y + 1.f);
+	return (1.f - f) * vec3(1.f) + f * vec3(0.5f, 0.7f, 1.f);
+}
+
+/// Surface seen through a pixel by one sample, used to guide the denoiser. Sky has albedo 1 and normal 0
+struct PrimaryFeatures {
+	Color albedo;
+	vec3 normal;
+};
+
+/// Trace a path iteratively, accumulating the attenuation of each bounce. Paths with low throughput are
+/// terminated early with Russian roulette, surviving paths are reweighted to keep the estimate unbiased.
+/// rays counts every ray cast including bounces. features is set from the first hit if not null
+vec3 raytrace(Ray ray, const std::vector<SharedPrimPtr> &prims, PathRng &rng, uint64_t &rays, PrimaryFeatures *features = nullptr) {
+	Color throughput(1.f);
+	for (int depth = 0; ; depth++) {
+		Intersection data;
+		rays++;
+		// Top level primitives are few, each one culls the ray with its own acceleration structure
+		bool hit = false;
+		float closest = FLT_MAX;
+		for (const SharedPrimPtr &prim : prims) {
+			if (prim->intersect(ray, 0.001f, closest, data)) {
+				hit = true;
+				closest = data.t;
+			}
+		}
+		if (!hit) {
+			if (features && depth == 0) {
+				*features = { Color(1.f), vec3(0.f) };
+			}
+			return throughput * skyColor(ray);
+		}
+
 		Ray scatter;
 		Color attenuation;
-		if (depth < MAX_RAY_DEPTH && data.material->shade(r, data, attenuation, scatter)) {
-			const Color incoming = raytrace(scatter, prims, depth + 1);
-			return attenuation * incoming;
-		} else {
+		const bool scattered = depth < MAX_RAY_DEPTH && data.material->shade(ray, data, attenuation, scatter);
+		if (features && depth == 0) {
+			*features = { scattered ? attenuation : Color(0.f), data.normal };
+		}
+		if (!scattered) {
 			return Color(0.f);
 		}
+		throughput = throughput * attenuation;
+
+		if (depth >= RouletteDepth) {
+			const float survival = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), 0.95f);
+			if (rng.nextFloat() >= survival) {
+				return Color(0.f);
+			}
+			throughput = (1.f / survival) * throughput;
+		}
+		ray = scatter;
 	}
-	const vec3 dir = r.dir;
-	const float f = 0.5f * (dir.y + 1.f);
-	return (1.f - f) * vec3(1.f) + f * vec3(0.5f, 0.7f, 1.f);
 }
 
+/// Instances of shared meshes placed with an offset and uniform scale. Instances are stored as structure of arrays
+/// with 16 bit mesh and material indices into small tables instead of a pair of shared_ptr each, 20 bytes per instance.
+/// onBeforeRender builds a BVH over the instance bounds whose leaves reference the meshes' own BVHs, so the meshes
+/// are the bottom level shared by all instances. Traversal only follows indices and raw pointers, no reference counts
+struct CompactInstancer : Primitive {
+	/// Instances in a leaf of the top level BVH
+	static const int MaxLeafSize = 4;
+	/// Bins per axis of the surface area heuristic
+	static const int SahBins = 16;
+	/// Subtrees of at least this many instances build one of their halves in a spawned job
+	static const uint32_t ParallelBuildSize = 256;
+
+	/// Add an instance of mesh, material replaces the mesh's own material if set
+	void addInstance(const SharedPrimPtr &mesh, const vec3 &offset, float scale = 1.f, const SharedMaterialPtr &material = nullptr) {
+		offsetX.push_back(offset.x);
+		offsetY.push_back(offset.y);
+		offsetZ.push_back(offset.z);
+		scales.push_back(scale);
+		meshIndex.push_back(tableIndex(meshes, mesh));
+		materialIndex.push_back(material ? uint16_t(tableIndex(materials, material) + 1) : 0);
+	}
+
+	/// Build the top level BVH on the calling thread, the meshes must be built already and are not changed
+	void onBeforeRender() override {
+		build(nullptr);
+	}
+
+	/// Build the top level BVH, large subtrees are built by jobs spawned on ts if it is not null
+	void build(TaskSystem::TaskSystemExecutor *ts) {
+		meshPtrs.clear();
+		meshBounds.clear();
+		for (const SharedPrimPtr &mesh : meshes) {
+			BBox box;
+			mesh->expandBox(box);
+			meshPtrs.push_back(mesh.get());
+			meshBounds.push_back({ box.min, box.max });
+		}
+		materialPtrs.clear();
+		for (const SharedMaterialPtr &material : materials) {
+			materialPtrs.push_back(material.get());
+		}
+
+		const uint32_t count = uint32_t(scales.size());
+		std::vector<Bounds> instanceBounds(count);
+		std::vector<uint32_t> order(count);
+		for (uint32_t i = 0; i < count; i++) {
+			const Bounds &mesh = meshBounds[meshIndex[i]];
+			const vec3 offset(offsetX[i], offsetY[i], offsetZ[i]);
+			instanceBounds[i] = { offset + scales[i] * mesh.min, offset + scales[i] * mesh.max };
+			order[i] = i;
+		}
+		nodes.clear();
+		// A binary tree with at least one instance per leaf has fewer than twice as many nodes as instances
+		nodes.reserve(size_t(count) * 2);
+		if (count > 0) {
+			buildNode(ts, instanceBounds, order, 0, count, nodes);
+		}
+
+		// Leaves reference consecutive instances, the arrays are put in leaf order
+		permute(offsetX, order);
+		permute(offsetY, order);
+		permute(offsetZ, order);
+		permute(scales, order);
+		permute(meshIndex, order);
+		permute(materialIndex, order);
+	}
+
+	bool intersect(const Ray &ray, float tMin, float tMax, Intersection &intersection) override {
+		if (nodes.empty()) {
+			return false;
+		}
+		const float invDir[3] = { 1.f / ray.dir.x, 1.f / ray.dir.y, 1.f / ray.dir.z };
+		uint32_t stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		bool hit = false;
+		while (top > 0) {
+			const uint32_t index = stack[--top];
+			const Node &node = nodes[index];
+			if (!node.intersect(ray.origin, invDir, tMin, tMax)) {
+				continue;
+			}
+			if (node.count > 0) {
+				for (uint32_t i = node.index; i < node.index + node.count; i++) {
+					if (intersectInstance(i, ray, tMin, tMax, intersection)) {
+						hit = true;
+						tMax = intersection.t;
+					}
+				}
+			} else if (invDir[node.axis] < 0.f) {
+				// Visit the child nearer to the ray first, the second child holds the larger coordinates
+				stack[top++] = index + 1;
+				stack[top++] = node.index;
+			} else {
+				stack[top++] = node.index;
+				stack[top++] = index + 1;
+			}
+		}
+		return hit;
+	}
+
+	bool boxIntersect(const BBox &other) override {
+		if (nodes.empty()) {
+			return false;
+		}
+		const Node &root = nodes[0];
+		for (int axis = 0; axis < 3; axis++) {
+			if (root.min[axis] > other.max[axis] || root.max[axis] < other.min[axis]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void expandBox(BBox &other) override {
+		if (!nodes.empty()) {
+			other.add(vec3(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]));
+			other.add(vec3(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]));
+		}
+	}
+
+	vec3 getCenter() const override {
+		if (nodes.empty()) {
+			return vec3(0.f);
+		}
+		const Node &root = nodes[0];
+		return vec3(root.min[0] + root.max[0], root.min[1] + root.max[1], root.min[2] + root.max[2]) * 0.5f;
+	}
+
+	/// Memory used by the instances and the top level BVH
+	size_t getMemoryUsage() const {
+		return scales.size() * (4 * sizeof(float) + 2 * sizeof(uint16_t)) + nodes.size() * sizeof(Node);
+	}
+
+private:
+	struct Bounds {
+		vec3 min, max;
+	};
+
+	/// Node of the top level BVH, 32 bytes. The first child of an inner node directly follows it
+	struct Node {
+		float min[3], max[3];
+		/// First instance of a leaf, or the second child of an inner node
+		uint32_t index;
+		/// Instances of a leaf, 0 for inner nodes
+		uint16_t count;
+		/// Axis an inner node is split on
+		uint16_t axis;
+
+		bool intersect(const vec3 &origin, const float invDir[3], float tMin, float tMax) const {
+			for (int axis = 0; axis < 3; axis++) {
+				const float t0 = (min[axis] - origin[axis]) * invDir[axis];
+				const float t1 = (max[axis] - origin[axis]) * invDir[axis];
+				tMin = std::max(tMin, std::min(t0, t1));
+				tMax = std::min(tMax, std::max(t0, t1));
+			}
+			return tMin <= tMax;
+		}
+	};
+
+	/// Append the subtree of instances order[first, last) to out. Inner nodes are split with the binned surface area
+	/// heuristic over the instance centers. Above ParallelBuildSize the second child is built into its own array by a
+	/// spawned job while this thread builds the first, and appended once both are done
+	void buildNode(TaskSystem::TaskSystemExecutor *ts, const std::vector<Bounds> &bounds, std::vector<uint32_t> &order, uint32_t first, uint32_t last,
+		std::vector<Node> &out) const {
+		const uint32_t index = uint32_t(out.size());
+		out.emplace_back();
+		Bounds box = bounds[order[first]];
+		Bounds centers = { box.min + box.max, box.min + box.max };
+		for (uint32_t i = first; i < last; i++) {
+			const Bounds &instance = bounds[order[i]];
+			const vec3 center = instance.min + instance.max;
+			for (int axis = 0; axis < 3; axis++) {
+				box.min[axis] = std::min(box.min[axis], instance.min[axis]);
+				box.max[axis] = std::max(box.max[axis], instance.max[axis]);
+				centers.min[axis] = std::min(centers.min[axis], center[axis]);
+				centers.max[axis] = std::max(centers.max[axis], center[axis]);
+			}
+		}
+		for (int axis = 0; axis < 3; axis++) {
+			out[index].min[axis] = box.min[axis];
+			out[index].max[axis] = box.max[axis];
+		}
+
+		if (last - first <= MaxLeafSize) {
+			out[index].index = first;
+			out[index].count = uint16_t(last - first);
+			out[index].axis = 0;
+			return;
+		}
+
+		int axis = 0;
+		const uint32_t middle = splitSah(bounds, order, first, last, centers, axis);
+		out[index].count = 0;
+		out[index].axis = uint16_t(axis);
+
+		if (!ts || last - first < ParallelBuildSize) {
+			buildNode(ts, bounds, order, first, middle, out);
+			out[index].index = uint32_t(out.size());
+			buildNode(ts, bounds, order, middle, last, out);
+			return;
+		}
+
+		// The halves touch disjoint parts of order, inner nodes of the second one are moved behind the first below
+		std::vector<Node> second;
+		second.reserve(size_t(last - middle) * 2);
+		TaskSystem::TaskSystemExecutor::TaskGroup group;
+		ts->Spawn(group, [this, ts, &bounds, &order, middle, last, &second](int, int) {
+			buildNode(ts, bounds, order, middle, last, second);
+		});
+		buildNode(ts, bounds, order, first, middle, out);
+		ts->WaitForGroup(group);
+
+		const uint32_t offset = uint32_t(out.size());
+		out[index].index = offset;
+		for (Node &node : second) {
+			if (node.count == 0) {
+				node.index += offset;
+			}
+			out.push_back(node);
+		}
+	}
+
+	/// Partition order[first, last) at the bin boundary with the lowest surface area cost and return the first index
+	/// of the second half, which holds the larger coordinates on axis. centers bounds the doubled instance centers.
+	/// Splits the instances in two halves of their current order when all centers coincide
+	static uint32_t splitSah(const std::vector<Bounds> &bounds, std::vector<uint32_t> &order, uint32_t first, uint32_t last,
+		const Bounds &centers, int &axis) {
+		struct Bin {
+			Bounds box;
+			uint32_t count = 0;
+		};
+		const auto grow = [](Bounds &box, const Bounds &other) {
+			for (int a = 0; a < 3; a++) {
+				box.min[a] = std::min(box.min[a], other.min[a]);
+				box.max[a] = std::max(box.max[a], other.max[a]);
+			}
+		};
+		const auto area = [](const Bounds &box) {
+			const vec3 d = box.max - box.min;
+			return d.x * d.y + d.y * d.z + d.z * d.x;
+		};
+		const auto binOf = [&bounds, &centers](uint32_t instance, int a) {
+			const float extent = centers.max[a] - centers.min[a];
+			const float center = bounds[instance].min[a] + bounds[instance].max[a];
+			return std::min(int((center - centers.min[a]) / extent * SahBins), SahBins - 1);
+		};
+
+		float bestCost = std::numeric_limits<float>::max();
+		int bestSplit = -1;
+		for (int a = 0; a < 3; a++) {
+			if (centers.max[a] - centers.min[a] <= 0.f) {
+				continue;
+			}
+			Bin bins[SahBins];
+			for (uint32_t i = first; i < last; i++) {
+				Bin &bin = bins[binOf(order[i], a)];
+				if (bin.count++ == 0) {
+					bin.box = bounds[order[i]];
+				} else {
+					grow(bin.box, bounds[order[i]]);
+				}
+			}
+
+			// Cost of splitting before bin s is area * count of both sides, swept from the right and then the left
+			float rightCost[SahBins];
+			Bounds right = {};
+			uint32_t rightCount = 0;
+			for (int s = SahBins - 1; s > 0; s--) {
+				if (bins[s].count > 0) {
+					if (rightCount == 0) {
+						right = bins[s].box;
+					} else {
+						grow(right, bins[s].box);
+					}
+					rightCount += bins[s].count;
+				}
+				rightCost[s] = rightCount > 0 ? area(right) * rightCount : 0.f;
+			}
+			Bounds left = {};
+			uint32_t leftCount = 0;
+			for (int s = 1; s < SahBins; s++) {
+				if (bins[s - 1].count > 0) {
+					if (leftCount == 0) {
+						left = bins[s - 1].box;
+					} else {
+						grow(left, bins[s - 1].box);
+					}
+					leftCount += bins[s - 1].count;
+				}
+				if (leftCount == 0 || leftCount == last - first) {
+					continue;
+				}
+				const float cost = area(left) * leftCount + rightCost[s];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestSplit = s;
+					axis = a;
+				}
+			}
+		}
+
+		if (bestSplit < 0) {
+			axis = 0;
+			return first + (last - first) / 2;
+		}
+		const auto split = std::partition(order.begin() + first, order.begin() + last, [&binOf, axis, bestSplit](uint32_t instance) {
+			return binOf(instance, axis) < bestSplit;
+		});
+		return uint32_t(split - order.begin());
+	}
+
+	bool intersectInstance(uint32_t i, const Ray &ray, float tMin, float tMax, Intersection &intersection) const {
+		// The mesh is intersected in its own space, the direction is kept so distances scale with the instance
+		const float scale = scales[i];
+		const float invScale = 1.f / scale;
+		const Ray local(vec3((ray.origin.x - offsetX[i]) * invScale, (ray.origin.y - offsetY[i]) * invScale, (ray.origin.z - offsetZ[i]) * invScale), ray.dir);
+		Intersection data;
+		if (!meshPtrs[meshIndex[i]]->intersect(local, tMin * invScale, tMax * invScale, data)) {
+			return false;
+		}
+		intersection = data;
+		intersection.t = data.t * scale;
+		intersection.p = vec3(offsetX[i], offsetY[i], offsetZ[i]) + scale * data.p;
+		if (materialIndex[i] > 0) {
+			intersection.material = materialPtrs[materialIndex[i] - 1];
+		}
+		return true;
+	}
+
+	/// Index of value in table, added if missing. Tables hold the few distinct meshes and materials of the instances
+	template <typename T>
+	static uint16_t tableIndex(std::vector<T> &table, const T &value) {
+		const auto it = std::find(table.begin(), table.end(), value);
+		if (it != table.end()) {
+			return uint16_t(it - table.begin());
+		}
+		assert(table.size() < UINT16_MAX);
+		table.push_back(value);
+		return uint16_t(table.size() - 1);
+	}
+
+	template <typename T>
+	static void permute(std::vector<T> &values, const std::vector<uint32_t> &order) {
+		std::vector<T> permuted(values.size());
+		for (size_t i = 0; i < order.size(); i++) {
+			permuted[i] = values[order[i]];
+		}
+		values.swap(permuted);
+	}
+
+	/// Owning references of the meshes and materials, one per distinct value
+	std::vector<SharedPrimPtr> meshes;
+	std::vector<SharedMaterialPtr> materials;
+	/// Raw pointers and bounds used while rendering, filled by onBeforeRender
+	std::vector<Primitive *> meshPtrs;
+	std::vector<Material *> materialPtrs;
+	std::vector<Bounds> meshBounds;
+
+	std::vector<float> offsetX, offsetY, offsetZ, scales;
+	std::vector<uint16_t> meshIndex;
+	/// 0 keeps the mesh's material, otherwise index + 1 in materials
+	std::vector<uint16_t> materialIndex;
+	std::vector<Node> nodes;
+};
+
 struct Scene {
 	int width = 640;
 	int height = 480;
 	int samplesPerPixel = 2;
 	std::string name;
-	Instancer primitives;
+	/// Top level primitives, each with its own acceleration structure built in parallel with the others.
+	/// Shared by all renders of the scene once built, read only while rendering
+	std::vector<SharedPrimPtr> primitives;
+	/// Meshes loaded for the scene, built before the primitives that instance them
+	std::vector<SharedPrimPtr> meshes;
 	Camera camera;
 	ImageData image;
-	std::atomic<int> completedThreads = 0;
+	/// Approximate memory used by loaded meshes, taken from their file size
+	size_t meshBytes = 0;
+	/// Time spent constructing meshes in loadMesh, mostly OBJ parsing
+	double meshLoadSeconds = 0;
+	/// Wall time of build()
+	double buildSeconds = 0;
 
-	std::mutex initMutex;
-	std::vector<int> perThreadProgress;
+	/// Build the acceleration structures of all meshes, then of all other top level primitives. Each structure is
+	/// built by a job spawned on the task system, the calling thread runs jobs until all are done. Instancers also
+	/// spawn jobs for the subtrees of their top level BVH
+	void build(TaskSystem::TaskSystemExecutor &ts) {
+		const auto start = std::chrono::steady_clock::now();
+		std::vector<Primitive *> instancing;
+		for (const SharedPrimPtr &prim : primitives) {
+			if (std::find(meshes.begin(), meshes.end(), prim) == meshes.end()) {
+				instancing.push_back(prim.get());
+			}
+		}
+		std::vector<Primitive *> meshPrims;
+		for (const SharedPrimPtr &mesh : meshes) {
+			meshPrims.push_back(mesh.get());
+		}
+		buildAll(ts, meshPrims);
+		buildAll(ts, instancing);
+		buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
 
-	void onBeforeRender() {
-		primitives.onBeforeRender();
+	static void buildAll(TaskSystem::TaskSystemExecutor &ts, const std::vector<Primitive *> &prims) {
+		TaskSystem::TaskSystemExecutor::TaskGroup group;
+		for (Primitive *prim : prims) {
+			ts.Spawn(group, [&ts, prim](int, int) {
+				if (CompactInstancer *instancer = dynamic_cast<CompactInstancer *>(prim)) {
+					instancer->build(&ts);
+				} else {
+					prim->onBeforeRender();
+				}
+			});
+		}
+		ts.WaitForGroup(group);
 	}
 
-	void initImage(int w, int h, int spp) {
-		image.init(w, h);
+	/// Set output size, image itself is allocated by the renderer
+	void setImageSize(int w, int h, int spp) {
 		width = w;
 		height = h;
 		samplesPerPixel = spp;
 		camera.aspect = float(width) / height;
 	}
 
-	void addPrimitive(PrimPtr primitive) {
-		primitives.addInstance(std::move(primitive));
+	void addPrimitive(SharedPrimPtr primitive) {
+		primitives.push_back(std::move(primitive));
 	}
 
-	bool renderStep(int threadIndex, int threadCount) {
-		if (perThreadProgress.empty()) {
-			std::lock_guard<std::mutex> lock(initMutex);
-			if (perThreadProgress.empty()) {
-				perThreadProgress.resize(threadCount, 0);
-				for (int c = 0; c < int(perThreadProgress.size()); c++) {
-					perThreadProgress[c] = c;
-				}
-			}
-		}
+	SharedPrimPtr loadMesh(const std::string &path, MaterialPtr material) {
+		std::error_code error;
+		const uintmax_t fileSize = std::filesystem::file_size(path, error);
+		meshBytes += error ? 0 : size_t(fileSize);
+		const auto start = std::chrono::steady_clock::now();
+		meshes.push_back(std::make_shared<TriangleMesh>(path, std::move(material)));
+		meshLoadSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return meshes.back();
+	}
 
-		int &idx = perThreadProgress[threadIndex];
+	/// Add samples [firstSample, endSample) of count pixels of row r starting at column c, seen from camera, to sum,
+	/// and the squared luminance of each sample to lumSq. r is counted from the bottom of the image. If albedo is not
+	/// null the first hit features of each sample are added to albedo and normal.
+	/// Primary rays of all pixels are generated as one packet per sample, intersection and bounces are traced per ray
+	void renderSpan(const Camera &camera, int r, int c, int count, int firstSample, int endSample, Color *sum, float *lumSq, Color *albedo, vec3 *normal,
+		uint64_t seed, uint64_t &rays) const {
+		assert(count <= RayPacket::MaxSize);
+		float u[RayPacket::MaxSize], v[RayPacket::MaxSize];
+		RayPacket packet;
 
-		if (idx >= width * height) {
-			if (completedThreads.load() == threadCount) {
-				return true;
-			} else {
-				return false;
+		for (int s = firstSample; s < endSample; s++) {
+			// Random sequence depends only on the pixel, sample and seed
+			PathRng rngs[RayPacket::MaxSize];
+			for (int i = 0; i < count; i++) {
+				const uint64_t pixelIndex = uint64_t(r) * width + c + i;
+				rngs[i] = PathRng(seed ^ (pixelIndex * samplesPerPixel + s), pixelIndex);
+				u[i] = float(c + i + rngs[i].nextFloat()) / float(width);
+				v[i] = float(r + rngs[i].nextFloat()) / float(height);
 			}
-		}
-
-		const int r = idx / width;
-		const int c = idx % width;
-
-		Color avg(0);
-		for (int s = 0; s < samplesPerPixel; s++) {
-			const float u = float(c + randFloat()) / float(width);
-			const float v = float(r + randFloat()) / float(height);
-			const Ray &ray = camera.getRay(u, v);
-			const vec3 sample = raytrace(ray, primitives);
-			avg += sample;
-		}
-
-		avg /= samplesPerPixel;
-		image(c, height - r - 1) = Color(sqrtf(avg.x), sqrtf(avg.y), sqrtf(avg.z));
-
-		idx += threadCount;
-
-		if (idx >= width * height) {
-			if (completedThreads.fetch_add(1) == threadCount - 1) {
-				const std::string resultImage = name + ".png";
-				const PNGImage &png = image.createPNGData();
-				const int success = stbi_write_png(resultImage.c_str(), width, height, PNGImage::componentCount(), png.data.data(), sizeof(PNGImage::Pixel) * width);
-				assert(success == 1);
-				return true;
+			generatePrimaryRays(camera.llc, camera.left, camera.up, camera.origin, u, v, count, packet);
+			for (int i = 0; i < count; i++) {
+				PrimaryFeatures features;
+				const Color sample = raytrace(packet.getRay(camera.origin, i), primitives, rngs[i], rays, albedo ? &features : nullptr);
+				const float lum = luminance(sample);
+				sum[i] += sample;
+				lumSq[i] += lum * lum;
+				if (albedo) {
+					albedo[i] += features.albedo;
+					normal[i] += features.normal;
+				}
 			}
 		}
-		return false;
 	}
+
+	static float luminance(const Color &color) {
+		return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+	}
+
 };
 
 void sceneExample(Scene &scene) {
 	scene.name = "example";
-	scene.initImage(800, 600, 4);
 	scene.camera.lookAt(90.f, {-0.1f, 5, -0.1f}, {0, 0, 0});
 
-	SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
-	Instancer *instancer = new Instancer;
+	SharedPrimPtr mesh(scene.loadMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
+	CompactInstancer *instancer = new CompactInstancer;
 	instancer->addInstance(mesh, vec3(2, 0, 0));
 	instancer->addInstance(mesh, vec3(0, 0, 2));
 	instancer->addInstance(mesh, vec3(2, 0, 2));
@@ -165,11 +690,23 @@ void sceneExample(Scene &scene) {
 	scene.addPrimitive(PrimPtr(new SpherePrim{vec3(0, 0, 0), r, MaterialPtr(new Lambert{Color(0.8, 0.3, 0.3)})}));
 }
 
+/// Columns of an instance grid that share one CompactInstancer. Each band is a top level primitive, so bands build in parallel
+const int GridBandColumns = 8;
+
+/// Instancers for the bands of a grid with columns from -count to count, added to the scene
+std::vector<CompactInstancer *> addGridBands(Scene &scene, int count) {
+	std::vector<CompactInstancer *> bands((2 * count + GridBandColumns) / GridBandColumns);
+	for (CompactInstancer *&band : bands) {
+		band = new CompactInstancer;
+		scene.addPrimitive(PrimPtr(band));
+	}
+	return bands;
+}
+
 void sceneManyHeavyMeshes(Scene &scene) {
 	scene.name = "instanced-dragons";
 	const int count = 50;
 
-	scene.initImage(1280, 720, 10);
 	scene.camera.lookAt(90.f, {0, 3, -count}, {0, 3, count});
 
 	SharedMaterialPtr instanceMaterials[] = {
@@ -182,85 +719,1385 @@ void sceneManyHeavyMeshes(Scene &scene) {
 	};
 	const int materialCount = std::size(instanceMaterials);
 
-	auto getRandomMaterial = [instanceMaterials, materialCount]() -> SharedMaterialPtr {
-		const int rng = int(randFloat() * materialCount);
+	// Fixed seed, every build of the scene assigns the same materials
+	PathRng materialRng(1, 0);
+	auto getRandomMaterial = [instanceMaterials, materialCount, &materialRng]() -> SharedMaterialPtr {
+		const int rng = int(materialRng.nextFloat() * materialCount);
 		return instanceMaterials[rng];
 	};
 
-	SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
-	Instancer *instancer = new Instancer;
+	SharedPrimPtr mesh(scene.loadMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
+	CompactInstancer *instancer = new CompactInstancer;
 
 	instancer->addInstance(mesh, vec3(0, 2.5, -count + 1), 0.08f, getRandomMaterial());
+	scene.addPrimitive(PrimPtr(instancer));
 
+	const std::vector<CompactInstancer *> bands = addGridBands(scene, count);
 	for (int c = -count; c <= count; c++) {
+		CompactInstancer *band = bands[(c + count) / GridBandColumns];
 		for (int r = -count; r <= count; r++) {
-			instancer->addInstance(mesh, vec3(c, 0, r), 0.05f, getRandomMaterial());
-			instancer->addInstance(mesh, vec3(c, 6, r), 0.05f, getRandomMaterial());
+			band->addInstance(mesh, vec3(c, 0, r), 0.05f, getRandomMaterial());
+			band->addInstance(mesh, vec3(c, 6, r), 0.05f, getRandomMaterial());
 		}
 	}
-
-	scene.addPrimitive(PrimPtr(instancer));
 }
 
 void sceneManySimpleMeshes(Scene &scene) {
 	scene.name = "instanced-cubes";
 	const int count = 20;
 
-	scene.initImage(800, 600, 2);
 	scene.camera.lookAt(90.f, {0, 2, count}, {0, 0, 0});
 
-	SharedPrimPtr mesh(new TriangleMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
-	Instancer *instancer = new Instancer;
+	SharedPrimPtr mesh(scene.loadMesh(MESH_FOLDER "/cube.obj", MaterialPtr(new Lambert{Color(1, 0, 0)})));
 
+	const std::vector<CompactInstancer *> bands = addGridBands(scene, count);
 	for (int c = -count; c <= count; c++) {
+		CompactInstancer *band = bands[(c + count) / GridBandColumns];
 		for (int r = -count; r <= count; r++) {
-			instancer->addInstance(mesh, vec3(c, 0, r), 0.5f);
+			band->addInstance(mesh, vec3(c, 0, r), 0.5f);
 		}
 	}
-
-	scene.addPrimitive(PrimPtr(instancer));
 }
 
 void sceneHeavyMesh(Scene &scene) {
 	scene.name = "dragon";
-	scene.initImage(800, 600, 4);
 	scene.camera.lookAt(90.f, {8, 10, 7}, {0, 0, 0});
-	scene.addPrimitive(PrimPtr(new TriangleMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)}))));
+	scene.addPrimitive(scene.loadMesh(MESH_FOLDER "/dragon.obj", MaterialPtr(new Lambert{Color(0.2, 0.7, 0.1)})));
 }
 
 typedef void (*SceneCreator)(Scene &);
 
-struct Renderer : TaskSystem::Executor {
-	Renderer(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
-		std::string sceneName = task->GetStringParam("sceneName").value();
-		std::map<std::string, SceneCreator> sceneCreators = {
-			{ "Example", sceneExample},
-			{ "HeavyMesh", sceneHeavyMesh},
-			{ "ManySimpleMeshes", sceneManySimpleMeshes},
-			{ "ManyHeavyMeshes", sceneManyHeavyMeshes},
-		};
+/// Creator and output size of a scene, the size is known before the scene is built
+struct SceneEntry {
+	SceneCreator create;
+	int width, height;
+	int samplesPerPixel;
+};
+
+const std::map<std::string, SceneEntry> sceneCreators = {
+	{ "Example", {sceneExample, 800, 600, 4}},
+	{ "HeavyMesh", {sceneHeavyMesh, 800, 600, 4}},
+	{ "ManySimpleMeshes", {sceneManySimpleMeshes, 800, 600, 2}},
+	{ "ManyHeavyMeshes", {sceneManyHeavyMeshes, 1280, 720, 10}},
+};
+
+/// Rectangle of pixels rendered by one step
+struct Tile {
+	int x, y;
+	int width, height;
+};
+
+/// Interleave the bits of x and y, tiles sorted by it are visited in Z-order
+uint32_t mortonCode(uint32_t x, uint32_t y) {
+	uint32_t code = 0;
+	for (int bit = 0; bit < 16; bit++) {
+		code |= ((x >> bit) & 1u) << (2 * bit);
+		code |= ((y >> bit) & 1u) << (2 * bit + 1);
+	}
+	return code;
+}
 
-		sceneCreators[sceneName](scene);
-		scene.onBeforeRender();
-		printf("Initialized scene [%s]\n", scene.name.c_str());
+/// Split the image in tiles of tileSize x tileSize in Morton order, so consecutive tiles are close on screen
+std::vector<Tile> makeTiles(int width, int height, int tileSize) {
+	const int tilesX = (width + tileSize - 1) / tileSize;
+	const int tilesY = (height + tileSize - 1) / tileSize;
+	std::vector<std::pair<uint32_t, Tile>> ordered;
+	ordered.reserve(tilesX * tilesY);
+	for (int ty = 0; ty < tilesY; ty++) {
+		for (int tx = 0; tx < tilesX; tx++) {
+			const Tile tile{tx * tileSize, ty * tileSize, std::min(tileSize, width - tx * tileSize), std::min(tileSize, height - ty * tileSize)};
+			ordered.push_back({mortonCode(tx, ty), tile});
+		}
 	}
+	std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint32_t, Tile> &a, const std::pair<uint32_t, Tile> &b) {
+		return a.first < b.first;
+	});
 
-	virtual ~Renderer() {}
+	std::vector<Tile> tiles;
+	tiles.reserve(ordered.size());
+	for (const std::pair<uint32_t, Tile> &entry : ordered) {
+		tiles.push_back(entry.second);
+	}
+	return tiles;
+}
+
+/// Accumulation state of a progressive render, every pass adds one sample to each pixel. Passes alternate between
+/// two accumulation buffers and two frames. Each tile resolves its pass into the frame of the pass, a completed
+/// frame is handed to the snapshot while the next pass renders into the other one
+struct ProgressiveFrame {
+	int passes = 0;
+	/// Sample sums after passes with even and odd index, stored tile after tile
+	std::vector<Color> accumulation[2];
+	/// Resolved frames of passes with even and odd index
+	ImageData images[2];
+	/// Offset of each tile in the accumulation buffers
+	std::vector<size_t> tileOffsets;
+	/// Passes completed by each tile
+	std::unique_ptr<std::atomic<int>[]> tilePasses;
+	/// Tiles completed in each pass
+	std::unique_ptr<std::atomic<int>[]> passTiles;
+	/// Passes published in order, the last published frame holds the average of this many samples
+	std::atomic<int> resolvedPasses = 0;
+	/// Held by the step publishing completed passes
+	std::mutex publishMutex;
+
+	ProgressiveFrame(const std::vector<Tile> &tiles, int passes, int width, int height) : passes(passes), tileOffsets(tiles.size()),
+		tilePasses(new std::atomic<int>[tiles.size()]), passTiles(new std::atomic<int>[passes]) {
+		size_t pixels = 0;
+		for (size_t t = 0; t < tiles.size(); t++) {
+			tileOffsets[t] = pixels;
+			pixels += size_t(tiles[t].width) * tiles[t].height;
+			tilePasses[t] = 0;
+		}
+		for (int p = 0; p < passes; p++) {
+			passTiles[p] = 0;
+		}
+		accumulation[0].resize(pixels);
+		accumulation[1].resize(pixels);
+		images[0].init(width, height);
+		images[1].init(width, height);
+	}
+};
+
+/// View of one frame of a sequence
+struct CameraPose {
+	float verticalFov;
+	vec3 lookFrom;
+	vec3 lookAt;
+};
+
+/// Frames of a sequence render in flight. Each frame renders into one of a few slots and a slot is reused once the
+/// frame in it is handed over, so tiles of the next frame are rendered while the last tiles of a frame finish
+struct FrameSequence {
+	static const int SlotCount = 2;
+
+	struct Slot {
+		/// Frame being rendered into the slot, tiles of later frames using it are not claimed until it is set to theirs
+		std::atomic<int> frame = -1;
+		std::atomic<int> tilesDone = 0;
+		Camera camera;
+		ImageData image;
+		/// 8 bit copy of the frame, empty if no image is written
+		std::vector<uint8_t> quantized;
+	};
+
+	std::vector<CameraPose> poses;
+	Slot slots[SlotCount];
+	/// Called by the step completing the last tile of a frame, must hand the frame over and prepare the slot for a later frame
+	std::function<void(int frame, Slot &slot)> onFrameRendered;
+};
+
+/// Renders one tile of the scene for each index of the range
+struct RenderTile {
+	Scene *scene = nullptr;
+	std::vector<Tile> tiles;
+	/// Number of pixels in a row traced as one packet
+	int packetSize = 8;
+	/// Seed of the random sequences, same seed renders the same image
+	uint64_t seed = 0;
+	/// Adaptive sampling of a tile starts with minSamples per pixel and doubles them while the tile's noise is above
+	/// noiseTarget, up to maxSamples. Without it every pixel takes the scene's samplesPerPixel
+	bool adaptive = false;
+	float noiseTarget = 0.f;
+	int minSamples = 1, maxSamples = 1;
+	/// Samples that adaptive sampling may still add above minSamples over the whole frame, shared by all slots
+	std::atomic<int64_t> *sampleBudget = nullptr;
+	/// Per slot buffers of sample sums and squared luminance sums, the tile is rendered there and copied into the frame
+	std::vector<std::vector<Color>> slotBuffers;
+	std::vector<std::vector<float>> slotLumSq;
+	/// Rays traced, samples taken and sum of the tiles' noise, for each slot
+	std::vector<TaskSystem::CacheLinePadded<uint64_t>> slotRays;
+	std::vector<TaskSystem::CacheLinePadded<uint64_t>> slotSamples;
+	std::vector<TaskSystem::CacheLinePadded<double>> slotNoise;
+	/// 8 bit RGB copy of the frame, top row first, filled while the tile is still in cache. Null if no image is written
+	uint8_t *quantized = nullptr;
+	/// Set for progressive renders, the range then has one index per tile and pass
+	ProgressiveFrame *progressive = nullptr;
+	/// Set for sequence renders, the range then has one index per frame and tile
+	FrameSequence *sequence = nullptr;
+	/// Average first hit albedo, gamma corrected like the frame, and normal of each pixel, top row first.
+	/// Null unless the frame is denoised
+	Color *albedo = nullptr;
+	vec3 *normal = nullptr;
+	std::vector<std::vector<Color>> slotAlbedo;
+	std::vector<std::vector<vec3>> slotNormal;
+	/// Executor rendering, checked for stop requests and used to publish snapshots
+	TaskSystem::Executor *executor = nullptr;
+
+	void operator()(int64_t idx, int threadIndex, int threadCount) {
+		if (progressive) {
+			renderPass(idx, threadIndex);
+			return;
+		}
+		if (sequence) {
+			renderSequenceTile(idx, threadIndex);
+			return;
+		}
+		renderTile(tiles[idx], scene->camera, scene->image, quantized, threadIndex);
+	}
+
+	/// Whether the tile of a progressive pass or of a sequence frame can be rendered without waiting, always true for
+	/// other renders. A tile that is not ready is not claimed, see ChunkedRange::ProcessReadyChunk
+	bool isReady(int64_t idx) const {
+		if (executor->IsStopRequested()) {
+			return true;
+		}
+		if (progressive) {
+			// A pass of the tile follows its previous pass and overwrites the frame of two passes ago, which must
+			// be published already
+			const int tileIndex = int(idx % int64_t(tiles.size()));
+			const int pass = int(idx / int64_t(tiles.size()));
+			return progressive->tilePasses[tileIndex].load(std::memory_order_acquire) >= pass &&
+				progressive->resolvedPasses.load(std::memory_order_acquire) >= pass - 1;
+		}
+		if (sequence) {
+			// The slot holds an earlier frame until the last tile of that frame is done and the frame is handed over
+			const int frame = int(idx / int64_t(tiles.size()));
+			return sequence->slots[frame % FrameSequence::SlotCount].frame.load(std::memory_order_acquire) == frame;
+		}
+		return true;
+	}
+
+	/// Render a tile seen from camera into image and, if not null, its 8 bit copy quantizedFrame
+	void renderTile(const Tile &tile, const Camera &camera, ImageData &image, uint8_t *quantizedFrame, int threadIndex) {
+		const int pixelCount = tile.width * tile.height;
+		std::vector<Color> &buffer = slotBuffers[threadIndex];
+		std::vector<float> &lumSq = slotLumSq[threadIndex];
+		buffer.assign(pixelCount, Color(0));
+		lumSq.assign(pixelCount, 0.f);
+		if (albedo) {
+			slotAlbedo[threadIndex].assign(pixelCount, Color(0));
+			slotNormal[threadIndex].assign(pixelCount, vec3(0));
+		}
+
+		int samples = adaptive ? minSamples : scene->samplesPerPixel;
+		renderSamples(tile, camera, 0, samples, threadIndex);
+		float noise = tileNoise(pixelCount, samples, threadIndex);
+		while (adaptive && samples < maxSamples && noise > noiseTarget) {
+			const int extra = reserveSamples(std::min(samples, maxSamples - samples), pixelCount);
+			if (extra == 0) {
+				break;
+			}
+			renderSamples(tile, camera, samples, samples + extra, threadIndex);
+			samples += extra;
+			noise = tileNoise(pixelCount, samples, threadIndex);
+		}
+		slotSamples[threadIndex].value += uint64_t(samples) * pixelCount;
+		slotNoise[threadIndex].value += noise;
+
+		for (int r = 0; r < tile.height; r++) {
+			const int y = scene->height - (tile.y + r) - 1;
+			for (int c = 0; c < tile.width; c++) {
+				Color pixel = buffer[r * tile.width + c];
+				pixel /= samples;
+				pixel = Color(sqrtf(pixel.x), sqrtf(pixel.y), sqrtf(pixel.z));
+				image(tile.x + c, y) = pixel;
+				if (albedo) {
+					const size_t index = size_t(y) * scene->width + tile.x + c;
+					Color pixelAlbedo = slotAlbedo[threadIndex][r * tile.width + c];
+					pixelAlbedo /= samples;
+					albedo[index] = Color(sqrtf(pixelAlbedo.x), sqrtf(pixelAlbedo.y), sqrtf(pixelAlbedo.z));
+					normal[index] = slotNormal[threadIndex][r * tile.width + c];
+					normal[index] /= samples;
+				}
+				if (quantizedFrame) {
+					uint8_t *out = quantizedFrame + (size_t(y) * scene->width + tile.x + c) * 3;
+					out[0] = quantize(pixel.x);
+					out[1] = quantize(pixel.y);
+					out[2] = quantize(pixel.z);
+				}
+			}
+		}
+	}
+
+	/// Render one tile of a frame of a sequence, idx is frame * tile count + tile. Only claimed once the frame has
+	/// its slot, see isReady. The step completing the last tile of a frame hands it over
+	void renderSequenceTile(int64_t idx, int threadIndex) {
+		const int frame = int(idx / int64_t(tiles.size()));
+		FrameSequence::Slot &slot = sequence->slots[frame % FrameSequence::SlotCount];
+		if (executor->IsStopRequested()) {
+			return;
+		}
+
+		renderTile(tiles[idx % int64_t(tiles.size())], slot.camera, slot.image, slot.quantized.empty() ? nullptr : slot.quantized.data(), threadIndex);
+		if (slot.tilesDone.fetch_add(1, std::memory_order_acq_rel) + 1 == int(tiles.size())) {
+			sequence->onFrameRendered(frame, slot);
+		}
+	}
+
+	/// Add one sample to every pixel of a tile and resolve the tile into the frame of the pass, idx is
+	/// pass * tile count + tile. Only claimed once the tile's previous pass is done, see isReady. The step completing
+	/// the last tile of a pass publishes it
+	void renderPass(int64_t idx, int threadIndex) {
+		ProgressiveFrame &frame = *progressive;
+		const int tileIndex = int(idx % int64_t(tiles.size()));
+		const int pass = int(idx / int64_t(tiles.size()));
+		const Tile &tile = tiles[tileIndex];
+		const int pixelCount = tile.width * tile.height;
+		if (executor->IsStopRequested()) {
+			return;
+		}
+
+		Color *sum = &frame.accumulation[pass % 2][frame.tileOffsets[tileIndex]];
+		if (pass == 0) {
+			std::fill(sum, sum + pixelCount, Color(0));
+		} else {
+			const Color *previous = &frame.accumulation[(pass + 1) % 2][frame.tileOffsets[tileIndex]];
+			std::copy(previous, previous + pixelCount, sum);
+		}
+		std::vector<float> &lumSq = slotLumSq[threadIndex];
+		lumSq.assign(pixelCount, 0.f);
+
+		uint64_t &rays = slotRays[threadIndex].value;
+		for (int r = 0; r < tile.height; r++) {
+			for (int c = 0; c < tile.width; c += packetSize) {
+				const int count = std::min(packetSize, tile.width - c);
+				scene->renderSpan(scene->camera, tile.y + r, tile.x + c, count, pass, pass + 1, sum + r * tile.width + c, &lumSq[r * tile.width + c],
+					nullptr, nullptr, seed, rays);
+			}
+		}
+		slotSamples[threadIndex].value += pixelCount;
+
+		// Resolved while the sums are in cache, the frame of the pass is complete once its last tile is
+		ImageData &image = frame.images[pass % 2];
+		for (int r = 0; r < tile.height; r++) {
+			const int y = scene->height - (tile.y + r) - 1;
+			for (int c = 0; c < tile.width; c++) {
+				Color pixel = sum[r * tile.width + c];
+				pixel /= pass + 1;
+				image(tile.x + c, y) = Color(sqrtf(pixel.x), sqrtf(pixel.y), sqrtf(pixel.z));
+			}
+		}
+
+		frame.tilePasses[tileIndex].store(pass + 1, std::memory_order_release);
+		if (frame.passTiles[pass].fetch_add(1, std::memory_order_acq_rel) + 1 == int(tiles.size())) {
+			publishPasses();
+		}
+	}
+
+	/// Publish completed passes in order. The frame of a pass is moved into the snapshot and replaced by a new
+	/// one for the pass after next, the frame of the last pass becomes the scene's image
+	void publishPasses() {
+		ProgressiveFrame &frame = *progressive;
+		// A later pass may complete while an earlier one is being published, whoever holds the lock publishes both
+		std::lock_guard<std::mutex> publishLock(frame.publishMutex);
+		for (int pass = frame.resolvedPasses.load(std::memory_order_relaxed);
+			pass < frame.passes && frame.passTiles[pass].load(std::memory_order_acquire) == int(tiles.size()); pass++) {
+			ImageData &image = frame.images[pass % 2];
+			if (pass + 1 == frame.passes) {
+				scene->image = std::move(image);
+			} else {
+				executor->PublishSnapshot(std::move(image), sizeof(Color) * scene->width * scene->height);
+				image.init(scene->width, scene->height);
+			}
+			frame.resolvedPasses.store(pass + 1, std::memory_order_release);
+		}
+	}
+
+	/// Add samples [firstSample, endSample) of every pixel of the tile seen from camera to the slot's buffers
+	void renderSamples(const Tile &tile, const Camera &camera, int firstSample, int endSample, int threadIndex) {
+		uint64_t &rays = slotRays[threadIndex].value;
+		for (int r = 0; r < tile.height; r++) {
+			for (int c = 0; c < tile.width; c += packetSize) {
+				const int count = std::min(packetSize, tile.width - c);
+				const int offset = r * tile.width + c;
+				scene->renderSpan(camera, tile.y + r, tile.x + c, count, firstSample, endSample, &slotBuffers[threadIndex][offset],
+					&slotLumSq[threadIndex][offset], albedo ? &slotAlbedo[threadIndex][offset] : nullptr,
+					albedo ? &slotNormal[threadIndex][offset] : nullptr, seed, rays);
+			}
+		}
+	}
+
+	/// Take up to extra samples per pixel for pixelCount pixels from sampleBudget, fewer if less is left. The budget
+	/// never goes below zero, so a refused tile does not take samples other tiles could still use
+	int reserveSamples(int extra, int pixelCount) const {
+		int64_t left = sampleBudget->load(std::memory_order_relaxed);
+		for (;;) {
+			const int granted = int(std::min<int64_t>(extra, left / pixelCount));
+			if (granted <= 0) {
+				return 0;
+			}
+			if (sampleBudget->compare_exchange_weak(left, left - int64_t(granted) * pixelCount, std::memory_order_relaxed)) {
+				return granted;
+			}
+		}
+	}
+
+	/// Mean over the tile's pixels of the standard error of the pixel's luminance relative to the luminance,
+	/// estimated from the samples in the slot's buffers. Dark pixels are measured relative to 0.05. Zero for one sample
+	float tileNoise(int pixelCount, int samples, int threadIndex) const {
+		if (samples < 2) {
+			return 0.f;
+		}
+		const std::vector<Color> &sum = slotBuffers[threadIndex];
+		const std::vector<float> &lumSq = slotLumSq[threadIndex];
+		float total = 0.f;
+		for (int i = 0; i < pixelCount; i++) {
+			const float mean = Scene::luminance(sum[i]) / samples;
+			const float variance = std::max(lumSq[i] / samples - mean * mean, 0.f) * samples / (samples - 1);
+			total += sqrtf(variance / samples) / (mean + 0.05f);
+		}
+		return total / pixelCount;
+	}
+
+	/// Clamp a gamma corrected component to [0, 1] and scale it to 8 bits
+	static uint8_t quantize(float value) {
+		return uint8_t(255.99f * std::clamp(value, 0.f, 1.f));
+	}
+};
+
+/// Parameters of the output stage, owns the quantized frame handed over by the renderer
+struct ImageOutputTask : TaskSystem::Task {
+	ImageOutputTask(const std::string &path, const std::string &format, int width, int height, std::vector<uint8_t> &&pixels)
+		: path(path), format(format), width(width), height(height), pixels(std::move(pixels)) {}
+
+	virtual std::optional<int> GetIntParam(const std::string &name) const override {
+		if (name == "width") {
+			return width;
+		} else if (name == "height") {
+			return height;
+		}
+		return std::nullopt;
+	}
+
+	virtual std::optional<std::string> GetStringParam(const std::string &name) const override {
+		if (name == "path") {
+			return path;
+		} else if (name == "format") {
+			return format;
+		}
+		return std::nullopt;
+	}
+
+	/// "pixels" is the 8 bit RGB frame, top row first
+	virtual std::optional<void *> GetAnyParam(const std::string &name) const override {
+		if (name == "pixels") {
+			return const_cast<uint8_t *>(pixels.data());
+		}
+		return std::nullopt;
+	}
+
+	virtual std::string GetExecutorName() const override {
+		return "imageOutput";
+	}
+
+	std::string path;
+	std::string format;
+	int width, height;
+	std::vector<uint8_t> pixels;
+};
 
-	virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) {
-		return scene.renderStep(threadIndex, threadCount) ? ExecStatus::ES_Stop : ExecStatus::ES_Continue;
+/// CRC-32 used by PNG chunks, crc of a previous call can be passed to continue it
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0) {
+	static const std::array<uint32_t, 256> table = [] {
+		std::array<uint32_t, 256> entries;
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			}
+			entries[n] = c;
+		}
+		return entries;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+uint8_t paethPredictor(int a, int b, int c) {
+	const int p = a + b - c;
+	const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return uint8_t(a);
+	}
+	return uint8_t(pb <= pc ? b : c);
+}
+
+/// Writes one strip of rows of the output image for each index of the range.
+/// PNG rows are filtered into the scanline buffer that is compressed once all strips are done,
+/// PPM rows are written straight to their place in the file
+struct WriteStrip {
+	enum Format {
+		PNG, PPM
 	};
 
-	std::atomic<int> current = 0;
-	int max = 0;
-	int sleepMs = 0;
-	Scene scene;
+	Format format = PNG;
+	std::string path;
+	int width = 0, height = 0;
+	int stripRows = 32;
+	const uint8_t *pixels = nullptr;
+	/// Filter type byte followed by the filtered row, for each row of a PNG
+	std::vector<uint8_t> scanlines;
+	/// Size of the PPM header, rows are written after it
+	size_t headerSize = 0;
+	/// Set by any strip that could not be written
+	std::atomic<bool> *failed = nullptr;
+
+	void operator()(int64_t idx, int threadIndex, int threadCount) {
+		const int first = int(idx) * stripRows;
+		const int last = std::min(first + stripRows, height);
+		const size_t rowSize = size_t(width) * 3;
+		if (format == PPM) {
+			// Each strip opens its own handle, strips cover disjoint parts of the file
+			FILE *file = fopen(path.c_str(), "r+b");
+			const bool written = file && fseek(file, long(headerSize + first * rowSize), SEEK_SET) == 0 &&
+				fwrite(pixels + first * rowSize, rowSize, last - first, file) == size_t(last - first);
+			if (file) {
+				fclose(file);
+			}
+			if (!written) {
+				*failed = true;
+			}
+			return;
+		}
+
+		for (int y = first; y < last; y++) {
+			filterRow(y, &scanlines[y * (rowSize + 1)]);
+		}
+	}
+
+	/// Pick the PNG filter with the smallest sum of absolute filtered values for the row, same heuristic as stb_image_write
+	void filterRow(int y, uint8_t *out) const {
+		const int rowSize = width * 3;
+		const uint8_t *row = pixels + size_t(y) * rowSize;
+		const uint8_t *prior = y > 0 ? row - rowSize : nullptr;
+		int bestFilter = 0;
+		int bestSum = INT32_MAX;
+		for (int filter = 0; filter < 5; filter++) {
+			int sum = 0;
+			for (int i = 0; i < rowSize; i++) {
+				sum += std::abs(int(int8_t(filterByte(filter, row, prior, i))));
+			}
+			if (sum < bestSum) {
+				bestSum = sum;
+				bestFilter = filter;
+			}
+		}
+		out[0] = uint8_t(bestFilter);
+		for (int i = 0; i < rowSize; i++) {
+			out[i + 1] = filterByte(bestFilter, row, prior, i);
+		}
+	}
+
+	/// Byte i of the row filtered with one of the five PNG filters, prior is null for the first row
+	static uint8_t filterByte(int filter, const uint8_t *row, const uint8_t *prior, int i) {
+		const int a = i >= 3 ? row[i - 3] : 0;
+		const int b = prior ? prior[i] : 0;
+		const int c = prior && i >= 3 ? prior[i - 3] : 0;
+		switch (filter) {
+		case 1: return uint8_t(row[i] - a);
+		case 2: return uint8_t(row[i] - b);
+		case 3: return uint8_t(row[i] - ((a + b) >> 1));
+		case 4: return uint8_t(row[i] - paethPredictor(a, b, c));
+		default: return row[i];
+		}
+	}
+};
+
+/// Output stage of the renderer, scheduled as its own task once a frame is rendered so the render task completes
+/// without waiting for the file. Strips of rows are filtered or written in parallel by all slots taking part
+struct ImageOutput : TaskSystem::ParallelRangeExecutor<WriteStrip> {
+	ImageOutput(std::unique_ptr<TaskSystem::Task> taskToExecute) : ParallelRangeExecutor(std::move(taskToExecute), 0, 0, 1, WriteStrip{}) {
+		body.path = task->GetStringParam("path").value();
+		body.format = task->GetStringParam("format").value_or("png") == "ppm" ? WriteStrip::PPM : WriteStrip::PNG;
+		body.width = task->GetIntParam("width").value();
+		body.height = task->GetIntParam("height").value();
+		body.pixels = static_cast<const uint8_t *>(task->GetAnyParam("pixels").value());
+		body.failed = &failed;
+		outputStart = std::chrono::steady_clock::now();
+
+		if (body.format == WriteStrip::PNG) {
+			body.scanlines.resize(size_t(body.height) * (size_t(body.width) * 3 + 1));
+		} else if (!createPPM()) {
+			// Empty range, the first step completes the task and reports the failure
+			failed = true;
+			return;
+		}
+		range.Reset(0, (body.height + body.stripRows - 1) / body.stripRows, 1);
+	}
+
+	virtual ~ImageOutput() {}
+
+protected:
+	/// Write the PPM header and size the file, so strips can write their rows in any order
+	bool createPPM() {
+		FILE *file = fopen(body.path.c_str(), "wb");
+		if (!file) {
+			return false;
+		}
+		const int header = fprintf(file, "P6\n%d %d\n255\n", body.width, body.height);
+		fclose(file);
+		if (header <= 0) {
+			return false;
+		}
+		body.headerSize = size_t(header);
+		std::error_code error;
+		std::filesystem::resize_file(body.path, body.headerSize + size_t(body.width) * body.height * 3, error);
+		return !error;
+	}
+
+	/// Compress the filtered scanlines and write the PNG chunks
+	bool writePNG() {
+		int compressedSize = 0;
+		unsigned char *compressed = stbi_zlib_compress(body.scanlines.data(), int(body.scanlines.size()), &compressedSize, 8);
+		FILE *file = compressed ? fopen(body.path.c_str(), "wb") : nullptr;
+		if (!file) {
+			STBIW_FREE(compressed);
+			return false;
+		}
+
+		const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		uint8_t header[13] = {};
+		putBigEndian(header, uint32_t(body.width));
+		putBigEndian(header + 4, uint32_t(body.height));
+		header[8] = 8; // bits per component
+		header[9] = 2; // RGB
+
+		bool written = fwrite(signature, sizeof(signature), 1, file) == 1;
+		written = written && writeChunk(file, "IHDR", header, sizeof(header));
+		written = written && writeChunk(file, "IDAT", compressed, uint32_t(compressedSize));
+		written = written && writeChunk(file, "IEND", nullptr, 0);
+		fclose(file);
+		STBIW_FREE(compressed);
+		return written;
+	}
+
+	static void putBigEndian(uint8_t *out, uint32_t value) {
+		out[0] = uint8_t(value >> 24);
+		out[1] = uint8_t(value >> 16);
+		out[2] = uint8_t(value >> 8);
+		out[3] = uint8_t(value);
+	}
+
+	static bool writeChunk(FILE *file, const char type[4], const uint8_t *data, uint32_t size) {
+		uint8_t length[4], crc[4];
+		putBigEndian(length, size);
+		putBigEndian(crc, crc32(data, size, crc32(reinterpret_cast<const uint8_t *>(type), 4)));
+		return fwrite(length, 4, 1, file) == 1 && fwrite(type, 4, 1, file) == 1 &&
+			(size == 0 || fwrite(data, size, 1, file) == 1) && fwrite(crc, 4, 1, file) == 1;
+	}
+
+	virtual void OnRangeComplete(int threadIndex, int threadCount) override {
+		// Deflate has to run over the whole image, it is the only part of the PNG output done by a single slot
+		if (body.format == WriteStrip::PNG && !failed && !writePNG()) {
+			failed = true;
+		}
+		const std::chrono::duration<double> outputTime = std::chrono::steady_clock::now() - outputStart;
+		if (failed) {
+			printf("Failed to write [%s]\n", body.path.c_str());
+		} else {
+			printf("Wrote [%s] in %.3fs\n", body.path.c_str(), outputTime.count());
+		}
+	}
+
+	std::atomic<bool> failed = false;
+	std::chrono::steady_clock::time_point outputStart;
+};
+
+/// Noisy frame and the feature buffers guiding its filter, the denoiser filters the image in place and publishes it
+struct DenoiseTask : TaskSystem::Task {
+	DenoiseTask(ImageData &&image, std::vector<Color> &&albedo, std::vector<vec3> &&normal, int iterations, double sigmaColor)
+		: image(std::move(image)), albedo(std::move(albedo)), normal(std::move(normal)), iterations(iterations), sigmaColor(sigmaColor) {}
+
+	virtual std::optional<int> GetIntParam(const std::string &name) const override {
+		if (name == "iterations") {
+			return iterations;
+		}
+		return std::nullopt;
+	}
+
+	virtual std::optional<double> GetDoubleParam(const std::string &name) const override {
+		if (name == "sigmaColor") {
+			return sigmaColor;
+		}
+		return std::nullopt;
+	}
+
+	/// "image" is the ImageData to filter, "albedo" and "normal" the per pixel features in the same layout
+	virtual std::optional<void *> GetAnyParam(const std::string &name) const override {
+		if (name == "image") {
+			return const_cast<ImageData *>(&image);
+		} else if (name == "albedo") {
+			return const_cast<Color *>(albedo.data());
+		} else if (name == "normal") {
+			return const_cast<vec3 *>(normal.data());
+		}
+		return std::nullopt;
+	}
+
+	virtual std::string GetExecutorName() const override {
+		return "denoise";
+	}
+
+	ImageData image;
+	std::vector<Color> albedo;
+	std::vector<vec3> normal;
+	int iterations;
+	double sigmaColor;
+};
+
+/// Planes of the denoiser, one float per pixel each
+struct DenoisePlanes {
+	const float *color[3];
+	const float *albedo[3];
+	const float *normal[3];
 };
 
-TaskSystem::Executor* ExecutorConstructorImpl(std::unique_ptr<TaskSystem::Task> taskToExecute) {
-	return new Renderer(std::move(taskToExecute));
+/// Add one tap of the edge stopping filter to count consecutive pixels starting at pixel, the tap of each pixel
+/// is tapOffset away. Weights fall off with the colour and albedo distance and with the angle between normals,
+/// both branch free so the loop is vectorized. Sums never overlap the planes, restrict saves the runtime alias checks
+RT_TARGET_CLONES
+void accumulateDenoiseTap(const DenoisePlanes &planes, size_t pixel, ptrdiff_t tapOffset, int count, float kernel, float invColor,
+                          float invAlbedo, float *__restrict sumR, float *__restrict sumG, float *__restrict sumB, float *__restrict sumW) {
+	const float *__restrict cr = planes.color[0] + pixel, *__restrict cg = planes.color[1] + pixel, *__restrict cb = planes.color[2] + pixel;
+	const float *__restrict ar = planes.albedo[0] + pixel, *__restrict ag = planes.albedo[1] + pixel, *__restrict ab = planes.albedo[2] + pixel;
+	const float *__restrict nx = planes.normal[0] + pixel, *__restrict ny = planes.normal[1] + pixel, *__restrict nz = planes.normal[2] + pixel;
+	for (int i = 0; i < count; i++) {
+		const float dr = cr[i + tapOffset] - cr[i], dg = cg[i + tapOffset] - cg[i], db = cb[i + tapOffset] - cb[i];
+		const float er = ar[i + tapOffset] - ar[i], eg = ag[i + tapOffset] - ag[i], eb = ab[i + tapOffset] - ab[i];
+		const float x = (dr * dr + dg * dg + db * db) * invColor + (er * er + eg * eg + eb * eb) * invAlbedo;
+		// exp(-x) approximated by the inverse of the cubic Taylor expansion of exp(x)
+		const float range = 1.f / (1.f + x * (1.f + x * (0.5f + x * (1.f / 6.f))));
+
+		// Normals are unit or zero for sky, the last term makes sky match only sky. Facing away is clamped to 0
+		// without a compare, which would keep the loop from being vectorized
+		const float qx = nx[i + tapOffset], qy = ny[i + tapOffset], qz = nz[i + tapOffset];
+		const float lenP = nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i];
+		const float lenQ = qx * qx + qy * qy + qz * qz;
+		float cosine = nx[i] * qx + ny[i] * qy + nz[i] * qz + (1.f - lenP) * (1.f - lenQ);
+		cosine = 0.5f * (cosine + fabsf(cosine));
+		// cosine^128 by repeated squaring
+		const float c2 = cosine * cosine, c4 = c2 * c2, c8 = c4 * c4, c16 = c8 * c8, c32 = c16 * c16, c64 = c32 * c32;
+
+		const float w = kernel * range * c64 * c64;
+		sumR[i] += w * cr[i + tapOffset];
+		sumG[i] += w * cg[i + tapOffset];
+		sumB[i] += w * cb[i + tapOffset];
+		sumW[i] += w;
+	}
 }
 
+/// Edge avoiding à-trous wavelet filter of a low sample frame, guided by the albedo and normal of the first hits.
+/// Colour is divided by albedo before filtering so texture detail is kept, and multiplied back after.
+/// Phases run one after the other, each a strip of rows per index: load the frame into planes, one phase per filter
+/// iteration with the taps spread twice as far as the previous one, and write the frame back. Index idx is strip
+/// idx % strips of phase idx / strips, the Denoiser only hands out strips of a phase once the previous one is complete
+struct DenoiseStrip {
+	/// Taps of the B3 spline kernel in each direction
+	static constexpr int Radius = 2;
+	/// Added to albedo before dividing so black surfaces do not blow up the colour
+	static constexpr float AlbedoEpsilon = 0.01f;
+
+	enum Plane {
+		ColorA = 0, ColorB = 3, Albedo = 6, Normal = 9, PlaneCount = 12
+	};
+
+	ImageData *image = nullptr;
+	const Color *albedo = nullptr;
+	const vec3 *normal = nullptr;
+	int width = 0, height = 0;
+	int stripRows = 16;
+	int strips = 0;
+	int iterations = 5;
+	/// Colour distance of the first iteration at which weights fall to about 1/e, halved every iteration
+	float sigmaColor = 0.5f;
+	float sigmaAlbedo = 0.1f;
+	/// PlaneCount planes of width * height floats. Iterations read from one colour plane set and write the other
+	std::vector<float> planes;
+
+	int phaseCount() const {
+		return iterations + 2;
+	}
+
+	/// Process a strip of a phase, sums holds width * 4 floats of scratch
+	void process(int64_t idx, float *sums) {
+		const int phase = int(idx / strips);
+		const int first = int(idx % strips) * stripRows;
+		const int last = std::min(first + stripRows, height);
+
+		if (phase == 0) {
+			load(first, last);
+		} else if (phase <= iterations) {
+			const int iteration = phase - 1;
+			const int source = iteration % 2 ? ColorB : ColorA;
+			const int target = iteration % 2 ? ColorA : ColorB;
+			const float sigma = sigmaColor / float(1 << iteration);
+			for (int y = first; y < last; y++) {
+				filterRow(y, 1 << iteration, source, target, 1.f / (sigma * sigma), sums);
+			}
+		} else {
+			store(first, last, iterations % 2 ? ColorB : ColorA);
+		}
+	}
+
+	float *plane(int index) {
+		return planes.data() + size_t(index) * width * height;
+	}
+
+	void load(int first, int last) {
+		for (int y = first; y < last; y++) {
+			for (int x = 0; x < width; x++) {
+				const size_t i = size_t(y) * width + x;
+				const Color &pixel = (*image)(x, y);
+				const Color &a = albedo[i];
+				const vec3 &n = normal[i];
+				plane(ColorA)[i] = pixel.x / (a.x + AlbedoEpsilon);
+				plane(ColorA + 1)[i] = pixel.y / (a.y + AlbedoEpsilon);
+				plane(ColorA + 2)[i] = pixel.z / (a.z + AlbedoEpsilon);
+				plane(Albedo)[i] = a.x;
+				plane(Albedo + 1)[i] = a.y;
+				plane(Albedo + 2)[i] = a.z;
+				// Averaged normals are shorter than unit where surfaces meet, the filter expects unit normals or zero for sky
+				const float length = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+				const float scale = length > 1e-3f ? 1.f / length : 0.f;
+				plane(Normal)[i] = n.x * scale;
+				plane(Normal + 1)[i] = n.y * scale;
+				plane(Normal + 2)[i] = n.z * scale;
+			}
+		}
+	}
+
+	void store(int first, int last, int source) {
+		for (int y = first; y < last; y++) {
+			for (int x = 0; x < width; x++) {
+				const size_t i = size_t(y) * width + x;
+				const Color &a = albedo[i];
+				(*image)(x, y) = Color(plane(source)[i] * (a.x + AlbedoEpsilon), plane(source + 1)[i] * (a.y + AlbedoEpsilon),
+					plane(source + 2)[i] * (a.z + AlbedoEpsilon));
+			}
+		}
+	}
+
+	/// Filter row y with taps step pixels apart. Columns whose taps are all inside the row are done in one run per tap,
+	/// columns at the borders clamp their taps one pixel at a time
+	void filterRow(int y, int step, int source, int target, float invColor, float *sums) {
+		static const float kernel[2 * Radius + 1] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+		std::fill(sums, sums + size_t(width) * 4, 0.f);
+		float *sumR = sums, *sumG = sumR + width, *sumB = sumG + width, *sumW = sumB + width;
+		const DenoisePlanes input = {
+			{ plane(source), plane(source + 1), plane(source + 2) },
+			{ plane(Albedo), plane(Albedo + 1), plane(Albedo + 2) },
+			{ plane(Normal), plane(Normal + 1), plane(Normal + 2) },
+		};
+		const float invAlbedo = 1.f / (sigmaAlbedo * sigmaAlbedo);
+		const int interiorBegin = std::min(Radius * step, width);
+		const int interiorEnd = std::max(width - Radius * step, interiorBegin);
+		const size_t row = size_t(y) * width;
+
+		for (int dy = -Radius; dy <= Radius; dy++) {
+			const ptrdiff_t rowOffset = (ptrdiff_t(std::clamp(y + dy * step, 0, height - 1)) - y) * width;
+			for (int dx = -Radius; dx <= Radius; dx++) {
+				const float weight = kernel[dy + Radius] * kernel[dx + Radius];
+				accumulateDenoiseTap(input, row + interiorBegin, rowOffset + dx * step, interiorEnd - interiorBegin, weight, invColor,
+					invAlbedo, sumR + interiorBegin, sumG + interiorBegin, sumB + interiorBegin, sumW + interiorBegin);
+				const auto border = [&](int x) {
+					const ptrdiff_t offset = rowOffset + std::clamp(x + dx * step, 0, width - 1) - x;
+					accumulateDenoiseTap(input, row + x, offset, 1, weight, invColor, invAlbedo, sumR + x, sumG + x, sumB + x, sumW + x);
+				};
+				for (int x = 0; x < interiorBegin; x++) {
+					border(x);
+				}
+				for (int x = interiorEnd; x < width; x++) {
+					border(x);
+				}
+			}
+		}
+
+		// The centre tap always has a positive weight
+		float *outR = plane(target) + row, *outG = plane(target + 1) + row, *outB = plane(target + 2) + row;
+		for (int x = 0; x < width; x++) {
+			const float inv = 1.f / sumW[x];
+			outR[x] = sumR[x] * inv;
+			outG[x] = sumG[x] * inv;
+			outB[x] = sumB[x] * inv;
+		}
+	}
+};
+
+/// Denoising stage of the renderer, scheduled by the render task for frames rendered with "denoise" and run by all
+/// slots taking part. Each phase is a range of its own, the step completing a phase releases the next one, so no
+/// step holds a strip while the previous phase finishes. Publishes the filtered ImageData
+struct Denoiser : TaskSystem::Executor {
+	Denoiser(std::unique_ptr<TaskSystem::Task> taskToExecute) : Executor(std::move(taskToExecute)) {
+		body.image = static_cast<ImageData *>(task->GetAnyParam("image").value());
+		body.albedo = static_cast<const Color *>(task->GetAnyParam("albedo").value());
+		body.normal = static_cast<const vec3 *>(task->GetAnyParam("normal").value());
+		body.width = body.image->width;
+		body.height = body.image->height;
+		body.iterations = std::max(task->GetIntParam("iterations").value_or(5), 0);
+		body.sigmaColor = float(task->GetDoubleParam("sigmaColor").value_or(0.5));
+		body.strips = (body.height + body.stripRows - 1) / body.stripRows;
+		body.planes.resize(size_t(DenoiseStrip::PlaneCount) * body.width * body.height);
+		// Planes and the frame, albedo and normal buffers handed over by the renderer
+		ReportMemory(body.planes.size() * sizeof(float) + size_t(body.width) * body.height * (2 * sizeof(Color) + sizeof(vec3)));
+		const int phases = body.phaseCount();
+		phaseRanges.reset(new TaskSystem::ChunkedRange[phases]);
+		for (int p = 0; p < phases; p++) {
+			phaseRanges[p].Reset(int64_t(body.strips) * p, int64_t(body.strips) * (p + 1), 1);
+		}
+		denoiseStart = std::chrono::steady_clock::now();
+	}
+
+	virtual ~Denoiser() {}
+
+	virtual ExecStatus ExecuteStep(TaskSystem::StepContext &context) override {
+		const int phases = body.phaseCount();
+		const int current = phase.load(std::memory_order_acquire);
+		if (current == phases) {
+			return ExecStatus::ES_Stop;
+		}
+
+		// Row sums only live for one strip, they come from the slot's step scratch instead of per-slot buffers
+		float *sums = context.Scratch().AllocateArray<float>(size_t(body.width) * 4);
+		const TaskSystem::ChunkedRange::ChunkStatus status = phaseRanges[current].ProcessChunk([this, sums](int64_t index) {
+			body.process(index, sums);
+		}, stepQuantum);
+
+		switch (status) {
+		case TaskSystem::ChunkedRange::CS_Continue:
+			return ExecStatus::ES_Continue;
+		case TaskSystem::ChunkedRange::CS_Completed:
+			// All strips of the phase are written, the next phase may read them
+			if (current + 1 < phases) {
+				phase.store(current + 1, std::memory_order_release);
+				return ExecStatus::ES_Continue;
+			}
+			onDenoised();
+			return ExecStatus::ES_Stop;
+		default:
+			if (current + 1 == phases) {
+				return ExecStatus::ES_Stop;
+			}
+			// The last strips of the phase are still processed by other steps. Nothing is claimed, the worker helps
+			// with spawned jobs or goes back to the task system until the phase is released
+			if (!taskSystem->StealJob()) {
+				std::this_thread::yield();
+			}
+			return ExecStatus::ES_Continue;
+		}
+	}
+
+protected:
+	void onDenoised() {
+		const std::chrono::duration<double> denoiseTime = std::chrono::steady_clock::now() - denoiseStart;
+		printf("Denoised %dx%d frame with %d iterations in %.3fs\n", body.width, body.height, body.iterations, denoiseTime.count());
+		PublishResult(std::move(*body.image), sizeof(Color) * body.width * body.height);
+	}
+
+	DenoiseStrip body;
+	/// Strips of each phase, handed out once the phase before is complete
+	std::unique_ptr<TaskSystem::ChunkedRange[]> phaseRanges;
+	/// Phase whose strips are handed out, phaseCount once all are done
+	std::atomic<int> phase = 0;
+	std::chrono::steady_clock::time_point denoiseStart;
+};
+
+struct Renderer : TaskSystem::ParallelRangeExecutor<RenderTile> {
+	Renderer(std::unique_ptr<TaskSystem::Task> taskToExecute) : ParallelRangeExecutor(std::move(taskToExecute), 0, 0, 1, RenderTile{}) {
+		// Reported before admission of other renders, the exact figure follows once the scene is prepared
+		ReportMemory(estimateFrameBytes());
+	}
+
+	virtual ~Renderer() {}
+
+	virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) override {
+		// Scene is prepared by the first step, the resource cache is reached through taskSystem which is set after construction
+		if (!sceneReady.load(std::memory_order_acquire)) {
+			bool expected = false;
+			if (!scenePreparing.compare_exchange_strong(expected, true)) {
+				// Nothing to render until the scene is built, help with the build jobs spawned by the preparing step
+				if (!taskSystem->StealJob()) {
+					std::this_thread::yield();
+				}
+				return ExecStatus::ES_Continue;
+			}
+			if (!prepareScene(threadCount)) {
+				// Another render is building the scene, any step may look again after helping with its build jobs
+				scenePreparing.store(false, std::memory_order_release);
+				if (!taskSystem->StealJob()) {
+					std::this_thread::yield();
+				}
+				return ExecStatus::ES_Continue;
+			}
+			sceneReady.store(true, std::memory_order_release);
+		}
+		if (!body.progressive && !body.sequence) {
+			return ParallelRangeExecutor::ExecuteStep(threadIndex, threadCount);
+		}
+
+		// Tiles of passes and frames depend on earlier ones, a tile is only claimed once it can be rendered
+		const TaskSystem::ChunkedRange::ChunkStatus status = range.ProcessReadyChunk([this](int64_t index) {
+			return body.isReady(index);
+		}, [this, threadIndex, threadCount](int64_t index) {
+			body(index, threadIndex, threadCount);
+		}, stepQuantum);
+		switch (status) {
+		case TaskSystem::ChunkedRange::CS_Continue:
+			return ExecStatus::ES_Continue;
+		case TaskSystem::ChunkedRange::CS_Completed:
+			OnRangeComplete(threadIndex, threadCount);
+			return ExecStatus::ES_Stop;
+		case TaskSystem::ChunkedRange::CS_Waiting:
+			// The next tile waits for the last tiles of an earlier pass or frame, the worker is not held by it
+			if (!taskSystem->StealJob()) {
+				std::this_thread::yield();
+			}
+			return ExecStatus::ES_Continue;
+		default:
+			return ExecStatus::ES_Stop;
+		}
+	}
+
+	virtual bool IsRecyclable() const override {
+		return true;
+	}
+
+	virtual void Reset(std::unique_ptr<TaskSystem::Task> taskToExecute) override {
+		ParallelRangeExecutor::Reset(std::move(taskToExecute));
+		ReportMemory(estimateFrameBytes());
+		scene.reset();
+		progressiveFrame.reset();
+		sequence.reset();
+		sceneReady = false;
+		scenePreparing = false;
+	}
+
+protected:
+	/// Frame buffers the task will need, from its parameters and the size of its scene. Slot buffers depend on the
+	/// thread count and are left out. 0 for an unknown scene
+	size_t estimateFrameBytes() const {
+		const auto found = sceneCreators.find(task->GetStringParam("sceneName").value_or(""));
+		if (found == sceneCreators.end()) {
+			return 0;
+		}
+		const size_t pixelCount = size_t(found->second.width) * found->second.height;
+		const bool writes = task->GetIntParam("writeImage").value_or(1) != 0;
+		const bool progressive = task->GetIntParam("progressive").value_or(0) != 0;
+		const bool sequence = task->GetIntParam("frames").value_or(1) > 1 && !progressive;
+		const size_t framePixels = pixelCount * (sequence ? FrameSequence::SlotCount : 1);
+		size_t bytes = sizeof(Scene) + framePixels * (sizeof(Color) + (writes ? 3 : 0));
+		if (task->GetIntParam("denoise").value_or(0) != 0 && !progressive && !sequence) {
+			bytes += pixelCount * (sizeof(Color) + sizeof(vec3));
+		}
+		if (progressive) {
+			// Accumulation buffers and resolved frames of even and odd passes
+			bytes += 4 * pixelCount * sizeof(Color);
+		}
+		return bytes;
+	}
+
+	/// Get the built scene from the cache, or build it, and set up the image and tiles for this task. Returns false
+	/// without waiting if another task is still building the scene
+	bool prepareScene(int threadCount) {
+		const std::string sceneName = task->GetStringParam("sceneName").value();
+		writeImage = task->GetIntParam("writeImage").value_or(1) != 0;
+		outputFormat = task->GetStringParam("outputFormat").value_or("png");
+
+		// Meshes and acceleration structures are built once per scene name and shared by all renders of it
+		std::shared_ptr<Scene> prototype;
+		const bool cached = taskSystem->GetResourceCache().TryGetOrCreate<Scene>("raytracer/scene/" + sceneName, [this, &sceneName](size_t &bytes) {
+			std::shared_ptr<Scene> built = std::make_shared<Scene>();
+			const SceneEntry &entry = sceneCreators.at(sceneName);
+			built->setImageSize(entry.width, entry.height, entry.samplesPerPixel);
+			entry.create(*built);
+			built->build(*taskSystem);
+			printf("Built scene [%s] in %.3fs, meshes loaded in %.3fs\n", built->name.c_str(), built->buildSeconds, built->meshLoadSeconds);
+			bytes = sizeof(Scene) + built->meshBytes;
+			return built;
+		}, prototype);
+		if (!cached) {
+			return false;
+		}
+
+		if (!prototype) {
+			printf("Unknown scene [%s]\n", sceneName.c_str());
+			writeImage = false;
+			range.Reset(0, 0, 1);
+			return true;
+		}
+
+		scene = std::make_unique<Scene>(*prototype);
+
+		// Tiles are claimed one per step, any number of slots can take part in rendering
+		const int tileSize = std::max(task->GetIntParam("tileSize").value_or(16), 1);
+		body.scene = scene.get();
+		body.tiles = makeTiles(scene->width, scene->height, tileSize);
+		body.slotBuffers.assign(threadCount, std::vector<Color>(tileSize * tileSize));
+		body.slotLumSq.assign(threadCount, std::vector<float>(tileSize * tileSize));
+		body.slotRays.assign(threadCount, TaskSystem::CacheLinePadded<uint64_t>{0});
+		body.slotSamples.assign(threadCount, TaskSystem::CacheLinePadded<uint64_t>{0});
+		body.slotNoise.assign(threadCount, TaskSystem::CacheLinePadded<double>{0});
+
+		// Adaptive sampling is enabled by a noise target, "sampleBudget" limits the average samples per pixel
+		body.noiseTarget = float(task->GetDoubleParam("noiseTarget").value_or(0.0));
+		body.adaptive = body.noiseTarget > 0.f;
+		body.minSamples = std::max(task->GetIntParam("minSamples").value_or(2), 2);
+		body.maxSamples = std::max(task->GetIntParam("maxSamples").value_or(4 * scene->samplesPerPixel), body.minSamples);
+		const int64_t pixelCount = int64_t(scene->width) * scene->height;
+		const int frames = std::max(task->GetIntParam("frames").value_or(1), 1);
+		const std::optional<int> budget = task->GetIntParam("sampleBudget");
+		sampleBudget = budget ? (int64_t(*budget) - body.minSamples) * pixelCount * frames : INT64_MAX / 2;
+		body.sampleBudget = &sampleBudget;
+		body.executor = this;
+
+		// Progressive rendering adds one sample per pixel to the whole frame per pass, "passes" defaults to the scene's spp
+		progressiveFrame.reset();
+		body.progressive = nullptr;
+		if (task->GetIntParam("progressive").value_or(0) != 0) {
+			const int passes = std::max(task->GetIntParam("passes").value_or(scene->samplesPerPixel), 1);
+			progressiveFrame = std::make_unique<ProgressiveFrame>(body.tiles, passes, scene->width, scene->height);
+			body.progressive = progressiveFrame.get();
+			body.adaptive = false;
+		}
+		// Denoising needs the first hit features of every pixel, progressive renders do not collect them
+		denoise = task->GetIntParam("denoise").value_or(0) != 0 && !body.progressive;
+		body.albedo = nullptr;
+		body.normal = nullptr;
+		if (denoise) {
+			albedo.assign(size_t(pixelCount), Color(0));
+			normal.assign(size_t(pixelCount), vec3(0));
+			body.albedo = albedo.data();
+			body.normal = normal.data();
+			body.slotAlbedo.assign(threadCount, std::vector<Color>(tileSize * tileSize));
+			body.slotNormal.assign(threadCount, std::vector<vec3>(tileSize * tileSize));
+		}
+		// A sequence renders "frames" views of the scene in one task, frames are handed over as they complete.
+		// Not combined with progressive rendering or denoising
+		sequence.reset();
+		body.sequence = nullptr;
+		if (frames > 1 && !body.progressive) {
+			denoise = false;
+			body.albedo = nullptr;
+			body.normal = nullptr;
+			sequence = std::make_unique<FrameSequence>();
+			sequence->poses = makeCameraPath(frames);
+			sequence->onFrameRendered = [this](int frame, FrameSequence::Slot &slot) {
+				completeFrame(frame, slot);
+			};
+			for (int frame = 0; frame < std::min(frames, FrameSequence::SlotCount); frame++) {
+				prepareFrameSlot(sequence->slots[frame], frame);
+			}
+			body.sequence = sequence.get();
+		} else {
+			scene->image.init(scene->width, scene->height);
+		}
+		body.packetSize = std::clamp(task->GetIntParam("packetSize").value_or(8), 1, RayPacket::MaxSize);
+		body.seed = uint64_t(task->GetIntParam("seed").value_or(0));
+		if (writeImage && !body.sequence) {
+			quantized.resize(size_t(scene->width) * scene->height * 3);
+		}
+		body.quantized = writeImage && !body.progressive && !denoise && !body.sequence ? quantized.data() : nullptr;
+		const int64_t rounds = body.progressive ? body.progressive->passes : body.sequence ? frames : 1;
+		range.Reset(0, int64_t(body.tiles.size()) * rounds, 1);
+
+		// Buffers of this render, the meshes are shared through the resource cache and counted there
+		const size_t framePixels = size_t(pixelCount) * (body.sequence ? FrameSequence::SlotCount : 1);
+		const size_t slotPixels = size_t(threadCount) * tileSize * tileSize;
+		size_t bytes = sizeof(Scene) + framePixels * (sizeof(Color) + (writeImage ? 3 : 0)) + slotPixels * (sizeof(Color) + sizeof(float));
+		bytes += albedo.capacity() * sizeof(Color) + normal.capacity() * sizeof(vec3);
+		if (body.albedo) {
+			bytes += slotPixels * (sizeof(Color) + sizeof(vec3));
+		}
+		if (progressiveFrame) {
+			bytes += 2 * (progressiveFrame->accumulation[0].size() + size_t(pixelCount)) * sizeof(Color);
+		}
+		ReportMemory(bytes);
+		renderStart = std::chrono::steady_clock::now();
+		printf("Initialized scene [%s]\n", scene->name.c_str());
+		return true;
+	}
+
+	/// Camera of each frame of a sequence. "cameraPath" points to 7 floats per frame: vertical fov, position and
+	/// target. Without it the scene's camera orbits its target by "orbitDegrees", a full turn by default
+	std::vector<CameraPose> makeCameraPath(int frames) const {
+		std::vector<CameraPose> poses(frames);
+		if (const std::optional<void *> path = task->GetAnyParam("cameraPath")) {
+			const float *values = static_cast<const float *>(*path);
+			for (int frame = 0; frame < frames; frame++) {
+				const float *pose = values + frame * 7;
+				poses[frame] = { pose[0], vec3(pose[1], pose[2], pose[3]), vec3(pose[4], pose[5], pose[6]) };
+			}
+			return poses;
+		}
+
+		const Camera &camera = scene->camera;
+		const float degrees = float(task->GetDoubleParam("orbitDegrees").value_or(360.0));
+		const vec3 offset = camera.origin - camera.target;
+		for (int frame = 0; frame < frames; frame++) {
+			const float angle = degToRad(degrees * frame / frames);
+			const float c = cosf(angle), s = sinf(angle);
+			const vec3 rotated(offset.x * c - offset.z * s, offset.y, offset.x * s + offset.z * c);
+			poses[frame] = { camera.verticalFov, camera.target + rotated, camera.target };
+		}
+		return poses;
+	}
+
+	/// Set up a slot for rendering frame, tiles of the frame start as soon as its number is stored
+	void prepareFrameSlot(FrameSequence::Slot &slot, int frame) {
+		const CameraPose &pose = sequence->poses[frame];
+		slot.camera.aspect = scene->camera.aspect;
+		slot.camera.lookAt(pose.verticalFov, pose.lookFrom, pose.lookAt);
+		slot.image.init(scene->width, scene->height);
+		if (writeImage) {
+			slot.quantized.resize(size_t(scene->width) * scene->height * 3);
+		}
+		slot.tilesDone.store(0, std::memory_order_relaxed);
+		slot.frame.store(frame, std::memory_order_release);
+	}
+
+	/// Hand a rendered frame of a sequence over and reuse its slot for the frame SlotCount later. The frame is written
+	/// by an output task that runs while the next frames render, if "outputPriority" is above the render task's
+	/// priority. "onFrame" points to a std::function<void(int, TaskSystem::TaskResult)> called with the frame number
+	/// and the frame's ImageData, from the step completing the frame. Frames usually complete in order but may not
+	void completeFrame(int frame, FrameSequence::Slot &slot) {
+		const int frames = int(sequence->poses.size());
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - renderStart;
+		printf("Rendered frame %d of %d [%s] at %.3fs\n", frame + 1, frames, scene->name.c_str(), elapsed.count());
+		if (writeImage) {
+			char suffix[16];
+			snprintf(suffix, sizeof(suffix), "_%04d", frame);
+			const std::string path = scene->name + suffix + (outputFormat == "ppm" ? ".ppm" : ".png");
+			taskSystem->ScheduleTask(std::make_unique<ImageOutputTask>(path, outputFormat, scene->width, scene->height, std::move(slot.quantized)),
+				task->GetIntParam("outputPriority").value_or(0));
+			slot.quantized.clear();
+		}
+
+		// The last frame stays in its slot and is published as the task's result
+		const size_t bytes = sizeof(Color) * scene->width * scene->height;
+		const bool last = frame == frames - 1;
+		const std::optional<void *> onFrame = task->GetAnyParam("onFrame");
+		if (onFrame) {
+			TaskSystem::TaskResult result = last ? TaskSystem::TaskResult::Make(ImageData(slot.image), bytes) :
+				TaskSystem::TaskResult::Make(std::move(slot.image), bytes);
+			(*static_cast<std::function<void(int, TaskSystem::TaskResult)> *>(*onFrame))(frame, std::move(result));
+		}
+		if (frame + FrameSequence::SlotCount < frames) {
+			prepareFrameSlot(slot, frame + FrameSequence::SlotCount);
+		}
+	}
+
+	virtual void OnRangeComplete(int threadIndex, int threadCount) override {
+		if (!scene) {
+			return;
+		}
+		// A stopped progressive render keeps the frame of the last published pass
+		if (body.progressive && body.progressive->resolvedPasses.load() < body.progressive->passes) {
+			if (const ImageData *last = GetSnapshot().Get<ImageData>()) {
+				scene->image = *last;
+			}
+		}
+
+		uint64_t rays = 0, samples = 0;
+		double noise = 0;
+		for (int c = 0; c < int(body.slotRays.size()); c++) {
+			rays += body.slotRays[c].value;
+			samples += body.slotSamples[c].value;
+			noise += body.slotNoise[c].value;
+		}
+		const std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+
+		// Checksum of the frame, equal between runs that render the same image. For sequences, of the last frame
+		ImageData &image = body.sequence ? sequence->slots[(sequence->poses.size() - 1) % FrameSequence::SlotCount].image : scene->image;
+		uint32_t checksum = 2166136261u;
+		for (int y = 0; y < image.height; y++) {
+			for (int x = 0; x < image.width; x++) {
+				const Color &pixel = image(x, y);
+				for (const float component : { pixel.x, pixel.y, pixel.z }) {
+					uint32_t bits;
+					memcpy(&bits, &component, sizeof(bits));
+					checksum = (checksum ^ bits) * 16777619u;
+				}
+			}
+		}
+		// Noise is the mean of the tiles' relative standard error, comparable between fixed and adaptive sampling.
+		// Progressive renders do not estimate it
+		const int frames = body.sequence ? int(sequence->poses.size()) : 1;
+		const double pixelCount = double(scene->width) * scene->height * frames;
+		printf("Rendered [%s] %llu rays in %.3fs, %.2f Mrays/s, %.2f spp, noise %.4f, checksum %08x\n", scene->name.c_str(),
+			(unsigned long long)rays, renderTime.count(), rays / renderTime.count() / 1e6, samples / pixelCount,
+			noise / (body.tiles.size() * frames), checksum);
+
+		if (body.sequence) {
+			printf("Sequence [%s] rendered %d frames, %.2f frames/s\n", scene->name.c_str(), frames, frames / renderTime.count());
+			PublishResult(std::move(image), sizeof(Color) * scene->width * scene->height);
+			return;
+		}
+
+		if (body.progressive) {
+			printf("Progressive [%s] resolved %d of %d passes\n", scene->name.c_str(), body.progressive->resolvedPasses.load(), body.progressive->passes);
+		}
+
+		if (denoise) {
+			// The filter reaches across tiles, so it runs as its own task once the frame is complete. This slot helps
+			// running it while waiting, the other slots pick it up as soon as they are out of tiles
+			const int iterations = task->GetIntParam("denoiseIterations").value_or(5);
+			const double sigmaColor = task->GetDoubleParam("denoiseSigmaColor").value_or(0.5);
+			const TaskSystem::TaskSystemExecutor::TaskID denoiseTask = taskSystem->ScheduleTask(std::make_unique<DenoiseTask>(
+				std::move(scene->image), std::move(albedo), std::move(normal), iterations, sigmaColor), 0);
+			taskSystem->WaitForTask(denoiseTask);
+			std::unique_ptr<ImageData> denoised = taskSystem->TakeResult(denoiseTask).Take<ImageData>();
+			if (denoised) {
+				scene->image = std::move(*denoised);
+			}
+		}
+
+		if (writeImage && !body.quantized) {
+			// The frame is final only once the last pass is resolved or it is denoised, so it is quantized here instead of in the tiles
+			for (int y = 0; y < scene->height; y++) {
+				for (int x = 0; x < scene->width; x++) {
+					const Color &pixel = scene->image(x, y);
+					uint8_t *out = &quantized[(size_t(y) * scene->width + x) * 3];
+					out[0] = RenderTile::quantize(pixel.x);
+					out[1] = RenderTile::quantize(pixel.y);
+					out[2] = RenderTile::quantize(pixel.z);
+				}
+			}
+		}
+
+		if (writeImage) {
+			// Encoding and writing the file is a separate task, the frame is available as soon as rendering is done
+			const std::string path = scene->name + (outputFormat == "ppm" ? ".ppm" : ".png");
+			taskSystem->ScheduleTask(std::make_unique<ImageOutputTask>(path, outputFormat, scene->width, scene->height, std::move(quantized)), 0);
+			quantized.clear();
+		}
+		// Hand the frame over to the task system, ImageData is moved and not copied
+		PublishResult(std::move(scene->image), sizeof(Color) * scene->width * scene->height);
+	}
+
+	/// Schedule an ImageOutput task writing <scene name>.<outputFormat> when rendering completes, result is published either way
+	bool writeImage = true;
+	/// "png" or "ppm", PPM is uncompressed and written by all slots in parallel
+	std::string outputFormat;
+	/// 8 bit frame filled by the tiles, moved into the output task
+	std::vector<uint8_t> quantized;
+	/// Run the frame through the Denoiser before publishing and writing it, see RenderTile::albedo
+	bool denoise = false;
+	std::vector<Color> albedo;
+	std::vector<vec3> normal;
+	/// Samples adaptive sampling may add over the frame, see RenderTile::sampleBudget
+	std::atomic<int64_t> sampleBudget = 0;
+	/// Accumulation buffers of a progressive render
+	std::unique_ptr<ProgressiveFrame> progressiveFrame;
+	/// Frames in flight of a sequence render
+	std::unique_ptr<FrameSequence> sequence;
+	std::unique_ptr<Scene> scene;
+	std::chrono::steady_clock::time_point renderStart;
+	std::atomic<bool> sceneReady = false;
+	/// Set by the step preparing the scene, other steps return until it is ready
+	std::atomic<bool> scenePreparing = false;
+};
+
+#ifdef TS_STATIC_EXECUTORS
+IMPLEMENT_EXECUTOR("RaytracerExecutor", "raytracer", Renderer);
+IMPLEMENT_EXECUTOR("RaytracerExecutor", "imageOutput", ImageOutput);
+IMPLEMENT_EXECUTOR("RaytracerExecutor", "denoise", Denoiser);
+#else
 IMPLEMENT_ON_INIT() {
-	ts.Register("raytracer", &ExecutorConstructorImpl);
+	ts.RegisterExecutor<Renderer>("raytracer");
+	ts.RegisterExecutor<ImageOutput>("imageOutput");
+	ts.RegisterExecutor<Denoiser>("denoise");
 }
+#endif
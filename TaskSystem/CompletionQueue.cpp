@@ -0,0 +1,104 @@
+#include "CompletionQueue.h"
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#elif !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#include <fcntl.h>
+#define USE_PIPE
+#endif
+
+namespace TaskSystem {
+
+	CompletionQueue::CompletionQueue() {
+#if defined(__linux__)
+		readFd = writeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif defined(USE_PIPE)
+		int fds[2];
+		if (pipe(fds) == 0) {
+			for (int fd : fds) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+			}
+			readFd = fds[0];
+			writeFd = fds[1];
+		}
+#endif
+	}
+
+	CompletionQueue::~CompletionQueue() {
+		Node* node = head.exchange(nullptr);
+		while (node) {
+			Node* next = node->next;
+			delete node;
+			node = next;
+		}
+#if !defined(_WIN32) && !defined(_WIN64)
+		if (readFd != -1) {
+			close(readFd);
+		}
+		if (writeFd != -1 && writeFd != readFd) {
+			close(writeFd);
+		}
+#endif
+	}
+
+	void CompletionQueue::Push(const Completion& completion) {
+		Node* node = new Node{ completion, head.load(std::memory_order_relaxed) };
+		while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+			;
+
+		// Consumer is woken once per batch, when the first completion lands in an empty queue
+		if (!node->next) {
+			signal();
+		}
+	}
+
+	size_t CompletionQueue::Drain(std::vector<Completion>& out) {
+		clearSignal();
+
+		Node* node = head.exchange(nullptr, std::memory_order_acquire);
+
+		// Reverse the list to restore push order
+		Node* oldest = nullptr;
+		while (node) {
+			Node* next = node->next;
+			node->next = oldest;
+			oldest = node;
+			node = next;
+		}
+
+		size_t count = 0;
+		while (oldest) {
+			Node* next = oldest->next;
+			out.push_back(oldest->completion);
+			delete oldest;
+			oldest = next;
+			count++;
+		}
+		return count;
+	}
+
+	void CompletionQueue::signal() {
+#if defined(__linux__)
+		const uint64_t one = 1;
+		(void)!write(writeFd, &one, sizeof(one));
+#elif defined(USE_PIPE)
+		const char one = 1;
+		(void)!write(writeFd, &one, sizeof(one));
+#endif
+	}
+
+	void CompletionQueue::clearSignal() {
+#if defined(__linux__)
+		uint64_t value;
+		(void)!read(readFd, &value, sizeof(value));
+#elif defined(USE_PIPE)
+		char buffer[64];
+		while (read(readFd, buffer, sizeof(buffer)) > 0)
+			;
+#endif
+	}
+};
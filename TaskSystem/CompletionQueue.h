@@ -0,0 +1,76 @@
+#pragma once
+
+#include "TaskSystem.h"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace TaskSystem {
+
+	/**
+	 * @brief Queue of finished tasks meant to be polled from an event loop. Any number of worker threads push
+	 *        completions without locks, a single consumer drains them in batches. On POSIX systems the queue owns
+	 *        a file descriptor that becomes readable when completions are available (eventfd on Linux, a pipe elsewhere)
+	 *
+	 */
+	struct CompletionQueue {
+		enum CompletionStatus {
+			CS_Completed, CS_DeadlineMissed, CS_Failed
+		};
+
+		struct Completion {
+			TaskSystemExecutor::TaskID id;
+			CompletionStatus status;
+			std::chrono::steady_clock::time_point scheduled;
+			std::chrono::steady_clock::time_point started;
+			std::chrono::steady_clock::time_point completed;
+			/// Most memory reported by the task's executor
+			size_t peakMemoryBytes = 0;
+		};
+
+		CompletionQueue();
+		~CompletionQueue();
+
+		CompletionQueue(const CompletionQueue&) = delete;
+		CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+		/**
+		 * @brief Add a completion, safe to call from any thread. Signals the file descriptor only when the queue was empty
+		 *
+		 * @param completion the completion to add
+		 */
+		void Push(const Completion& completion);
+
+		/**
+		 * @brief Take all queued completions in the order they were pushed. Must be called from a single consumer thread.
+		 *        Resets the file descriptor before taking the completions, so nothing pushed afterwards is missed
+		 *
+		 * @param out vector to append completions to
+		 * @return number of completions appended
+		 */
+		size_t Drain(std::vector<Completion>& out);
+
+		/**
+		 * @brief File descriptor to register in epoll/poll for reading, -1 when not supported on the platform
+		 *
+		 */
+		int GetFd() const {
+			return readFd;
+		}
+
+	private:
+		struct Node {
+			Completion completion;
+			Node* next;
+		};
+
+		void signal();
+		void clearSignal();
+
+		/// Most recently pushed completion, completions are linked from newest to oldest
+		std::atomic<Node*> head = nullptr;
+		int readFd = -1;
+		int writeFd = -1;
+	};
+};
@@ -1,10 +1,101 @@
 #pragma once
 
 #include "Task.h"
+#include "TaskResult.h"
+#include "ScratchArena.h"
 
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
 namespace TaskSystem {
 
+struct TaskSystemExecutor;
+
+/**
+ * @brief Bytes held by a task, by all tasks of an executor name or by all tasks of the task system, and the peak
+ *        reached. Changes are added to the parent counter as well
+ *
+ */
+struct MemoryCounter {
+    std::atomic<int64_t> bytes = 0;
+    std::atomic<int64_t> peakBytes = 0;
+    MemoryCounter *parent = nullptr;
+
+    void Add(int64_t delta) {
+        const int64_t current = bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+        int64_t peak = peakBytes.load(std::memory_order_relaxed);
+        while (current > peak && !peakBytes.compare_exchange_weak(peak, current, std::memory_order_relaxed))
+            ;
+        if (parent) {
+            parent->Add(delta);
+        }
+    }
+
+    /**
+     * @brief Start adding changes to newParent, which gets the bytes already held. They are taken back from the
+     *        previous parent, a recycled executor may report memory before it is attached again
+     *
+     */
+    void Attach(MemoryCounter *newParent) {
+        const int64_t held = bytes.load(std::memory_order_relaxed);
+        if (parent) {
+            parent->Add(-held);
+        }
+        parent = newParent;
+        parent->Add(held);
+    }
+};
+
+/**
+ * @brief Slot and scratch memory of a step, passed to Executor::ExecuteStep(StepContext &)
+ *
+ */
+struct StepContext {
+    StepContext(int threadIndex, int threadCount, ScratchArena &scratch, std::unique_ptr<ScratchArena> &taskScratch, ScratchArenaPool *pool = nullptr)
+        : threadIndex(threadIndex), threadCount(threadCount), scratch(scratch), taskScratch(taskScratch), pool(pool) {}
+
+    /**
+     * @brief Arena of the slot for temporaries of this step, rewound when the step returns
+     *
+     */
+    ScratchArena &Scratch() {
+        return scratch;
+    }
+
+    /**
+     * @brief Arena of the task on this slot, kept between steps with the same threadIndex and reset once the task
+     *        has completed. Taken from the pool of finished tasks on first use
+     *
+     */
+    ScratchArena &TaskScratch() {
+        if (!taskScratch) {
+            taskScratch = pool ? pool->Acquire() : std::make_unique<ScratchArena>();
+        }
+        return *taskScratch;
+    }
+
+    /**
+     * @brief Per-slot state of the task, default constructed by the first step on the slot and destroyed when the task
+     *        has completed. Replaces vectors of per-slot buffers sized by threadCount
+     *
+     */
+    template <typename T>
+    T &TaskLocal() {
+        return TaskScratch().Local<T>();
+    }
+
+    const int threadIndex;
+    const int threadCount;
+
+private:
+    ScratchArena &scratch;
+    std::unique_ptr<ScratchArena> &taskScratch;
+    ScratchArenaPool *pool;
+};
 
 /**
  * @brief Base class for task executor. Should be inherited in executor plugins
@@ -20,15 +111,146 @@ struct Executor {
 
     /**
      * @brief Execute a small step of the task, on a given thread. TaskSystem is allowed to call this method multiple times
-     *        even after it has returned ES_Stop once
+     *        even after it has returned ES_Stop once. The task is finished once a step has returned ES_Stop and all
+     *        steps still executing have returned.
+     *        Slots in [0, threadCount - 1] include helper slots of threads waiting for tasks, so executors must not
+     *        expect every threadIndex to be stepped. Steps with the same threadIndex never run concurrently.
      *
      * @param threadIndex the current thread index, in range [0, threadCount - 1]
-     * @param threadCount the total number of threads running
+     * @param threadCount the total number of slots that can execute steps
      * @return ExecStatus return ES_Stop when task is finished, returns ES_Continue otherwise
      */
-    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) = 0;
+    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) {
+        throw std::logic_error("Executor does not override an ExecuteStep overload");
+    }
+
+    /**
+     * @brief Execute a step with access to scratch memory of the slot, the task system steps executors through this
+     *        overload. Executors override either this one or ExecuteStep(threadIndex, threadCount), which is called by default
+     *
+     */
+    virtual ExecStatus ExecuteStep(StepContext &context) {
+        return ExecuteStep(context.threadIndex, context.threadCount);
+    }
+
+    /**
+     * @brief Publish the result of the task, retrieved by TaskSystemExecutor::TakeResult once the task has finished.
+     *        Must be called from a step before the task finishes. Pass large values as rvalues to avoid copies
+     *
+     * @param value the result value
+     * @param bytes approximate memory used by the value, including buffers it owns
+     */
+    template <typename T>
+    void PublishResult(T &&value, size_t bytes = sizeof(std::decay_t<T>)) {
+        result = TaskResult::Make(std::forward<T>(value), bytes);
+    }
+
+    /**
+     * @brief Publish an intermediate result while the task keeps running, read by TaskSystemExecutor::GetSnapshot.
+     *        Replaces the previous snapshot, readers that already got it keep it alive. May be called from any step
+     *
+     * @param value the snapshot value, should not be changed once published
+     * @param bytes approximate memory used by the value, including buffers it owns
+     */
+    template <typename T>
+    void PublishSnapshot(T &&value, size_t bytes = sizeof(std::decay_t<T>)) {
+        TaskResult published = TaskResult::Make(std::forward<T>(value), bytes);
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        snapshot = std::move(published);
+    }
+
+    /**
+     * @brief Get the latest snapshot, sharing its value
+     *
+     */
+    TaskResult GetSnapshot() {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        return snapshot;
+    }
+
+    /**
+     * @brief Ask the executor to finish early, set by TaskSystemExecutor::RequestStop. Executors supporting it check
+     *        IsStopRequested between units of work and publish what they have, others ignore it
+     *
+     */
+    void RequestStop() {
+        stopRequested = true;
+    }
+
+    bool IsStopRequested() const {
+        return stopRequested.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Report the memory the task holds now, e.g. its frame buffers, replacing the previous report. May be
+     *        called from the constructor and from steps. The task system counts it against its memory budget,
+     *        attributes it to the executor name and records the peak of each task
+     *
+     * @param bytes approximate memory held by the executor for this task
+     */
+    void ReportMemory(size_t bytes) {
+        memory.Add(int64_t(bytes) - reportedBytes.exchange(int64_t(bytes), std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief Return true if a finished executor can be reused with Reset for another task of the same executor name,
+     *        instead of constructing a new executor. Executors are not recycled by default
+     *
+     */
+    virtual bool IsRecyclable() const {
+        return false;
+    }
+
+    /**
+     * @brief Prepare a finished, recyclable executor for another task. Overrides must call the base implementation
+     *        and bring the executor to the same state a newly constructed one would have
+     *
+     * @param taskToExecute the next task
+     */
+    virtual void Reset(std::unique_ptr<Task> taskToExecute) {
+        task = std::move(taskToExecute);
+        result = TaskResult();
+        {
+            std::lock_guard<std::mutex> lock(snapshotMutex);
+            snapshot = TaskResult();
+        }
+        stopRequested = false;
+        ReportMemory(0);
+        memory.peakBytes = 0;
+    }
 
     std::unique_ptr<Task> task;
+
+    /**
+     * @brief Result published by the executor, moved out by the task system when the task finishes
+     *
+     */
+    TaskResult result;
+
+    /**
+     * @brief The task system executing this executor, set before the first step. Can be used to spawn jobs from steps
+     *
+     */
+    TaskSystemExecutor *taskSystem = nullptr;
+
+    /**
+     * @brief Time a step should take, set by the task system before the first step, 0 if not set. Executors splitting
+     *        work into steps size them from it, so workers look for higher priority work about this often
+     *
+     */
+    std::chrono::nanoseconds stepQuantum{ 0 };
+
+    /**
+     * @brief Memory reported by this executor, attached to the counter of its executor name by the task system
+     *
+     */
+    MemoryCounter memory;
+
+private:
+    std::atomic<int64_t> reportedBytes = 0;
+    std::mutex snapshotMutex;
+    TaskResult snapshot;
+    std::atomic<bool> stopRequested = false;
 };
 
 /**
@@ -38,6 +260,87 @@ struct Executor {
 typedef Executor*(*ExecutorConstructor)(std::unique_ptr<Task> taskToExecute);
 struct TaskSystemExecutor;
 
+/**
+ * @brief Function executing a step of an executor, resolved once when the executor is registered
+ *
+ */
+typedef Executor::ExecStatus(*ExecutorStepFunction)(Executor &exec, StepContext &context);
+
+/**
+ * @brief Constructor of an executor with known type
+ *
+ */
+template <typename T>
+Executor *ConstructExecutor(std::unique_ptr<Task> taskToExecute) {
+    return new T(std::move(taskToExecute));
+}
+
+template <typename C>
+C StepContextOverrider(Executor::ExecStatus (C::*)(StepContext &));
+
+/**
+ * @brief True if T overrides ExecuteStep(StepContext &), false if it only has the default of Executor or hides it
+ *
+ */
+template <typename T, typename = void>
+struct OverridesStepContext : std::false_type {};
+
+template <typename T>
+struct OverridesStepContext<T, std::void_t<decltype(StepContextOverrider(&T::ExecuteStep))>>
+    : std::bool_constant<!std::is_same_v<decltype(StepContextOverrider(&T::ExecuteStep)), Executor>> {};
+
+/**
+ * @brief Step of an executor with known type. The call is not virtual, so the step can be inlined into the thunk.
+ *        Executors that don't use the step context are called with ExecuteStep(threadIndex, threadCount) directly
+ *
+ */
+template <typename T>
+Executor::ExecStatus ExecuteStepOf(Executor &exec, StepContext &context) {
+    if constexpr (OverridesStepContext<T>::value) {
+        return static_cast<T &>(exec).T::ExecuteStep(context);
+    } else {
+        return static_cast<T &>(exec).T::ExecuteStep(context.threadIndex, context.threadCount);
+    }
+}
+
+/**
+ * @brief Step through the virtual ExecuteStep, used for executors registered only with a constructor
+ *
+ */
+inline Executor::ExecStatus ExecuteStepVirtual(Executor &exec, StepContext &context) {
+    return exec.ExecuteStep(context);
+}
+
+/**
+ * @brief Executor linked into the application instead of being loaded from a dynamic library.
+ *        Registrations are static objects, collected in a list before main runs
+ *
+ */
+struct StaticExecutorRegistration {
+    StaticExecutorRegistration(const char *libraryName, const char *executorName, ExecutorConstructor constructor, ExecutorStepFunction step)
+        : libraryName(libraryName), executorName(executorName), constructor(constructor), step(step), next(First()) {
+        First() = this;
+    }
+
+    /**
+     * @brief Head of the list of all static registrations
+     *
+     */
+    static StaticExecutorRegistration *&First() {
+        static StaticExecutorRegistration *first = nullptr;
+        return first;
+    }
+
+    /**
+     * @brief Name of the library the executor is otherwise loaded from, as passed to TS_LOAD_LIBARY
+     *
+     */
+    const char *libraryName;
+    const char *executorName;
+    ExecutorConstructor constructor;
+    ExecutorStepFunction step;
+    StaticExecutorRegistration *next;
+};
 
 };
 
@@ -55,3 +358,20 @@ typedef void (*OnLibraryInitPtr)(TaskSystem::TaskSystemExecutor &);
 #endif
 
 #define IMPLEMENT_ON_INIT() extern "C" DLL_EXPORT void OnLibraryInit(TaskSystem::TaskSystemExecutor &ts)
+
+/**
+ * @brief Define the executor of a library. Registers the executor from OnLibraryInit when built as a dynamic library,
+ *        and as a static registration when built with TS_STATIC_EXECUTORS and linked into the application.
+ *        Steps are executed with ExecuteStepOf<ExecutorType> in both cases
+ *
+ */
+#ifdef TS_STATIC_EXECUTORS
+#define IMPLEMENT_EXECUTOR(libraryName, executorName, ExecutorType) \
+    static TaskSystem::StaticExecutorRegistration staticRegistration##ExecutorType(libraryName, executorName, \
+        &TaskSystem::ConstructExecutor<ExecutorType>, &TaskSystem::ExecuteStepOf<ExecutorType>)
+#else
+#define IMPLEMENT_EXECUTOR(libraryName, executorName, ExecutorType) \
+    IMPLEMENT_ON_INIT() { \
+        ts.Register(executorName, &TaskSystem::ConstructExecutor<ExecutorType>, &TaskSystem::ExecuteStepOf<ExecutorType>); \
+    }
+#endif
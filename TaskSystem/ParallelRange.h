@@ -0,0 +1,279 @@
+#pragma once
+
+#include "Executor.h"
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+namespace TaskSystem {
+
+/**
+ * @brief Size used to pad shared counters so that they don't share a cache line
+ *
+ */
+const size_t CacheLineSize = 64;
+
+template <typename T>
+struct alignas(CacheLineSize) CacheLinePadded {
+    T value;
+};
+
+/**
+ * @brief Range of indices processed in chunks claimed from an atomic counter. Detects which chunk completes the range.
+ *        Chunks have grainSize indices, or when a quantum is passed to ProcessChunk, as many as are measured to take
+ *        about that long, at least one and at most a 64th of the range
+ *
+ */
+struct ChunkedRange {
+    enum ChunkStatus {
+        CS_Continue, ///< a chunk was processed, more work may be left
+        CS_Exhausted, ///< no chunk left to claim, other steps may still be processing theirs
+        CS_Completed, ///< the processed chunk was the last one to finish, the whole range is done
+        CS_Waiting ///< the next index is not ready to be processed, nothing was claimed
+    };
+
+    ChunkedRange(int64_t begin = 0, int64_t end = 0, int64_t grainSize = 1) {
+        Reset(begin, end, grainSize);
+    }
+
+    /**
+     * @brief Change the range, not allowed while chunks are being processed
+     *
+     */
+    void Reset(int64_t begin, int64_t end, int64_t grainSize) {
+        this->begin = begin;
+        this->end = std::max(begin, end);
+        this->grainSize = std::max<int64_t>(grainSize, 1);
+        next.value = begin;
+        completed.value = 0;
+        emptyCompleted = false;
+        adaptiveGrain.value = this->grainSize;
+        nsPerIndex = 0.0;
+    }
+
+    /**
+     * @brief Claim a chunk and call f(index) for each of its indices
+     *
+     * @param quantum time a chunk should take, 0 to use grainSize
+     */
+    template <typename F>
+    ChunkStatus ProcessChunk(F &&f, std::chrono::nanoseconds quantum = std::chrono::nanoseconds(0)) {
+        const bool adaptive = quantum.count() > 0;
+        const int64_t size = adaptive ? adaptiveGrain.value.load(std::memory_order_relaxed) : grainSize;
+        const int64_t chunkBegin = next.value.fetch_add(size, std::memory_order_relaxed);
+        if (chunkBegin >= end) {
+            // Empty range has no chunk to complete it
+            if (begin == end && !emptyCompleted.exchange(true)) {
+                return CS_Completed;
+            }
+            return CS_Exhausted;
+        }
+
+        return processClaimed(chunkBegin, std::min(chunkBegin + size, end), f, quantum);
+    }
+
+    /**
+     * @brief Claim a chunk of indices for which ready(index) returns true and call f(index) for each of them.
+     *        Indices are claimed in order, a chunk ends before the first index that is not ready. For ranges whose
+     *        indices depend on earlier ones, a step finding the next index not ready returns instead of waiting
+     *        inside a claimed index. ready must stay true for an index once it returned true
+     *
+     * @param quantum time a chunk should take, 0 to use grainSize
+     */
+    template <typename Ready, typename F>
+    ChunkStatus ProcessReadyChunk(Ready &&ready, F &&f, std::chrono::nanoseconds quantum = std::chrono::nanoseconds(0)) {
+        const int64_t size = quantum.count() > 0 ? adaptiveGrain.value.load(std::memory_order_relaxed) : grainSize;
+        int64_t chunkBegin = next.value.load(std::memory_order_relaxed);
+        int64_t chunkEnd;
+        do {
+            if (chunkBegin >= end) {
+                if (begin == end && !emptyCompleted.exchange(true)) {
+                    return CS_Completed;
+                }
+                return CS_Exhausted;
+            }
+            chunkEnd = chunkBegin;
+            const int64_t last = std::min(chunkBegin + size, end);
+            while (chunkEnd < last && ready(chunkEnd)) {
+                chunkEnd++;
+            }
+            if (chunkEnd == chunkBegin) {
+                return CS_Waiting;
+            }
+        } while (!next.value.compare_exchange_weak(chunkBegin, chunkEnd, std::memory_order_relaxed));
+
+        return processClaimed(chunkBegin, chunkEnd, f, quantum);
+    }
+
+    int64_t GetBegin() const { return begin; }
+    int64_t GetEnd() const { return end; }
+    int64_t GetGrainSize() const { return grainSize; }
+
+    /**
+     * @brief Size of the next chunk claimed with a quantum
+     *
+     */
+    int64_t GetAdaptiveGrainSize() const { return adaptiveGrain.value.load(std::memory_order_relaxed); }
+
+private:
+    template <typename F>
+    ChunkStatus processClaimed(int64_t chunkBegin, int64_t chunkEnd, F &f, std::chrono::nanoseconds quantum) {
+        const bool adaptive = quantum.count() > 0;
+        const auto chunkStart = adaptive ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        for (int64_t index = chunkBegin; index < chunkEnd; index++) {
+            f(index);
+        }
+        if (adaptive) {
+            adaptGrain(chunkEnd - chunkBegin, std::chrono::steady_clock::now() - chunkStart, quantum);
+        }
+
+        const int64_t chunkSize = chunkEnd - chunkBegin;
+        if (completed.value.fetch_add(chunkSize, std::memory_order_acq_rel) + chunkSize == end - begin) {
+            return CS_Completed;
+        }
+        return CS_Continue;
+    }
+
+    /**
+     * @brief Update the average time per index and the chunk size that takes quantum. Updates from concurrent chunks
+     *        may overwrite each other, the average only has to follow the cost roughly
+     *
+     */
+    void adaptGrain(int64_t indices, std::chrono::nanoseconds time, std::chrono::nanoseconds quantum) {
+        const double measured = double(time.count()) / double(indices);
+        const double previous = nsPerIndex.load(std::memory_order_relaxed);
+        const double average = previous > 0.0 ? previous + (measured - previous) * 0.25 : measured;
+        nsPerIndex.store(average, std::memory_order_relaxed);
+
+        const int64_t maxGrain = std::max((end - begin) / 64, grainSize);
+        const double fitting = double(quantum.count()) / std::max(average, 1.0);
+        adaptiveGrain.value.store(std::clamp<int64_t>(int64_t(fitting), 1, maxGrain), std::memory_order_relaxed);
+    }
+
+    int64_t begin;
+    int64_t end;
+    int64_t grainSize;
+    /// First index not claimed yet
+    CacheLinePadded<std::atomic<int64_t>> next;
+    /// Number of processed indices
+    CacheLinePadded<std::atomic<int64_t>> completed;
+    std::atomic<bool> emptyCompleted;
+    /// Chunk size and average time per index of chunks claimed with a quantum
+    CacheLinePadded<std::atomic<int64_t>> adaptiveGrain;
+    std::atomic<double> nsPerIndex;
+};
+
+/**
+ * @brief Executor running body for each index of a range. Each step claims a chunk of grainSize indices,
+ *        so the amount of work per step can be tuned without changing the body. When the task system sets a step
+ *        quantum, chunks are sized to take about that long instead. The body is called as
+ *        body(index, threadIndex, threadCount) and is inlined into the step
+ *
+ * @tparam Body functor type called for each index
+ */
+template <typename Body>
+struct ParallelRangeExecutor : Executor {
+    ParallelRangeExecutor(std::unique_ptr<Task> taskToExecute, int64_t begin, int64_t end, int64_t grainSize, Body body)
+        : Executor(std::move(taskToExecute)), body(std::move(body)), range(begin, end, grainSize) {}
+
+    virtual ~ParallelRangeExecutor() {}
+
+    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) override {
+        return StepChunk(threadIndex, threadCount, [this, threadIndex, threadCount](int64_t index) {
+            body(index, threadIndex, threadCount);
+        });
+    }
+
+protected:
+    /**
+     * @brief Process a chunk with f(index) instead of the body, for derived executors overriding
+     *        ExecuteStep(StepContext &) that pass step scratch to the body
+     *
+     */
+    template <typename F>
+    ExecStatus StepChunk(int threadIndex, int threadCount, F &&f) {
+        switch (range.ProcessChunk(std::forward<F>(f), stepQuantum)) {
+        case ChunkedRange::CS_Continue:
+            return ExecStatus::ES_Continue;
+        case ChunkedRange::CS_Completed:
+            OnRangeComplete(threadIndex, threadCount);
+            return ExecStatus::ES_Stop;
+        default:
+            return ExecStatus::ES_Stop;
+        }
+    }
+
+    /**
+     * @brief Called once, from the step that finished the last chunk of the range, after all indices are processed
+     *
+     */
+    virtual void OnRangeComplete(int threadIndex, int threadCount) {}
+
+    Body body;
+    ChunkedRange range;
+};
+
+/**
+ * @brief Executor reducing a range into a single value. Each slot accumulates into its own partial value
+ *        with body(index, partial), partials are combined with reducer(accumulated, partial) when the range completes
+ *        and the total is published as the task result
+ *
+ * @tparam Value type of the reduced value, identity is the value partials start from
+ * @tparam Body functor called for each index, accumulates into a partial value
+ * @tparam Reducer functor combining two values
+ */
+template <typename Value, typename Body, typename Reducer>
+struct ParallelReduceExecutor : Executor {
+    ParallelReduceExecutor(std::unique_ptr<Task> taskToExecute, int64_t begin, int64_t end, int64_t grainSize, Value identity, Body body, Reducer reducer)
+        : Executor(std::move(taskToExecute)),
+          body(std::move(body)),
+          reducer(std::move(reducer)),
+          identity(std::move(identity)),
+          range(begin, end, grainSize) {}
+
+    virtual ~ParallelReduceExecutor() {}
+
+    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) override {
+        // Partials are allocated once the number of slots is known
+        std::call_once(partialsInit, [this, threadCount]() {
+            partials.resize(threadCount, CacheLinePadded<Value>{ identity });
+        });
+
+        // Steps with the same threadIndex never run concurrently, so the partial is not shared
+        Value &partial = partials[threadIndex].value;
+        const ChunkedRange::ChunkStatus status = range.ProcessChunk([this, &partial](int64_t index) {
+            body(index, partial);
+        }, stepQuantum);
+
+        switch (status) {
+        case ChunkedRange::CS_Continue:
+            return ExecStatus::ES_Continue;
+        case ChunkedRange::CS_Completed: {
+            Value total = identity;
+            for (CacheLinePadded<Value> &slotPartial : partials) {
+                total = reducer(std::move(total), slotPartial.value);
+            }
+            PublishResult(std::move(total));
+            return ExecStatus::ES_Stop;
+        }
+        default:
+            return ExecStatus::ES_Stop;
+        }
+    }
+
+protected:
+    Body body;
+    Reducer reducer;
+    Value identity;
+    ChunkedRange range;
+
+private:
+    std::vector<CacheLinePadded<Value>> partials;
+    std::once_flag partialsInit;
+};
+
+};
@@ -0,0 +1,515 @@
+#include "ProcessWorkerPool.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#define USE_PROCESS_WORKERS
+#endif
+
+typedef TaskSystem::TaskSystemExecutor::TaskID TaskID;
+
+namespace TaskSystem {
+	namespace {
+		const char* WorkerFlag = "--ts-worker";
+
+		enum MessageType : uint8_t {
+			MT_Task = 1, MT_Steps, MT_Done, MT_Failed, MT_Exit
+		};
+
+		/// Largest message, serialized task descriptors must fit in it
+		const size_t MaxMessageSize = 64 * 1024;
+		const size_t HeaderSize = 1 + 2 * sizeof(int32_t);
+
+		/// Workers report step progress at most this often
+		const std::chrono::milliseconds StepReportInterval(10);
+
+		/// Delay before a lost worker is started again, doubled for each failed start up to MaxRestartDelay
+		const std::chrono::milliseconds RestartDelay(100);
+		const std::chrono::milliseconds MaxRestartDelay(5000);
+
+		/// Time a worker gets to exit after SIGTERM before it is killed
+		const std::chrono::milliseconds TerminateTimeout(1000);
+
+		/// <summary>
+		/// Registry of executors in a worker process. Executors are created directly and stepped on a single thread.
+		/// </summary>
+		struct WorkerRegistry : TaskSystemExecutor {
+			WorkerRegistry() : TaskSystemExecutor(1) {}
+
+			Executor* Create(std::unique_ptr<Task> task, ExecutorStepFunction& step) {
+				const ExecutorHandle executor = FindExecutor(task->GetExecutorName());
+				if (!executor.IsValid()) {
+					return nullptr;
+				}
+				const ExecutorEntry& entry = getExecutor(executor);
+				Executor* exec = entry.constructor(std::move(task));
+				exec->taskSystem = this;
+				step = entry.step;
+				return exec;
+			}
+		};
+
+#ifdef USE_PROCESS_WORKERS
+		/// Open a pipe that is closed on exec, so forked workers do not inherit it. flags may add O_NONBLOCK
+		bool openPipe(int fds[2], int flags) {
+#ifdef __linux__
+			return pipe2(fds, O_CLOEXEC | flags) == 0;
+#else
+			if (pipe(fds) != 0) {
+				return false;
+			}
+			for (int c = 0; c < 2; c++) {
+				fcntl(fds[c], F_SETFD, FD_CLOEXEC);
+				fcntl(fds[c], F_SETFL, flags);
+			}
+			return true;
+#endif
+		}
+
+		bool sendMessage(int fd, MessageType type, int32_t taskId, int32_t value, const std::string& payload = std::string()) {
+			std::string message(HeaderSize, '\0');
+			message[0] = char(type);
+			memcpy(&message[1], &taskId, sizeof(taskId));
+			memcpy(&message[1 + sizeof(taskId)], &value, sizeof(value));
+			message += payload;
+			return send(fd, message.data(), message.size(), MSG_NOSIGNAL) == ssize_t(message.size());
+		}
+
+		/// buffer is reused between messages from the same socket, it is allocated by the first one
+		bool receiveMessage(int fd, std::string& buffer, MessageType& type, int32_t& taskId, int32_t& value, std::string& payload) {
+			buffer.resize(MaxMessageSize);
+			const ssize_t size = recv(fd, &buffer[0], buffer.size(), 0);
+			if (size < ssize_t(HeaderSize)) {
+				return false;
+			}
+			type = MessageType(buffer[0]);
+			memcpy(&taskId, &buffer[1], sizeof(taskId));
+			memcpy(&value, &buffer[1 + sizeof(taskId)], sizeof(value));
+			payload.assign(buffer, HeaderSize, size - HeaderSize);
+			return true;
+		}
+#endif
+	}
+
+	ProcessWorkerPool::~ProcessWorkerPool() {
+		Stop();
+	}
+
+	bool ProcessWorkerPool::RunWorkerIfRequested(int argc, char* argv[]) {
+#ifdef USE_PROCESS_WORKERS
+		if (argc < 3 || strcmp(argv[1], WorkerFlag) != 0) {
+			return false;
+		}
+
+		const int fd = atoi(argv[2]);
+		WorkerRegistry registry;
+		for (int c = 3; c < argc; c++) {
+			TS_LOAD_LIBARY(argv[c], registry);
+		}
+
+		// Step scratch is reused by all tasks of the worker
+		ScratchArena scratch;
+		MessageType type;
+		int32_t taskId, value;
+		std::string buffer, payload;
+		while (receiveMessage(fd, buffer, type, taskId, value, payload) && type == MT_Task) {
+			std::optional<TaskDescriptor> descriptor = TaskDescriptor::Deserialize(payload);
+			ExecutorStepFunction step = nullptr;
+			std::unique_ptr<Executor> exec(descriptor ? registry.Create(std::make_unique<TaskDescriptor>(std::move(*descriptor)), step) : nullptr);
+			if (!exec) {
+				sendMessage(fd, MT_Failed, taskId, 0);
+				continue;
+			}
+
+			int steps = 0;
+			auto lastReport = std::chrono::steady_clock::now();
+			std::unique_ptr<ScratchArena> taskScratch;
+			StepContext context(0, 1, scratch, taskScratch);
+			for (;;) {
+				const Executor::ExecStatus status = step(*exec, context);
+				scratch.Reset();
+				if (status == Executor::ExecStatus::ES_Stop) {
+					break;
+				}
+				steps++;
+				const auto now = std::chrono::steady_clock::now();
+				if (now - lastReport >= StepReportInterval) {
+					sendMessage(fd, MT_Steps, taskId, steps);
+					lastReport = now;
+				}
+			}
+			sendMessage(fd, MT_Done, taskId, steps + 1);
+		}
+		close(fd);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool ProcessWorkerPool::Start(int workerCount, const std::vector<std::string>& libraries, const std::string& executablePath) {
+#ifdef USE_PROCESS_WORKERS
+		if (running) {
+			return false;
+		}
+		this->libraries = libraries;
+		this->executablePath = executablePath;
+
+		if (!openPipe(wakeFds, O_NONBLOCK)) {
+			return false;
+		}
+
+		workers.resize(workerCount);
+		for (Worker& worker : workers) {
+			if (!startWorker(worker)) {
+				Stop();
+				return false;
+			}
+		}
+
+		running = true;
+		coordinator = std::thread(&ProcessWorkerPool::coordinatorFun, this);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool ProcessWorkerPool::startWorker(Worker& worker) {
+#ifdef USE_PROCESS_WORKERS
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+			return false;
+		}
+		// Closed by a successful exec, the child writes errno to it if exec fails
+		int execStatus[2];
+		if (!openPipe(execStatus, 0)) {
+			close(fds[0]);
+			close(fds[1]);
+			return false;
+		}
+
+		// Prepare arguments before fork, the child may only call exec
+		const std::string childFd = std::to_string(fds[1]);
+		std::vector<const char*> args = { executablePath.c_str(), WorkerFlag, childFd.c_str() };
+		for (const std::string& library : libraries) {
+			args.push_back(library.c_str());
+		}
+		args.push_back(nullptr);
+
+		const pid_t pid = fork();
+		if (pid == 0) {
+			// Child keeps its end of the socket open across exec
+			fcntl(fds[1], F_SETFD, 0);
+			execv(args[0], const_cast<char* const*>(args.data()));
+			const int error = errno;
+			(void)!write(execStatus[1], &error, sizeof(error));
+			_exit(127);
+		}
+		close(fds[1]);
+		close(execStatus[1]);
+
+		int execError = 0;
+		ssize_t size;
+		do {
+			size = pid < 0 ? 0 : read(execStatus[0], &execError, sizeof(execError));
+		} while (size < 0 && errno == EINTR);
+		close(execStatus[0]);
+		if (pid < 0 || size > 0) {
+			if (pid > 0) {
+				waitpid(pid, nullptr, 0);
+			}
+			close(fds[0]);
+			return false;
+		}
+
+		worker.pid = pid;
+		worker.fd = fds[0];
+		worker.taskId = -1;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void ProcessWorkerPool::Stop(std::chrono::milliseconds timeout) {
+#ifdef USE_PROCESS_WORKERS
+		if (running.exchange(false)) {
+			wake();
+			coordinator.join();
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!pending.empty()) {
+			completeTask(pending.top().id, {}, true);
+			pending.pop();
+		}
+
+		// Workers read MT_Exit once their running task is done. Their last messages are still handled,
+		// so tasks finishing before the timeout complete normally
+		for (Worker& worker : workers) {
+			if (worker.fd != -1) {
+				sendMessage(worker.fd, MT_Exit, -1, 0);
+			}
+		}
+
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		std::vector<pollfd> fds;
+		for (;;) {
+			fds.clear();
+			for (const Worker& worker : workers) {
+				fds.push_back({ worker.fd, POLLIN, 0 });
+			}
+			const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (std::all_of(workers.begin(), workers.end(), [](const Worker& worker) { return worker.fd == -1; }) || left.count() <= 0) {
+				break;
+			}
+
+			lock.unlock();
+			const int ready = poll(fds.data(), fds.size(), int(left.count()) + 1);
+			lock.lock();
+			if (ready <= 0) {
+				continue;
+			}
+
+			for (size_t c = 0; c < fds.size(); c++) {
+				if (!fds[c].revents) {
+					continue;
+				}
+				Worker& worker = workers[c];
+				MessageType type;
+				int32_t taskId, value;
+				std::string payload;
+				if (receiveMessage(worker.fd, worker.receiveBuffer, type, taskId, value, payload)) {
+					handleMessage(worker, type, taskId, value);
+					continue;
+				}
+
+				// Worker has closed its socket and exits
+				if (worker.taskId != -1) {
+					completeTask(worker.taskId, {}, true);
+				}
+				close(worker.fd);
+				waitpid(worker.pid, nullptr, 0);
+				worker = Worker();
+			}
+		}
+
+		// Workers still executing a task after the timeout
+		for (Worker& worker : workers) {
+			if (worker.fd != -1) {
+				terminateWorker(worker);
+			}
+		}
+		workers.clear();
+
+		for (int& fd : wakeFds) {
+			if (fd != -1) {
+				close(fd);
+				fd = -1;
+			}
+		}
+#endif
+	}
+
+	void ProcessWorkerPool::terminateWorker(Worker& worker) {
+#ifdef USE_PROCESS_WORKERS
+		kill(worker.pid, SIGTERM);
+		const auto deadline = std::chrono::steady_clock::now() + TerminateTimeout;
+		while (waitpid(worker.pid, nullptr, WNOHANG) == 0) {
+			if (std::chrono::steady_clock::now() >= deadline) {
+				kill(worker.pid, SIGKILL);
+				waitpid(worker.pid, nullptr, 0);
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		close(worker.fd);
+		if (worker.taskId != -1) {
+			completeTask(worker.taskId, {}, true);
+		}
+		worker = Worker();
+#endif
+	}
+
+	TaskID ProcessWorkerPool::ScheduleTask(const TaskDescriptor& task, int priority) {
+		const TaskID id = ts.BeginExternalTask("remote:" + task.GetExecutorName());
+
+		std::string data = task.Serialize();
+		{
+			// Checked under the lock, Stop fails pending tasks once running is cleared
+			std::lock_guard<std::mutex> lock(mutex);
+			if (running && data.size() + HeaderSize <= MaxMessageSize) {
+				pending.push({ priority, id.id, std::move(data) });
+			}
+			else {
+				completeTask(id.id, {}, true);
+				return id;
+			}
+		}
+		wake();
+		return id;
+	}
+
+	int ProcessWorkerPool::GetReportedSteps(TaskID task) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = reportedSteps.find(task.id);
+		return it == reportedSteps.end() ? 0 : it->second;
+	}
+
+	void ProcessWorkerPool::wake() {
+#ifdef USE_PROCESS_WORKERS
+		const char one = 1;
+		(void)!write(wakeFds[1], &one, 1);
+#endif
+	}
+
+	void ProcessWorkerPool::dispatchPending() {
+#ifdef USE_PROCESS_WORKERS
+		for (Worker& worker : workers) {
+			if (pending.empty()) {
+				return;
+			}
+			if (worker.fd == -1 || worker.taskId != -1) {
+				continue;
+			}
+			const PendingTask& task = pending.top();
+			worker.taskId = task.id;
+			if (!sendMessage(worker.fd, MT_Task, task.id, 0, task.data)) {
+				workerLost(worker);
+			}
+			pending.pop();
+		}
+#endif
+	}
+
+	void ProcessWorkerPool::handleMessage(Worker& worker, uint8_t type, int32_t taskId, int32_t value) {
+		if (type == MT_Steps) {
+			reportedSteps[taskId] = value;
+		}
+		else if (type == MT_Done || type == MT_Failed) {
+			worker.taskId = -1;
+			// The worker does not send the executor's result back, remote tasks complete without one
+			completeTask(taskId, TaskResult(), type == MT_Failed);
+		}
+	}
+
+	void ProcessWorkerPool::completeTask(int taskId, TaskResult result, bool failed) {
+		reportedSteps.erase(taskId);
+		ts.CompleteExternalTask({ taskId }, std::move(result), failed);
+	}
+
+	void ProcessWorkerPool::workerLost(Worker& worker) {
+#ifdef USE_PROCESS_WORKERS
+		// Worker crashed or exited - its task fails and restartWorkers replaces the process.
+		// The process may still be alive if only its socket failed, kill it so waitpid returns
+		if (worker.taskId != -1) {
+			completeTask(worker.taskId, {}, true);
+		}
+		close(worker.fd);
+		kill(worker.pid, SIGKILL);
+		waitpid(worker.pid, nullptr, 0);
+		worker.pid = -1;
+		worker.fd = -1;
+		worker.taskId = -1;
+		worker.restartAt = std::chrono::steady_clock::now() + RestartDelay;
+#endif
+	}
+
+	int ProcessWorkerPool::restartWorkers() {
+#ifdef USE_PROCESS_WORKERS
+		const auto now = std::chrono::steady_clock::now();
+		auto nextRestart = std::chrono::steady_clock::time_point::max();
+		bool alive = false;
+		bool startFailed = true;
+		for (Worker& worker : workers) {
+			if (worker.fd == -1 && now >= worker.restartAt) {
+				if (startWorker(worker)) {
+					worker.startFailures = 0;
+				}
+				else {
+					worker.startFailures++;
+					worker.restartAt = now + std::min<std::chrono::milliseconds>(RestartDelay * (1 << std::min(worker.startFailures, 6)), MaxRestartDelay);
+				}
+			}
+			if (worker.fd != -1) {
+				alive = true;
+			}
+			else {
+				nextRestart = std::min(nextRestart, worker.restartAt);
+				startFailed = startFailed && worker.startFailures > 0;
+			}
+		}
+
+		// No worker is left and none could be started - fail pending tasks instead of leaving their waiters blocked
+		if (!alive && startFailed) {
+			while (!pending.empty()) {
+				completeTask(pending.top().id, {}, true);
+				pending.pop();
+			}
+		}
+
+		if (nextRestart == std::chrono::steady_clock::time_point::max()) {
+			return -1;
+		}
+		return int(std::chrono::duration_cast<std::chrono::milliseconds>(nextRestart - now).count()) + 1;
+#else
+		return -1;
+#endif
+	}
+
+	void ProcessWorkerPool::coordinatorFun() {
+#ifdef USE_PROCESS_WORKERS
+		std::vector<pollfd> fds;
+		while (running) {
+			int timeout;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				timeout = restartWorkers();
+				dispatchPending();
+
+				fds.assign(1, { wakeFds[0], POLLIN, 0 });
+				for (const Worker& worker : workers) {
+					fds.push_back({ worker.fd, POLLIN, 0 });
+				}
+			}
+
+			if (poll(fds.data(), fds.size(), timeout) <= 0) {
+				continue;
+			}
+
+			if (fds[0].revents) {
+				char buffer[64];
+				while (read(wakeFds[0], buffer, sizeof(buffer)) > 0)
+					;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t c = 1; c < fds.size(); c++) {
+				if (!fds[c].revents) {
+					continue;
+				}
+				Worker& worker = workers[c - 1];
+
+				MessageType type;
+				int32_t taskId, value;
+				std::string payload;
+				if (!receiveMessage(worker.fd, worker.receiveBuffer, type, taskId, value, payload)) {
+					workerLost(worker);
+					continue;
+				}
+				handleMessage(worker, type, taskId, value);
+			}
+		}
+#endif
+	}
+};
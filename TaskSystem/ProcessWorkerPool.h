@@ -0,0 +1,125 @@
+#pragma once
+
+#include "TaskSystem.h"
+#include "TaskDescriptor.h"
+
+#include <map>
+#include <queue>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace TaskSystem {
+
+	/**
+	 * @brief Executes tasks in separate worker processes. The coordinator keeps a priority queue of
+	 *        submitted tasks and hands them to idle worker processes over Unix-domain sockets. Each worker process
+	 *        loads the executor plugins itself and executes one task at a time, so a crashing executor only takes down
+	 *        its worker process. Remote tasks are external tasks of the task system and can be waited for as usual.
+	 *        Only supported on POSIX systems
+	 *
+	 */
+	struct ProcessWorkerPool {
+		ProcessWorkerPool(TaskSystemExecutor& ts) : ts(ts) {}
+		~ProcessWorkerPool();
+
+		ProcessWorkerPool(const ProcessWorkerPool&) = delete;
+		ProcessWorkerPool& operator=(const ProcessWorkerPool&) = delete;
+
+		/**
+		 * @brief Start worker processes by executing the current binary with worker arguments
+		 *
+		 * @param workerCount number of worker processes
+		 * @param libraries executor libraries to load in each worker, as passed to TS_LOAD_LIBARY
+		 * @param executablePath binary to start, must call RunWorkerIfRequested at the start of main
+		 * @return true if all workers were started
+		 */
+		bool Start(int workerCount, const std::vector<std::string>& libraries, const std::string& executablePath);
+
+		/**
+		 * @brief Stop all worker processes. Workers finish their running task first, tasks they finish complete
+		 *        normally. Workers still running after timeout are terminated with SIGTERM, then SIGKILL, and their
+		 *        tasks complete as failed, as do tasks not sent to a worker yet
+		 *
+		 */
+		void Stop(std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+		/**
+		 * @brief Schedule a task on a worker process
+		 *
+		 * @param task parameters of the task, serialized and sent to the worker
+		 * @param priority the task priority, bigger means sent to a worker sooner
+		 * @return TaskID of the external task in the task system. Tasks completed by a worker have no result,
+		 *         progress is read with GetReportedSteps while the task runs
+		 */
+		TaskSystemExecutor::TaskID ScheduleTask(const TaskDescriptor& task, int priority);
+
+		/**
+		 * @brief Number of steps a worker process has reported for a running task, 0 once the task has completed
+		 *
+		 */
+		int GetReportedSteps(TaskSystemExecutor::TaskID task);
+
+		/**
+		 * @brief Must be called at the start of main. When the process was started as a worker,
+		 *        runs the worker loop and returns true once the coordinator stops it
+		 *
+		 */
+		static bool RunWorkerIfRequested(int argc, char* argv[]);
+
+	private:
+		struct PendingTask {
+			int priority;
+			int id;
+			std::string data;
+
+			bool operator<(const PendingTask& other) const {
+				return priority < other.priority;
+			}
+		};
+
+		struct Worker {
+			int pid = -1;
+			int fd = -1;
+			/// Id of the task being executed by the worker, -1 when idle
+			int taskId = -1;
+			/// A lost worker is started again by the coordinator at this time
+			std::chrono::steady_clock::time_point restartAt;
+			/// Failed attempts to start the worker since it last ran, lengthens the restart delay
+			int startFailures = 0;
+			/// Messages from the worker are received here
+			std::string receiveBuffer;
+		};
+
+		void coordinatorFun();
+		bool startWorker(Worker& worker);
+		void dispatchPending();
+		void handleMessage(Worker& worker, uint8_t type, int32_t taskId, int32_t value);
+		void completeTask(int taskId, TaskResult result, bool failed);
+		void workerLost(Worker& worker);
+		void terminateWorker(Worker& worker);
+		/// Start lost workers that are due and fail pending tasks if no worker can run them. Returns milliseconds
+		/// until the next restart attempt, -1 if none is due
+		int restartWorkers();
+		void wake();
+
+		TaskSystemExecutor& ts;
+		std::vector<std::string> libraries;
+		std::string executablePath;
+
+		std::vector<Worker> workers;
+		std::priority_queue<PendingTask> pending;
+		/// Steps reported for running tasks, removed when they complete
+		std::map<int, int> reportedSteps;
+		/// Guards workers, pending and reportedSteps
+		std::mutex mutex;
+
+		std::thread coordinator;
+		std::atomic<bool> running = false;
+		int wakeFds[2] = { -1, -1 };
+	};
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <typeinfo>
+#include <cstdint>
+#include <stdexcept>
+
+namespace TaskSystem {
+
+/**
+ * @brief Cache of resources shared between tasks, e.g. loaded meshes or built acceleration structures.
+ *        Resources are reference counted with shared_ptr, the cache holds one reference. When a resource is added or
+ *        the budget changes and the total size is above the byte budget, least recently used resources only
+ *        referenced by the cache are released.
+ *        Implemented in the header so executor libraries can use it through TaskSystemExecutor::GetResourceCache
+ *
+ */
+struct ResourceCache {
+    /**
+     * @brief Cache usage counters
+     *
+     */
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t bytes = 0;
+        size_t entries = 0;
+    };
+
+    ResourceCache(size_t byteBudget = size_t(1) << 30) : byteBudget(byteBudget) {}
+
+    ResourceCache(const ResourceCache &) = delete;
+    ResourceCache &operator=(const ResourceCache &) = delete;
+
+    /**
+     * @brief Get the resource stored with key, or create it with create(bytes) if not cached. Concurrent requests
+     *        for a missing key wait for the first one to create it instead of creating it again
+     *
+     * @tparam T the resource type, must match the type the key was created with
+     * @param key unique key of the resource, should be prefixed with the executor name
+     * @param create functor returning std::shared_ptr<T>, sets its size_t& argument to the approximate size in bytes
+     * @return the shared resource, nullptr if create returned nullptr or threw
+     */
+    template <typename T, typename Create>
+    std::shared_ptr<T> GetOrCreate(const std::string &key, Create &&create) {
+        std::shared_ptr<T> value;
+        getOrCreate(key, std::forward<Create>(create), true, value);
+        return value;
+    }
+
+    /**
+     * @brief Like GetOrCreate, but returns instead of waiting when another caller is still creating the resource.
+     *        Lets tasks run other work meanwhile and try again on a later step
+     *
+     * @param[out] value the shared resource, nullptr if create returned nullptr or threw. Unchanged if pending
+     * @return false if the resource is still being created by another caller
+     */
+    template <typename T, typename Create>
+    bool TryGetOrCreate(const std::string &key, Create &&create, std::shared_ptr<T> &value) {
+        return getOrCreate(key, std::forward<Create>(create), false, value);
+    }
+
+    /**
+     * @brief Get the resource stored with key without creating it
+     *
+     * @return the shared resource, nullptr if not cached, still being created or cached with a different type
+     */
+    template <typename T>
+    std::shared_ptr<T> Find(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end() || *it->second.type != typeid(T) || !isReady(it->second)) {
+            return nullptr;
+        }
+        stats.hits++;
+        lru.splice(lru.end(), lru, it->second.lruPosition);
+        return std::static_pointer_cast<T>(it->second.value.get());
+    }
+
+    /**
+     * @brief Change the byte budget, releasing unused resources if the cache is above it
+     *
+     */
+    void SetBudget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        byteBudget = bytes;
+        evict();
+    }
+
+    /**
+     * @brief Release all resources that are only referenced by the cache
+     *
+     */
+    void ReleaseUnused() {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t budget = byteBudget;
+        byteBudget = 0;
+        evict();
+        byteBudget = budget;
+    }
+
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats result = stats;
+        result.entries = entries.size();
+        return result;
+    }
+
+private:
+    struct Entry {
+        const std::type_info *type = nullptr;
+        std::shared_future<std::shared_ptr<void>> value;
+        size_t bytes = 0;
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    static bool isReady(const Entry &entry) {
+        return entry.value.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    /**
+     * @brief Shared implementation of GetOrCreate and TryGetOrCreate, a pending resource is waited for only if wait
+     *        is set and neither counted nor touched otherwise
+     *
+     */
+    template <typename T, typename Create>
+    bool getOrCreate(const std::string &key, Create &&create, bool wait, std::shared_ptr<T> &result) {
+        std::shared_future<std::shared_ptr<void>> pending;
+        std::promise<std::shared_ptr<void>> creating;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                if (*it->second.type != typeid(T)) {
+                    throw std::invalid_argument("Resource " + key + " is cached with a different type");
+                }
+                if (!wait && !isReady(it->second)) {
+                    return false;
+                }
+                stats.hits++;
+                lru.splice(lru.end(), lru, it->second.lruPosition);
+                pending = it->second.value;
+            } else {
+                stats.misses++;
+                Entry &entry = entries[key];
+                entry.type = &typeid(T);
+                entry.value = creating.get_future().share();
+                entry.lruPosition = lru.insert(lru.end(), key);
+            }
+        }
+
+        if (pending.valid()) {
+            result = std::static_pointer_cast<T>(pending.get());
+            return true;
+        }
+
+        // Create outside of the lock, other keys can be used meanwhile
+        size_t bytes = 0;
+        std::shared_ptr<T> value;
+        try {
+            value = create(bytes);
+        } catch (...) {
+            value = nullptr;
+        }
+        creating.set_value(value);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!value) {
+            // Failed resources are not cached, the next request tries again. Eviction may have removed it already
+            auto it = entries.find(key);
+            if (it != entries.end() && isReady(it->second) && it->second.value.get() == nullptr) {
+                lru.erase(it->second.lruPosition);
+                entries.erase(it);
+            }
+            result = value;
+            return true;
+        }
+        entries[key].bytes = bytes;
+        stats.bytes += bytes;
+        evict();
+        result = value;
+        return true;
+    }
+
+    /**
+     * @brief Release least recently used resources until the cache fits the budget. Resources still referenced
+     *        outside of the cache or still being created are skipped. Called with mutex locked
+     *
+     */
+    void evict() {
+        for (auto it = lru.begin(); it != lru.end() && stats.bytes > byteBudget;) {
+            Entry &entry = entries[*it];
+            if (!isReady(entry) || entry.value.get().use_count() > 1) {
+                ++it;
+                continue;
+            }
+            stats.bytes -= entry.bytes;
+            stats.evictions++;
+            entries.erase(*it);
+            it = lru.erase(it);
+        }
+    }
+
+    std::mutex mutex;
+    std::map<std::string, Entry> entries;
+    /// Keys from least to most recently used
+    std::list<std::string> lru;
+    size_t byteBudget;
+    Stats stats;
+};
+
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <new>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <typeinfo>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+namespace TaskSystem {
+
+/**
+ * @brief Bump allocator for temporary memory of steps. Allocation advances an offset in the current block, memory is
+ *        released all at once by Rewind or Reset and blocks are kept for the next allocations, so an arena that
+ *        reached its working size does not allocate from the heap anymore.
+ *        Not thread safe, each arena is used by one slot at a time
+ *
+ */
+struct ScratchArena {
+    static const size_t DefaultBlockSize = size_t(64) << 10;
+
+    /**
+     * @brief Position in the arena, allocations made after GetMark are released by Rewind
+     *
+     */
+    struct Mark {
+        size_t block = 0;
+        size_t offset = 0;
+    };
+
+    explicit ScratchArena(size_t blockSize = DefaultBlockSize) : blockSize(blockSize) {}
+
+    ~ScratchArena() {
+        destroyLocal();
+    }
+
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+
+    /**
+     * @brief Allocate uninitialized memory, valid until the arena is rewound below it or reset
+     *
+     * @param alignment power of two
+     */
+    void *Allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        for (size_t block = current; block < blocks.size(); block++) {
+            const uintptr_t base = reinterpret_cast<uintptr_t>(blocks[block].data.get());
+            const uintptr_t aligned = (base + (block == current ? offset : 0) + alignment - 1) & ~uintptr_t(alignment - 1);
+            if (aligned + bytes <= base + blocks[block].size) {
+                current = block;
+                offset = size_t(aligned + bytes - base);
+                return reinterpret_cast<void *>(aligned);
+            }
+        }
+
+        // No retained block fits, blocks skipped here are used again after the next Rewind
+        Block block;
+        block.size = std::max(blockSize, bytes + alignment);
+        block.data.reset(new std::byte[block.size]);
+        capacity += block.size;
+        blocks.push_back(std::move(block));
+        current = blocks.size() - 1;
+        offset = 0;
+        return Allocate(bytes, alignment);
+    }
+
+    /**
+     * @brief Allocate an uninitialized array. Destructors are never called, so T must be trivially destructible
+     *
+     */
+    template <typename T>
+    T *AllocateArray(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "Scratch arrays are released without calling destructors");
+        return static_cast<T *>(Allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    Mark GetMark() const {
+        return { current, offset };
+    }
+
+    /**
+     * @brief Release the allocations made after mark was taken. Marks must be rewound in reverse order
+     *
+     */
+    void Rewind(const Mark &mark) {
+        current = mark.block;
+        offset = mark.offset;
+    }
+
+    /**
+     * @brief Get the object stored in the arena with Local, default constructing it on the first call. Lets a slot keep
+     *        state in the arena between uses, it is destroyed by Reset. Only one type can be stored per arena
+     *
+     */
+    template <typename T>
+    T &Local() {
+        if (!local) {
+            local = new (Allocate(sizeof(T), alignof(T))) T();
+            localType = &typeid(T);
+            localDestructor = [](void *value) { static_cast<T *>(value)->~T(); };
+        } else if (*localType != typeid(T)) {
+            throw std::invalid_argument("Scratch arena local is stored with a different type");
+        }
+        return *static_cast<T *>(local);
+    }
+
+    /**
+     * @brief Destroy the local object and release all allocations. Blocks are kept up to retainBytes in total
+     *
+     */
+    void Reset(size_t retainBytes = SIZE_MAX) {
+        destroyLocal();
+        current = 0;
+        offset = 0;
+        while (!blocks.empty() && capacity > retainBytes) {
+            capacity -= blocks.back().size;
+            blocks.pop_back();
+        }
+    }
+
+    /**
+     * @brief Total size of the blocks owned by the arena
+     *
+     */
+    size_t GetCapacity() const {
+        return capacity;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t size = 0;
+    };
+
+    void destroyLocal() {
+        if (local) {
+            localDestructor(local);
+            local = nullptr;
+            localType = nullptr;
+        }
+    }
+
+    std::vector<Block> blocks;
+    size_t current = 0;
+    size_t offset = 0;
+    size_t blockSize;
+    size_t capacity = 0;
+
+    void *local = nullptr;
+    const std::type_info *localType = nullptr;
+    void (*localDestructor)(void *) = nullptr;
+};
+
+/**
+ * @brief Allocator for standard containers allocating from a scratch arena, e.g. std::vector<float, ScratchAllocator<float>>.
+ *        Deallocation does nothing, the memory is released with the arena
+ *
+ */
+template <typename T>
+struct ScratchAllocator {
+    typedef T value_type;
+
+    ScratchAllocator(ScratchArena &arena) : arena(&arena) {}
+
+    template <typename U>
+    ScratchAllocator(const ScratchAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t count) {
+        return static_cast<T *>(arena->Allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    void deallocate(T *, size_t) {}
+
+    template <typename U>
+    bool operator==(const ScratchAllocator<U> &other) const {
+        return arena == other.arena;
+    }
+
+    template <typename U>
+    bool operator!=(const ScratchAllocator<U> &other) const {
+        return arena != other.arena;
+    }
+
+    ScratchArena *arena;
+};
+
+/**
+ * @brief Arenas released by finished tasks, reset and handed to the next tasks so their blocks are reused
+ *
+ */
+struct ScratchArenaPool {
+    /**
+     * @param maxArenas arenas kept for reuse, further released arenas are deleted
+     * @param retainBytes block bytes kept per pooled arena
+     */
+    ScratchArenaPool(size_t maxArenas = 64, size_t retainBytes = size_t(1) << 20) : maxArenas(maxArenas), retainBytes(retainBytes) {}
+
+    std::unique_ptr<ScratchArena> Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!arenas.empty()) {
+                std::unique_ptr<ScratchArena> arena = std::move(arenas.back());
+                arenas.pop_back();
+                return arena;
+            }
+        }
+        return std::make_unique<ScratchArena>();
+    }
+
+    void Release(std::unique_ptr<ScratchArena> arena) {
+        // Reset outside of the lock, it runs the destructor of the local object
+        arena->Reset(retainBytes);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (arenas.size() < maxArenas) {
+            arenas.push_back(std::move(arena));
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ScratchArena>> arenas;
+    size_t maxArenas;
+    size_t retainBytes;
+};
+
+};
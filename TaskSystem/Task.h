@@ -17,6 +17,25 @@ struct Task {
 
     virtual std::string GetExecutorName() const = 0;
 
+    /**
+     * @brief Stable identity of the work the task describes, the executor name plus canonicalized parameters.
+     *        Tasks returning a fingerprint opt in to sharing: a task scheduled while another one with the same
+     *        fingerprint runs attaches to it, and a recently completed one's result is reused without executing.
+     *        Only return one for tasks without side effects whose result depends on nothing but the parameters
+     *
+     * @return the fingerprint, empty for tasks that are always executed
+     */
+    virtual std::optional<std::string> GetFingerprint() const { return std::nullopt; }
+
+    /**
+     * @brief Memory the executor of this task is expected to hold, used to admit the task under a memory budget before
+     *        its executor is constructed. Without an estimate the mean peak of completed tasks of the executor is used,
+     *        or what its running tasks have reported. While none of these is known only one task of the executor is admitted
+     *
+     * @return the estimate in bytes, empty if unknown
+     */
+    virtual std::optional<size_t> GetMemoryEstimate() const { return std::nullopt; }
+
     virtual ~Task() {}
 };
 
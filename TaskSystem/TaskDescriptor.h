@@ -0,0 +1,177 @@
+#pragma once
+
+#include "Task.h"
+
+#include <map>
+#include <string>
+#include <optional>
+#include <cstdint>
+#include <cstring>
+
+namespace TaskSystem {
+
+/**
+ * @brief Task with parameters stored by value, that can be serialized to a compact binary form
+ *        and sent to another process
+ *
+ */
+struct TaskDescriptor : Task {
+    TaskDescriptor() = default;
+    TaskDescriptor(const std::string &executorName) : executorName(executorName) {}
+
+    std::string executorName;
+    std::map<std::string, int> intParams;
+    std::map<std::string, double> doubleParams;
+    std::map<std::string, std::string> stringParams;
+    /// Share execution and result with identical descriptors, see Task::GetFingerprint. Not serialized
+    bool shareable = false;
+
+    virtual std::optional<int> GetIntParam(const std::string &name) const { return find(intParams, name); }
+    virtual std::optional<std::string> GetStringParam(const std::string &name) const { return find(stringParams, name); }
+    virtual std::optional<double> GetDoubleParam(const std::string &name) const { return find(doubleParams, name); }
+
+    virtual std::string GetExecutorName() const { return executorName; }
+
+    /**
+     * @brief The serialized form if shareable, it holds the executor name and the parameters sorted by name
+     *
+     */
+    virtual std::optional<std::string> GetFingerprint() const {
+        if (!shareable) {
+            return std::nullopt;
+        }
+        return Serialize();
+    }
+
+    /**
+     * @brief Serialize to bytes. Parameters are written sorted by name, so equal descriptors give equal bytes
+     *
+     */
+    std::string Serialize() const {
+        std::string out;
+        out.push_back(char(FormatVersion));
+        writeString(out, executorName);
+        writeVarint(out, intParams.size() + doubleParams.size() + stringParams.size());
+        for (const auto &[name, value] : intParams) {
+            out.push_back(char(PT_Int));
+            writeString(out, name);
+            // zig-zag encoding keeps small negative numbers short
+            writeVarint(out, (uint64_t(int64_t(value)) << 1) ^ uint64_t(int64_t(value) >> 63));
+        }
+        for (const auto &[name, value] : doubleParams) {
+            out.push_back(char(PT_Double));
+            writeString(out, name);
+            char bytes[sizeof(double)];
+            memcpy(bytes, &value, sizeof(double));
+            out.append(bytes, sizeof(double));
+        }
+        for (const auto &[name, value] : stringParams) {
+            out.push_back(char(PT_String));
+            writeString(out, name);
+            writeString(out, value);
+        }
+        return out;
+    }
+
+    /**
+     * @brief Parse bytes created by Serialize
+     *
+     * @return the descriptor, empty if data is malformed or of unsupported version
+     */
+    static std::optional<TaskDescriptor> Deserialize(const std::string &data) {
+        size_t pos = 0;
+        if (data.empty() || uint8_t(data[pos++]) != FormatVersion) {
+            return std::nullopt;
+        }
+
+        TaskDescriptor result;
+        uint64_t count;
+        if (!readString(data, pos, result.executorName) || !readVarint(data, pos, count)) {
+            return std::nullopt;
+        }
+        for (uint64_t c = 0; c < count; c++) {
+            if (pos >= data.size()) {
+                return std::nullopt;
+            }
+            const uint8_t type = uint8_t(data[pos++]);
+            std::string name;
+            if (!readString(data, pos, name)) {
+                return std::nullopt;
+            }
+            if (type == PT_Int) {
+                uint64_t encoded;
+                if (!readVarint(data, pos, encoded)) {
+                    return std::nullopt;
+                }
+                result.intParams[name] = int(int64_t(encoded >> 1) ^ -int64_t(encoded & 1));
+            } else if (type == PT_Double) {
+                if (data.size() - pos < sizeof(double)) {
+                    return std::nullopt;
+                }
+                double value;
+                memcpy(&value, data.data() + pos, sizeof(double));
+                pos += sizeof(double);
+                result.doubleParams[name] = value;
+            } else if (type == PT_String) {
+                if (!readString(data, pos, result.stringParams[name])) {
+                    return std::nullopt;
+                }
+            } else {
+                return std::nullopt;
+            }
+        }
+        return result;
+    }
+
+private:
+    enum ParamType : uint8_t {
+        PT_Int = 1, PT_Double = 2, PT_String = 3
+    };
+    static const uint8_t FormatVersion = 1;
+
+    template <typename T>
+    static std::optional<T> find(const std::map<std::string, T> &params, const std::string &name) {
+        auto it = params.find(name);
+        if (it == params.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    static void writeVarint(std::string &out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(char(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(char(value));
+    }
+
+    static void writeString(std::string &out, const std::string &value) {
+        writeVarint(out, value.size());
+        out.append(value);
+    }
+
+    static bool readVarint(const std::string &data, size_t &pos, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && pos < data.size(); shift += 7) {
+            const uint8_t byte = uint8_t(data[pos++]);
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool readString(const std::string &data, size_t &pos, std::string &value) {
+        uint64_t size;
+        if (!readVarint(data, pos, size) || data.size() - pos < size) {
+            return false;
+        }
+        value.assign(data, pos, size_t(size));
+        pos += size_t(size);
+        return true;
+    }
+};
+
+};
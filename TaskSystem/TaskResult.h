@@ -0,0 +1,100 @@
+#pragma once
+
+#include <memory>
+#include <typeinfo>
+#include <type_traits>
+#include <utility>
+
+namespace TaskSystem {
+
+/**
+ * @brief Type erased result published by an executor. Values are stored once and handed over by moving,
+ *        copies of TaskResult share the same stored value
+ *
+ */
+struct TaskResult {
+    TaskResult() = default;
+
+    /**
+     * @brief Create a result holding value, moving it when passed as rvalue
+     *
+     * @param value the result value
+     * @param bytes approximate memory used by the value, including buffers it owns
+     */
+    template <typename T>
+    static TaskResult Make(T &&value, size_t bytes = sizeof(std::decay_t<T>)) {
+        TaskResult result;
+        result.holder = std::make_shared<Holder<std::decay_t<T>>>(std::forward<T>(value));
+        result.bytes = bytes;
+        return result;
+    }
+
+    bool HasValue() const {
+        return holder != nullptr;
+    }
+
+    size_t GetSize() const {
+        return holder ? bytes : 0;
+    }
+
+    /**
+     * @brief Get pointer to the stored value
+     *
+     * @return pointer to the value, nullptr if empty or the value is of different type
+     */
+    template <typename T>
+    T *Get() const {
+        if (!holder || holder->type() != typeid(T)) {
+            return nullptr;
+        }
+        return &static_cast<Holder<T> *>(holder.get())->value;
+    }
+
+    /**
+     * @brief Move the stored value out, leaving the result empty. If other copies of this result share the value,
+     *        e.g. results of coalesced or memoized tasks, it is copied instead. A shared value of a type that can
+     *        only be moved is not taken, use Get to read it
+     *
+     * @return pointer to the moved value, nullptr if empty, the value is of different type or it is shared and
+     *         can not be copied. The result is left unchanged when nullptr is returned
+     */
+    template <typename T>
+    std::unique_ptr<T> Take() {
+        T *value = Get<T>();
+        if (!value) {
+            return nullptr;
+        }
+        const bool shared = holder.use_count() > 1;
+        std::unique_ptr<T> taken;
+        if constexpr (std::is_copy_constructible_v<T>) {
+            taken = shared ? std::make_unique<T>(*value) : std::make_unique<T>(std::move(*value));
+        } else {
+            if (shared) {
+                return nullptr;
+            }
+            taken = std::make_unique<T>(std::move(*value));
+        }
+        holder.reset();
+        bytes = 0;
+        return taken;
+    }
+
+private:
+    struct HolderBase {
+        virtual ~HolderBase() {}
+        virtual const std::type_info &type() const = 0;
+    };
+
+    template <typename T>
+    struct Holder : HolderBase {
+        template <typename U>
+        Holder(U &&value) : value(std::forward<U>(value)) {}
+        const std::type_info &type() const override { return typeid(T); }
+        T value;
+    };
+
+    std::shared_ptr<HolderBase> holder;
+    size_t bytes = 0;
+};
+
+};
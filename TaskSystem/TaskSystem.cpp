@@ -1,7 +1,11 @@
 #include "TaskSystem.h"
+#include "CompletionQueue.h"
 #include <cassert>
 #include<iostream>
 #include <shared_mutex>
+#include <filesystem>
+#include <thread>
+#include <stdexcept>
 
 #if defined(_WIN32) || defined(_WIN64)
 #define USE_WIN
@@ -26,13 +30,74 @@ namespace TaskSystem {
 		return *self;
 	}
 
-	bool TaskSystemExecutor::LoadLibrary(const std::string& path) {
+	void TaskSystemExecutor::OnTaskCompleted(TaskID task, CompletionQueue& queue) {
+		// Tasks are executed inside ScheduleTask and have always finished
+		const auto now = std::chrono::steady_clock::now();
+		queue.Push({ task, CompletionQueue::CS_Completed, now, now, now });
+	}
+
+	bool TaskSystemExecutor::RegisterStaticLibrary(const std::string& libName) {
+		bool linked = false;
+		for (StaticExecutorRegistration* reg = StaticExecutorRegistration::First(); reg; reg = reg->next) {
+			if (libName == reg->libraryName) {
+				Register(reg->executorName, reg->constructor, reg->step);
+				linked = true;
+			}
+		}
+		if (linked) {
+			printf("Initialized [%s] linked executor\n", libName.c_str());
+		}
+		return linked;
+	}
+
+	TaskSystemExecutor::ExecutorHandle TaskSystemExecutor::Register(const std::string& executorName, ExecutorConstructor constructor, ExecutorStepFunction step) {
+		std::unique_lock<std::shared_mutex> lock(executorsMutex);
+		auto it = executorIndices.find(executorName);
+		if (it != executorIndices.end()) {
+			const ExecutorEntry& registered = executors[it->second];
+			if (registered.constructor == constructor && registered.step == step) {
+				return ExecutorHandle{ it->second };
+			}
+		}
+
+		const int index = executorCount.load();
+		if (index == MaxExecutorCount) {
+			throw std::length_error("Too many executors registered");
+		}
+		executors[index] = ExecutorEntry{ executorName, constructor, step };
+		// Entry is complete before readers can see the new count
+		executorCount.store(index + 1, std::memory_order_release);
+		executorIndices[executorName] = index;
+		return ExecutorHandle{ index };
+	}
+
+	TaskSystemExecutor::ExecutorHandle TaskSystemExecutor::FindExecutor(const std::string& executorName) const {
+		std::shared_lock<std::shared_mutex> lock(executorsMutex);
+		auto it = executorIndices.find(executorName);
+		return it != executorIndices.end() ? ExecutorHandle{ it->second } : ExecutorHandle{};
+	}
+
+	TaskSystemExecutor::ExecutorHandle TaskSystemExecutor::GetExecutorHandle(const std::string& executorName) const {
+		const ExecutorHandle executor = FindExecutor(executorName);
+		if (!executor.IsValid()) {
+			throw std::invalid_argument("No executor registered with name " + executorName);
+		}
+		return executor;
+	}
+
+	const TaskSystemExecutor::ExecutorEntry& TaskSystemExecutor::getExecutor(ExecutorHandle executor) const {
+		if (executor.index < 0 || executor.index >= executorCount.load(std::memory_order_acquire)) {
+			throw std::invalid_argument("Invalid executor handle");
+		}
+		return executors[executor.index];
+	}
+
+	bool TaskSystemExecutor::openLibrary(const std::string& path) {
 #ifdef USE_WIN
 		HMODULE handle = LoadLibraryA(path.c_str());
 #else
 		void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
 #endif
-		assert(handle);
 		if (handle) {
 			OnLibraryInitPtr initLib =
 #ifdef USE_WIN
@@ -40,13 +105,69 @@ namespace TaskSystem {
 #else
 				(OnLibraryInitPtr)dlsym(handle, "OnLibraryInit");
 #endif
-			assert(initLib);
 			if (initLib) {
 				initLib(*this);
-				printf("Initialized [%s] executor\n", path.c_str());
 				return true;
 			}
 		}
 		return false;
 	}
+
+	bool TaskSystemExecutor::LoadLibrary(const std::string& path) {
+		const bool loaded = openLibrary(path);
+		assert(loaded);
+		if (loaded) {
+			printf("Initialized [%s] executor\n", path.c_str());
+		}
+		return loaded;
+	}
+
+	std::vector<TaskSystemExecutor::LibraryLoadReport> TaskSystemExecutor::LoadAllLibraries(const std::string& directory) {
+		for (StaticExecutorRegistration* reg = StaticExecutorRegistration::First(); reg; reg = reg->next) {
+			Register(reg->executorName, reg->constructor, reg->step);
+		}
+
+#ifdef TS_EXECUTOR_PATH
+		const std::filesystem::path scanPath = directory.empty() ? TS_EXECUTOR_PATH : directory;
+#else
+		const std::filesystem::path scanPath = directory.empty() ? "." : directory;
+#endif
+#if defined(USE_WIN)
+		const std::string libraryExtension = ".dll";
+#elif defined(__APPLE__)
+		const std::string libraryExtension = ".dylib";
+#else
+		const std::string libraryExtension = ".so";
+#endif
+
+		std::vector<LibraryLoadReport> reports;
+		std::error_code error;
+		for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(scanPath, error)) {
+			if (file.is_regular_file(error) && file.path().extension() == libraryExtension) {
+				reports.push_back(LibraryLoadReport{ file.path().string() });
+			}
+		}
+
+		// Libraries register concurrently, the executor registry is safe for that
+		const auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> loaders;
+		for (LibraryLoadReport& report : reports) {
+			loaders.emplace_back([this, &report]() {
+				const auto loadStart = std::chrono::steady_clock::now();
+				report.loaded = openLibrary(report.path);
+				report.loadTime = std::chrono::steady_clock::now() - loadStart;
+			});
+		}
+		for (std::thread& loader : loaders) {
+			loader.join();
+		}
+		const std::chrono::duration<double, std::milli> totalTime = std::chrono::steady_clock::now() - start;
+
+		for (const LibraryLoadReport& report : reports) {
+			const std::chrono::duration<double, std::milli> loadTime = report.loadTime;
+			printf("%s [%s] in %.3fms\n", report.loaded ? "Initialized" : "Skipped", report.path.c_str(), loadTime.count());
+		}
+		printf("Loaded %d libraries from [%s] in %.3fms\n", int(reports.size()), scanPath.string().c_str(), totalTime.count());
+		return reports;
+	}
 };
@@ -3,9 +3,17 @@
 #include "Task.h"
 #include "Executor.h"
 #include "IdGenerator.h"
+#include "ResourceCache.h"
 
+#include <new>
 #include <map>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstddef>
+#include <optional>
 #include <functional>
+#include <type_traits>
 #include <atomic>
 #include <shared_mutex>
 #include<queue>
@@ -31,6 +39,8 @@ namespace TaskSystem {
 
 	void TS_LOAD_LIBARY(const std::string& libName, TaskSystem::TaskSystemExecutor& ts);
 
+	struct CompletionQueue;
+
 	/**
 	 * @brief The task system main class that can accept tasks to be scheduled and execute them on multiple threads
 	 *
@@ -73,16 +83,247 @@ namespace TaskSystem {
 		 * @return TaskID unique identifier used in later calls to wait or schedule callbacks for tasks
 		 */
 		virtual TaskID ScheduleTask(std::unique_ptr<Task> task, int priority) {
-			std::unique_ptr<Executor> exec(executorConstructors[task->GetExecutorName()](std::move(task)));
+			const ExecutorHandle executor = GetExecutorHandle(task->GetExecutorName());
+			return ScheduleTask(executor, std::move(task), priority);
+		}
 
-			while (exec->ExecuteStep(0, 1) != Executor::ExecStatus::ES_Stop)
-				;
+		/**
+		 * @brief Handle of a registered executor. Resolving a handle does not take locks or compare names
+		 *
+		 */
+		struct ExecutorHandle {
+			int index = -1;
+
+			bool IsValid() const {
+				return index >= 0;
+			}
+		};
+
+		/**
+		 * @brief Schedule a task with specific priority on an executor resolved in advance
+		 *
+		 * @param executor handle returned by Register or FindExecutor, throws std::invalid_argument if not valid
+		 * @param task the parameters describing the task, the executor name of the task is not used
+		 * @param priority the task priority, bigger means executer sooner
+		 * @return TaskID unique identifier used in later calls to wait or schedule callbacks for tasks
+		 */
+		virtual TaskID ScheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority) {
+			const ExecutorEntry& entry = getExecutor(executor);
+			std::unique_ptr<Executor> exec(entry.constructor(std::move(task)));
+
+			ScratchArena scratch;
+			std::unique_ptr<ScratchArena> taskScratch;
+			StepContext context(0, 1, scratch, taskScratch);
+			Executor::ExecStatus status;
+			do {
+				status = entry.step(*exec, context);
+				scratch.Reset();
+			} while (status != Executor::ExecStatus::ES_Stop);
 
 			return TaskID{};
 		}
 
 		/**
-		 * @brief Blocking wait for a given task. Does not block if the task has already finished
+		 * @brief Deadline of a real-time task
+		 *
+		 */
+		struct TaskDeadline {
+			/**
+			 * @brief Time point at which the task should have completed
+			 */
+			std::chrono::steady_clock::time_point deadline;
+
+			/**
+			 * @brief Expected total step time of the task. When empty it is predicted from previous tasks of the same executor
+			 */
+			std::optional<std::chrono::nanoseconds> estimatedCost;
+		};
+
+		/**
+		 * @brief Schedule a task with a deadline. Tasks with deadlines are executed earliest-deadline-first,
+		 *        before all tasks scheduled with only a priority
+		 *
+		 * @param task the parameters describing the task
+		 * @param priority the task priority, used if the task system does not support deadlines
+		 * @param deadline the deadline and optional cost estimate for the task
+		 * @return TaskID unique identifier used in later calls to wait or schedule callbacks for tasks
+		 */
+		virtual TaskID ScheduleTask(std::unique_ptr<Task> task, int priority, const TaskDeadline& deadline) {
+			const ExecutorHandle executor = GetExecutorHandle(task->GetExecutorName());
+			return ScheduleTask(executor, std::move(task), priority, deadline);
+		}
+
+		/**
+		 * @brief Schedule a task with a deadline on an executor resolved in advance
+		 *
+		 * @param executor handle returned by Register or FindExecutor, throws std::invalid_argument if not valid
+		 * @param task the parameters describing the task
+		 * @param priority the task priority, used if the task system does not support deadlines
+		 * @param deadline the deadline and optional cost estimate for the task
+		 * @return TaskID unique identifier used in later calls to wait or schedule callbacks for tasks
+		 */
+		virtual TaskID ScheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority, const TaskDeadline& deadline) {
+			return ScheduleTask(executor, std::move(task), priority);
+		}
+
+		/**
+		 * @brief Statistics collected for all tasks of one executor
+		 *
+		 */
+		struct ExecutorStats {
+			uint64_t steps = 0;
+			std::chrono::nanoseconds stepTime{ 0 };
+			uint64_t tasksCompleted = 0;
+			uint64_t deadlineTasks = 0;
+			uint64_t deadlineMisses = 0;
+			/// Memory reported by running tasks of the executor now, and the most they held together
+			size_t memoryBytes = 0;
+			size_t peakMemoryBytes = 0;
+			/// Largest and mean peak memory of a single completed task
+			size_t taskPeakMemoryBytes = 0;
+			size_t meanTaskPeakMemoryBytes = 0;
+
+			static const int StepHistogramBuckets = 32;
+			/// Step durations: bucket 0 counts steps under 1us, bucket b steps of [2^(b-1), 2^b) us, the last bucket all longer ones
+			std::array<uint64_t, StepHistogramBuckets> stepHistogram{};
+			/// Steps longer than the long step threshold, and the longest step
+			uint64_t longSteps = 0;
+			std::chrono::nanoseconds maxStepTime{ 0 };
+
+			/**
+			 * @brief Upper bound of the step duration below which the given fraction of steps completed
+			 *
+			 * @param fraction in [0, 1], e.g. 0.99 for the 99th percentile
+			 */
+			std::chrono::nanoseconds StepTimePercentile(double fraction) const {
+				uint64_t total = 0;
+				for (uint64_t count : stepHistogram) {
+					total += count;
+				}
+				uint64_t seen = 0;
+				for (int b = 0; b < StepHistogramBuckets; b++) {
+					seen += stepHistogram[b];
+					if (seen > 0 && double(seen) >= fraction * double(total)) {
+						return b + 1 < StepHistogramBuckets ? std::chrono::microseconds(int64_t(1) << b) : maxStepTime;
+					}
+				}
+				return std::chrono::nanoseconds(0);
+			}
+		};
+
+		/**
+		 * @brief Get statistics for each executor that had tasks scheduled
+		 *
+		 * @return map from executor name to collected statistics
+		 */
+		virtual std::map<std::string, ExecutorStats> GetExecutorStats() {
+			return {};
+		}
+
+		/**
+		 * @brief Set the time a step should take. Range executors size their chunks from the measured time per index,
+		 *        so that workers check for higher priority work about this often. 0 keeps the grain size of each range
+		 *
+		 */
+		virtual void SetStepQuantum(std::chrono::nanoseconds quantum) {
+			return;
+		}
+
+		/**
+		 * @brief Count steps taking longer than threshold in ExecutorStats::longSteps and report them on stderr, at most
+		 *        once per second for each executor. 0 disables the check
+		 *
+		 */
+		virtual void SetLongStepThreshold(std::chrono::nanoseconds threshold) {
+			return;
+		}
+
+		/**
+		 * @brief Memory reported by executors and the state of admission under the memory budget
+		 *
+		 */
+		struct MemoryStats {
+			size_t budget = 0;
+			/// Memory reported by all running tasks, and the most they held together
+			size_t memoryBytes = 0;
+			size_t peakMemoryBytes = 0;
+			/// Sum of the estimates of admitted tasks
+			size_t reservedBytes = 0;
+			int admittedTasks = 0;
+			/// Tasks waiting for memory, their executors are not constructed yet
+			int deferredTasks = 0;
+		};
+
+		/**
+		 * @brief Limit the memory of running tasks. A task is admitted when its estimate fits next to the larger of the
+		 *        reserved and the reported memory, otherwise its executor is only constructed once running tasks have
+		 *        released enough. A task is always admitted when no other task is, tasks scheduled from steps are not
+		 *        deferred since the scheduling task may wait for them. A task without any estimate waits until the
+		 *        admitted tasks of its executor have reported memory
+		 *
+		 * @param bytes the budget, 0 disables admission control
+		 */
+		virtual void SetMemoryBudget(size_t bytes) {
+			return;
+		}
+
+		/**
+		 * @brief Get reported memory and admission counters
+		 *
+		 */
+		virtual MemoryStats GetMemoryStats() {
+			return {};
+		}
+
+		/**
+		 * @brief Counters of tasks sharing work through Task::GetFingerprint
+		 *
+		 */
+		struct MemoStats {
+			/// Tasks completed from a memoized result without executing
+			uint64_t hits = 0;
+			/// Tasks with a fingerprint that had to be executed
+			uint64_t misses = 0;
+			/// Tasks attached to a running task with the same fingerprint
+			uint64_t coalesced = 0;
+			uint64_t evictions = 0;
+			size_t bytes = 0;
+			size_t entries = 0;
+		};
+
+		/**
+		 * @brief Get counters of coalesced and memoized tasks and the size of the memo cache
+		 *
+		 */
+		virtual MemoStats GetMemoStats() {
+			return {};
+		}
+
+		/**
+		 * @brief Limit the results kept for tasks with a fingerprint. Results older than ttl are not reused, least
+		 *        recently used ones are dropped while the total is above byteBudget. A zero budget disables memoization,
+		 *        identical running tasks are still coalesced
+		 *
+		 * @param byteBudget total of the sizes passed to PublishResult
+		 * @param ttl time a result stays reusable after its task completed
+		 */
+		virtual void SetMemoLimits(size_t byteBudget, std::chrono::milliseconds ttl) {
+			return;
+		}
+
+		/**
+		 * @brief Predict when a task will complete, based on the work queued ahead of it and measured step costs
+		 *
+		 * @param task the task to predict for
+		 * @return predicted completion time, empty if the task has completed or no prediction is possible
+		 */
+		virtual std::optional<std::chrono::steady_clock::time_point> PredictCompletion(TaskID task) {
+			return std::nullopt;
+		}
+
+		/**
+		 * @brief Blocking wait for a given task. Does not block if the task has already finished.
+		 *        The calling thread may execute pending work while waiting
 		 *
 		 * @param task the task to wait for
 		 */
@@ -90,6 +331,148 @@ namespace TaskSystem {
 			return;
 		}
 
+		/**
+		 * @brief Blocking wait for all scheduled tasks. The calling thread may execute pending work while waiting
+		 *
+		 */
+		virtual void WaitForAll() {
+			return;
+		}
+
+		/**
+		 * @brief Group of jobs spawned from inside a step, used to wait for all of them
+		 *
+		 */
+		struct TaskGroup {
+			std::atomic<int> pending = 0;
+		};
+
+		/**
+		 * @brief Job passed to Spawn, called as job(threadIndex, threadCount). Functors of up to InlineSize bytes
+		 *        are stored in the job itself so spawning does not allocate, larger ones are moved to the heap
+		 *
+		 */
+		class Job {
+		public:
+			static const size_t InlineSize = 64;
+
+			Job() = default;
+
+			template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Job>>>
+			Job(F&& f) {
+				typedef std::decay_t<F> Functor;
+				if constexpr (sizeof(Functor) <= InlineSize && alignof(Functor) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Functor>) {
+					new (storage) Functor(std::forward<F>(f));
+					ops = &inlineOps<Functor>;
+				}
+				else {
+					*reinterpret_cast<Functor**>(storage) = new Functor(std::forward<F>(f));
+					ops = &heapOps<Functor>;
+				}
+			}
+
+			Job(Job&& other) noexcept {
+				moveFrom(other);
+			}
+
+			Job& operator=(Job&& other) noexcept {
+				if (this != &other) {
+					reset();
+					moveFrom(other);
+				}
+				return *this;
+			}
+
+			Job(const Job&) = delete;
+			Job& operator=(const Job&) = delete;
+
+			~Job() {
+				reset();
+			}
+
+			void operator()(int threadIndex, int threadCount) {
+				ops->invoke(storage, threadIndex, threadCount);
+			}
+
+			explicit operator bool() const {
+				return ops != nullptr;
+			}
+
+		private:
+			struct Ops {
+				void (*invoke)(void* storage, int threadIndex, int threadCount);
+				/// Move constructs the functor in to and destroys it in from
+				void (*move)(void* to, void* from);
+				void (*destroy)(void* storage);
+			};
+
+			template <typename Functor>
+			static inline const Ops inlineOps = {
+				[](void* storage, int threadIndex, int threadCount) { (*static_cast<Functor*>(storage))(threadIndex, threadCount); },
+				[](void* to, void* from) {
+					new (to) Functor(std::move(*static_cast<Functor*>(from)));
+					static_cast<Functor*>(from)->~Functor();
+				},
+				[](void* storage) { static_cast<Functor*>(storage)->~Functor(); }
+			};
+
+			template <typename Functor>
+			static inline const Ops heapOps = {
+				[](void* storage, int threadIndex, int threadCount) { (**static_cast<Functor**>(storage))(threadIndex, threadCount); },
+				[](void* to, void* from) { *static_cast<Functor**>(to) = *static_cast<Functor**>(from); },
+				[](void* storage) { delete *static_cast<Functor**>(storage); }
+			};
+
+			void moveFrom(Job& other) {
+				if (other.ops) {
+					other.ops->move(storage, other.storage);
+					ops = other.ops;
+					other.ops = nullptr;
+				}
+			}
+
+			void reset() {
+				if (ops) {
+					ops->destroy(storage);
+					ops = nullptr;
+				}
+			}
+
+			alignas(std::max_align_t) unsigned char storage[InlineSize];
+			const Ops* ops = nullptr;
+		};
+
+		/**
+		 * @brief Spawn a job that may run in parallel with the caller. Jobs spawned from a worker are pushed to its
+		 *        local queue without locking. Other threads only steal them when they have no task step to execute,
+		 *        otherwise the jobs run when the spawning thread waits for the group
+		 *
+		 * @param group the group the job belongs to, must outlive the job
+		 * @param job the job to execute, receives the thread index and thread count of the slot running it
+		 */
+		virtual void Spawn(TaskGroup& group, Job&& job) {
+			job(0, 1);
+		}
+
+		/**
+		 * @brief Execute one job spawned by another slot. For steps that cannot make progress until jobs spawned by
+		 *        other steps of the task are done, which would otherwise keep their worker busy and the jobs unstolen
+		 *
+		 * @return true if a job was executed
+		 */
+		virtual bool StealJob() {
+			return false;
+		}
+
+		/**
+		 * @brief Blocking wait for all jobs spawned in the group. The calling thread executes spawned jobs while waiting
+		 *
+		 * @param group the group to wait for
+		 */
+		virtual void WaitForGroup(TaskGroup& group) {
+			return;
+		}
+
 		/**
 		 * @brief Register a callback to be executed when a task has finished executing. Executes the callbacl
 		 *        immediately if the task has already finished
@@ -101,6 +484,99 @@ namespace TaskSystem {
 			callback(task);
 		}
 
+		/**
+		 * @brief Push the task to a completion queue when its steps have finished executing. Pushes immediately
+		 *        if the task has already finished. Callbacks registered for the task may still be running
+		 *
+		 * @param task the task that was previously scheduled
+		 * @param queue the queue to push to, must outlive the task
+		 */
+		virtual void OnTaskCompleted(TaskID task, CompletionQueue& queue);
+
+		/**
+		 * @brief Move the result published by a finished task out of the task system. Later calls return an empty result
+		 *
+		 * @param task the task that was previously scheduled
+		 * @return the published result, empty if the task has not finished or published nothing
+		 */
+		virtual TaskResult TakeResult(TaskID task) {
+			return {};
+		}
+
+		/**
+		 * @brief Get the result published by a finished task, leaving it in the task system. The returned
+		 *        result shares the stored value and does not copy it
+		 *
+		 * @param task the task that was previously scheduled
+		 * @return the published result, empty if the task has not finished or published nothing
+		 */
+		virtual TaskResult GetResult(TaskID task) {
+			return {};
+		}
+
+		/**
+		 * @brief Get the latest snapshot published by a running task with Executor::PublishSnapshot, or the result
+		 *        once the task has finished. The returned result shares the stored value
+		 *
+		 * @param task the task that was previously scheduled
+		 * @return the snapshot or result, empty if nothing was published yet
+		 */
+		virtual TaskResult GetSnapshot(TaskID task) {
+			return {};
+		}
+
+		/**
+		 * @brief Ask a running task to finish early. The task still completes normally, executors that do not
+		 *        support stopping run to the end
+		 *
+		 * @param task the task that was previously scheduled
+		 */
+		virtual void RequestStop(TaskID task) {
+			return;
+		}
+
+		/**
+		 * @brief Change the priority of a scheduled task, e.g. raise the task a user is looking at.
+		 *        Has no effect on the order of deadline tasks
+		 *
+		 * @param task the task that was previously scheduled
+		 * @param priority the new priority
+		 */
+		virtual void SetTaskPriority(TaskID task, int priority) {
+			return;
+		}
+
+		/**
+		 * @brief Create a task that is executed outside of the task system, e.g. in another process. It can be waited for
+		 *        and have callbacks like any other task, and finishes when CompleteExternalTask is called
+		 *
+		 * @param name name used for the task in executor statistics
+		 * @return TaskID unique identifier of the task
+		 */
+		virtual TaskID BeginExternalTask(const std::string& name) {
+			return TaskID{};
+		}
+
+		/**
+		 * @brief Finish a task created with BeginExternalTask
+		 *
+		 * @param task the external task
+		 * @param result result of the task
+		 * @param failed true if the task could not be executed
+		 */
+		virtual void CompleteExternalTask(TaskID task, TaskResult result, bool failed) {
+			return;
+		}
+
+		/**
+		 * @brief Cache of resources shared between tasks. Executors reach it through Executor::taskSystem
+		 *
+		 * @return the cache, lives as long as the task system
+		 */
+		virtual ResourceCache& GetResourceCache() {
+			return resourceCache;
+		}
+
 		/**
 		 * @brief Load a dynamic library from a path and attempt to call OnLibraryInit
 		 *
@@ -109,16 +585,84 @@ namespace TaskSystem {
 		 */
 		virtual bool LoadLibrary(const std::string& path);
 
+		/**
+		 * @brief Outcome of loading one library with LoadAllLibraries
+		 *
+		 */
+		struct LibraryLoadReport {
+			std::string path;
+			std::chrono::nanoseconds loadTime{ 0 };
+			bool loaded = false;
+		};
+
+		/**
+		 * @brief Load every dynamic library in a directory in parallel, one thread per library, and print the
+		 *        load time of each. Files without OnLibraryInit are skipped. Executors linked into the
+		 *        application are registered as well
+		 *
+		 * @param directory the directory to scan, empty for the directory executors were installed to
+		 * @return report for each library found
+		 */
+		virtual std::vector<LibraryLoadReport> LoadAllLibraries(const std::string& directory = std::string());
+
 		/**
 		 * @brief Register an executor with a name and constructor function. Should be called from
-		 *        inside the dynamic libraries defining executors.
+		 *        inside the dynamic libraries defining executors. Safe to call concurrently with scheduling
+		 *        and with other registrations. Registering the same name and functions again returns the same handle,
+		 *        registering different functions for a name moves the name to a new handle
 		 *
 		 * @param executorName the name associated with the executor
 		 * @param constructor constructor returning new instance of the executor
+		 * @param step function executing steps of the executor, ExecuteStepOf<T> avoids the virtual call per step
+		 * @return ExecutorHandle handle that stays valid for the lifetime of the task system
+		 */
+		virtual ExecutorHandle Register(const std::string& executorName, ExecutorConstructor constructor, ExecutorStepFunction step = &ExecuteStepVirtual);
+
+		/**
+		 * @brief Register an executor type with a name. Steps are executed without virtual calls
+		 *
+		 * @tparam T the executor type, constructible from std::unique_ptr<Task>
+		 * @param executorName the name associated with the executor
+		 * @return ExecutorHandle handle that stays valid for the lifetime of the task system
+		 */
+		template <typename T>
+		ExecutorHandle RegisterExecutor(const std::string& executorName) {
+			return Register(executorName, &ConstructExecutor<T>, &ExecuteStepOf<T>);
+		}
+
+		/**
+		 * @brief Find the executor currently registered with a name
+		 *
+		 * @param executorName the name associated with the executor
+		 * @return ExecutorHandle the handle, not valid if no executor was registered with the name
+		 */
+		ExecutorHandle FindExecutor(const std::string& executorName) const;
+
+		/**
+		 * @brief Find the executor currently registered with a name
+		 *
+		 * @param executorName the name associated with the executor
+		 * @return ExecutorHandle the handle, throws std::invalid_argument if no executor was registered with the name
+		 */
+		ExecutorHandle GetExecutorHandle(const std::string& executorName) const;
+
+		/**
+		 * @brief Get the name an executor handle was registered with
+		 *
+		 * @param executor a valid handle
+		 * @return the executor name
 		 */
-		virtual void Register(const std::string& executorName, ExecutorConstructor constructor) {
-			executorConstructors[executorName] = constructor;
+		const std::string& GetExecutorName(ExecutorHandle executor) const {
+			return getExecutor(executor).name;
 		}
+
+		/**
+		 * @brief Register all executors of a library that was linked into the application with TS_STATIC_EXECUTORS
+		 *
+		 * @param libName the library name, as passed to TS_LOAD_LIBARY
+		 * @return true if the library was linked in
+		 */
+		bool RegisterStaticLibrary(const std::string& libName);
 		
 		/// <summary>
 		/// Stop worker threads. Delete instance of TaskSystemExecutor.
@@ -126,7 +670,46 @@ namespace TaskSystem {
 		virtual void Terminate() {};
 
 	protected:
+		/**
+		 * @brief Registered executor, the step function is stored next to the constructor so it is resolved with the same lookup
+		 *
+		 */
+		struct ExecutorEntry {
+			std::string name;
+			ExecutorConstructor constructor = nullptr;
+			ExecutorStepFunction step = &ExecuteStepVirtual;
+		};
+
+		/**
+		 * @brief Resolve a handle without locking, throws std::invalid_argument if the handle is not valid
+		 *
+		 */
+		const ExecutorEntry& getExecutor(ExecutorHandle executor) const;
+
+		/**
+		 * @brief Load a library, returns false instead of asserting if it can not be loaded
+		 *
+		 */
+		bool openLibrary(const std::string& path);
+
 		static TaskSystemExecutor* self;
-		std::map<std::string, ExecutorConstructor> executorConstructors;
+
+		/**
+		 * @brief Registered executors. Entries are written once before executorCount is increased and never move,
+		 *        so handles are resolved without locks
+		 *
+		 */
+		static const int MaxExecutorCount = 256;
+		std::array<ExecutorEntry, MaxExecutorCount> executors;
+		std::atomic<int> executorCount = 0;
+
+		/**
+		 * @brief Handle index of each name, guarded by executorsMutex. Registration is serialized by the same lock
+		 *
+		 */
+		std::map<std::string, int> executorIndices;
+		mutable std::shared_mutex executorsMutex;
+
+		ResourceCache resourceCache;
 	};
 };
\ No newline at end of file
@@ -1,13 +1,37 @@
 #include <cassert>
+#include <cstdio>
 #include<iostream>
 #include <shared_mutex>
+#include <algorithm>
+#include <chrono>
 #include "TaskSystemImpl.h"
 
 typedef TaskSystem::TaskSystemExecutor::TaskID TaskID;
 
 
 namespace TaskSystem {
+	namespace {
+		/// <summary>
+		/// Slot of the calling thread: worker index, borrowed helper slot or -1.
+		/// </summary>
+		thread_local int currentSlot = -1;
+
+		/// <summary>
+		/// Executors whose steps are currently on the calling thread's stack. Used to avoid re-entering
+		/// the same executor when a step waits for another task.
+		/// </summary>
+		thread_local std::vector<const void*> executingStack;
+
+		bool isExecutingOnThisThread(const void* context) {
+			return std::find(executingStack.begin(), executingStack.end(), context) != executingStack.end();
+		}
+	}
+
 	void TS_LOAD_LIBARY(const std::string& libName, TaskSystem::TaskSystemExecutor& ts) {
+		// Executors linked into the application need no dynamic library
+		if (ts.RegisterStaticLibrary(libName)) {
+			return;
+		}
 #if defined(_WIN32) || defined(_WIN64)
 		const bool libLoaded = ts.LoadLibrary(libName + ".dll");
 #elif defined(__APPLE__)
@@ -20,22 +44,64 @@ namespace TaskSystem {
 
 
 	TaskID TaskSystemExecutorImpl::ScheduleTask(std::unique_ptr<Task> task, int priority) {
+		const ExecutorHandle executor = GetExecutorHandle(task->GetExecutorName());
+		return scheduleTask(executor, std::move(task), priority, std::nullopt);
+	}
+
+	TaskID TaskSystemExecutorImpl::ScheduleTask(std::unique_ptr<Task> task, int priority, const TaskDeadline& deadline) {
+		const ExecutorHandle executor = GetExecutorHandle(task->GetExecutorName());
+		return scheduleTask(executor, std::move(task), priority, deadline);
+	}
+
+	TaskID TaskSystemExecutorImpl::ScheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority) {
+		return scheduleTask(executor, std::move(task), priority, std::nullopt);
+	}
+
+	TaskID TaskSystemExecutorImpl::ScheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority, const TaskDeadline& deadline) {
+		return scheduleTask(executor, std::move(task), priority, deadline);
+	}
+
+	TaskSystemExecutorImpl::ExecutorStatsCounters* TaskSystemExecutorImpl::getStats(const std::string& name) {
+		std::lock_guard<std::mutex> statsLock(executorStatsMutex);
+		ExecutorStatsCounters& counters = executorStats[name];
+		counters.memory.parent = &memoryTotal;
+		return &counters;
+	}
+
+	TaskID TaskSystemExecutorImpl::scheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority, const std::optional<TaskDeadline>& deadline) {
 		logThread("Starting task schedule. Init task context.", 999999);
 
-		// Create executor instance
-		std::string execName = task->GetExecutorName();
-		std::shared_ptr<Executor> exec(executorConstructors[execName](std::move(task)));
+		const ExecutorEntry& entry = getExecutor(executor);
+		std::shared_ptr<TaskContext> tc = std::make_shared<TaskContext>();
+		tc->priority = priority;
+		tc->deadline = deadline;
+
+		// Identical tasks share work, no executor is created for a task served by a running task or memoized result
+		if (const std::optional<std::string> fingerprint = task->GetFingerprint()) {
+			if (const std::optional<TaskID> shared = shareTask(*fingerprint, entry.name, tc)) {
+				return *shared;
+			}
+		}
+
 		TaskID tid = { idGen.getId() };
 
-		// Create task context instance
-		std::shared_ptr<TaskContext> tc = std::make_shared<TaskContext>();
-		tc->exec = exec;
+		// Fill task context instance, the executor is added once the task is admitted
+		tc->step = entry.step;
+		tc->executor = executor;
 		tc->taskComplete = std::make_shared<std::atomic<bool>>();
 		tc->callbacksComplete = std::make_shared<std::atomic<bool>>();
 		tc->taskComplete->store(false);
 		tc->callbacksComplete->store(false);
-		tc->priority = priority;
+		tc->scheduledAt = std::chrono::steady_clock::now();
+		tc->taskScratch.reset(new std::unique_ptr<ScratchArena>[slotCount]);
 		tc->id = tid;
+		tc->stats = handleStats[executor.index].load();
+		if (!tc->stats) {
+			tc->stats = getStats(entry.name);
+			handleStats[executor.index].store(tc->stats);
+		}
+
+		pendingTasks++;
 
 		// Insert task context into task map
 		{
@@ -47,7 +113,37 @@ namespace TaskSystem {
 
 			logThread("Unlocking Task Map Write Lock.", 999999);
 		}
-		
+
+		// Tasks not fitting the memory budget wait without an executor. Callbacks and tasks scheduled from steps are
+		// always admitted, the scheduling task may be waiting for them
+		if (executor.index == callbackExecutor.index || !executingStack.empty() || admitTask(tc, task)) {
+			startTask(tc, std::move(task));
+		}
+		logThread("End of task schedule", 999999);
+		return tid;
+	}
+
+	void TaskSystemExecutorImpl::startTask(const std::shared_ptr<TaskContext>& tc, std::unique_ptr<Task> task) {
+		// Reuse a finished executor if one was recycled, otherwise create executor instance
+		std::shared_ptr<Executor> exec = takeRecycledExecutor(tc->executor);
+		if (exec) {
+			exec->Reset(std::move(task));
+		}
+		else {
+			exec.reset(getExecutor(tc->executor).constructor(std::move(task)));
+		}
+		exec->taskSystem = this;
+		exec->stepQuantum = std::chrono::nanoseconds(stepQuantumNs.load(std::memory_order_relaxed));
+		exec->memory.Attach(&tc->stats->memory);
+		{
+			std::lock_guard<std::mutex> resultLock(tc->waitMutex);
+			tc->exec = exec;
+			tc->hasExecutor.store(true, std::memory_order_release);
+			if (tc->stopRequested) {
+				exec->RequestStop();
+			}
+		}
+
 		// Insert task context into task priority queue. Set cur_executed_task to be new highest priority task.
 		{
 			logThread("Trying to lock Task PQ Write Lock.", 999999);
@@ -61,46 +157,637 @@ namespace TaskSystem {
 			
 			logThread("Unlocking Task PQ Write Lock.", 999999);
 		}
-		logThread("End of task schedule", 999999);
+	}
+
+	std::optional<size_t> TaskSystemExecutorImpl::estimateMemory(const TaskContext& context, const Task& task) {
+		if (const std::optional<size_t> estimate = task.GetMemoryEstimate()) {
+			return estimate;
+		}
+		const uint64_t completed = context.stats->tasksCompleted;
+		if (completed > 0) {
+			return size_t(context.stats->completedPeakBytes / int64_t(completed));
+		}
+		// No task of the executor has completed yet, assume the task needs as much as the ones that reported hold on average
+		const int reporting = context.stats->reportedTasks;
+		const int64_t reported = context.stats->memory.bytes;
+		if (reporting > 0 && reported > 0) {
+			return size_t(reported / reporting);
+		}
+		return std::nullopt;
+	}
+
+	bool TaskSystemExecutorImpl::canAdmit(TaskContext& context, const Task& task) {
+		const std::optional<size_t> estimate = estimateMemory(context, task);
+		context.memoryReservation = estimate.value_or(0);
+		if (!estimate && memoryBudget != 0 && context.stats->admittedTasks > 0) {
+			return false;
+		}
+		return fitsMemoryBudget(context.memoryReservation);
+	}
+
+	bool TaskSystemExecutorImpl::fitsMemoryBudget(size_t estimate) const {
+		if (memoryBudget == 0 || admittedTasks == 0) {
+			return true;
+		}
+		const int64_t committed = std::max<int64_t>(reservedBytes, memoryTotal.bytes);
+		return committed + int64_t(estimate) <= int64_t(memoryBudget);
+	}
+
+	bool TaskSystemExecutorImpl::admitTask(const std::shared_ptr<TaskContext>& context, std::unique_ptr<Task>& task) {
+		std::lock_guard<std::mutex> admissionLock(admissionMutex);
+		if (!deferredTasks.empty() || !canAdmit(*context, *task)) {
+			// Deferred tasks are admitted in order, a small task does not overtake them
+			context->deferredTask = std::move(task);
+			deferredTasks.push_back(context);
+			return false;
+		}
+		reserveMemory(*context);
+		return true;
+	}
+
+	void TaskSystemExecutorImpl::memoryReportedBy(TaskContext& context) {
+		{
+			std::lock_guard<std::mutex> admissionLock(admissionMutex);
+			if (context.memoryReported.exchange(true) || !context.admitted) {
+				return;
+			}
+			context.stats->reportedTasks++;
+			if (context.memoryReservation == 0) {
+				context.memoryReservation = size_t(context.exec->memory.peakBytes.load(std::memory_order_relaxed));
+				reservedBytes += int64_t(context.memoryReservation);
+			}
+		}
+		admitDeferred();
+	}
+
+	void TaskSystemExecutorImpl::reserveMemory(TaskContext& context) {
+		context.admitted = true;
+		reservedBytes += int64_t(context.memoryReservation);
+		admittedTasks++;
+		context.stats->admittedTasks++;
+	}
+
+	void TaskSystemExecutorImpl::admitDeferred() {
+		for (;;) {
+			std::shared_ptr<TaskContext> next;
+			std::unique_ptr<Task> task;
+			{
+				std::lock_guard<std::mutex> admissionLock(admissionMutex);
+				if (deferredTasks.empty()) {
+					return;
+				}
+
+				// Deadline tasks first by deadline, then by priority, then in order of scheduling
+				auto before = [](const std::shared_ptr<TaskContext>& a, const std::shared_ptr<TaskContext>& b) {
+					if (a->deadline || b->deadline) {
+						return b->deadline && (!a->deadline || a->deadline->deadline < b->deadline->deadline);
+					}
+					return a->priority > b->priority;
+				};
+				auto best = deferredTasks.begin();
+				for (auto it = deferredTasks.begin(); it != deferredTasks.end(); ++it) {
+					if (before(*it, *best)) {
+						best = it;
+					}
+				}
+				// Estimated again, tasks of the executor may have reported or completed since it was deferred
+				if (!canAdmit(**best, *(*best)->deferredTask)) {
+					return;
+				}
+				next = *best;
+				deferredTasks.erase(best);
+				task = std::move(next->deferredTask);
+				reserveMemory(*next);
+			}
+			startTask(next, std::move(task));
+		}
+	}
+
+	void TaskSystemExecutorImpl::SetMemoryBudget(size_t bytes) {
+		{
+			std::lock_guard<std::mutex> admissionLock(admissionMutex);
+			memoryBudget = bytes;
+		}
+		admitDeferred();
+	}
+
+	TaskSystemExecutor::MemoryStats TaskSystemExecutorImpl::GetMemoryStats() {
+		std::lock_guard<std::mutex> admissionLock(admissionMutex);
+		MemoryStats stats;
+		stats.budget = memoryBudget;
+		stats.memoryBytes = size_t(std::max<int64_t>(memoryTotal.bytes, 0));
+		stats.peakMemoryBytes = size_t(memoryTotal.peakBytes.load());
+		stats.reservedBytes = size_t(reservedBytes);
+		stats.admittedTasks = admittedTasks;
+		stats.deferredTasks = int(deferredTasks.size());
+		return stats;
+	}
+
+	std::optional<TaskID> TaskSystemExecutorImpl::shareTask(const std::string& fingerprint, const std::string& executorName, const std::shared_ptr<TaskContext>& context) {
+		TaskResult memoized;
+		std::shared_ptr<TaskContext> leader;
+		TaskID tid;
+		{
+			std::lock_guard<std::mutex> memoLock(memoMutex);
+			auto cached = memo.find(fingerprint);
+			if (cached != memo.end() && std::chrono::steady_clock::now() - cached->second.completedAt > memoTtl) {
+				memoStats.bytes -= cached->second.result.GetSize();
+				memoStats.evictions++;
+				memoLru.erase(cached->second.lruPosition);
+				memo.erase(cached);
+				cached = memo.end();
+			}
+
+			if (cached != memo.end()) {
+				memoStats.hits++;
+				memoLru.splice(memoLru.end(), memoLru, cached->second.lruPosition);
+				memoized = cached->second.result;
+			}
+			else {
+				auto running = sharedTasks.find(fingerprint);
+				if (running == sharedTasks.end()) {
+					// First of its kind, executed normally and completes the identical tasks scheduled meanwhile
+					memoStats.misses++;
+					context->fingerprint = fingerprint;
+					sharedTasks[fingerprint] = context;
+					return std::nullopt;
+				}
+
+				// Attach while holding the lock, so the running task cannot complete without this one
+				memoStats.coalesced++;
+				leader = running->second;
+				tid = BeginExternalTask(executorName);
+				std::shared_ptr<TaskContext> follower = getContext(tid);
+				follower->sharedResult = true;
+				follower->priority = context->priority.load();
+				follower->deadline = context->deadline;
+				leader->followers.push_back(follower);
+			}
+		}
+
+		if (!leader) {
+			tid = BeginExternalTask(executorName);
+			getContext(tid)->sharedResult = true;
+			CompleteExternalTask(tid, std::move(memoized), false);
+			return tid;
+		}
+
+		// The running task now executes for a more important task too. Deadline tasks keep their scheduling class
+		if (!leader->deadline && !context->deadline) {
+			std::unique_lock<std::shared_mutex> taskPQWriteLock(taskPQMutex);
+			if (context->priority > leader->priority) {
+				leader->priority = context->priority.load();
+				taskPQ.update();
+				if (!taskPQ.empty()) {
+					setCurExecutedTask(taskPQ.top().get());
+				}
+			}
+		}
 		return tid;
 	}
 
+	void TaskSystemExecutorImpl::finishSharedTask(TaskContext* context, const TaskResult& result) {
+		std::vector<std::shared_ptr<TaskContext>> followers;
+		{
+			std::lock_guard<std::mutex> memoLock(memoMutex);
+			auto running = sharedTasks.find(context->fingerprint);
+			if (running != sharedTasks.end() && running->second.get() == context) {
+				sharedTasks.erase(running);
+			}
+			followers.swap(context->followers);
+
+			// Failed results are not memoized, the next identical task is executed again
+			if (!context->failed && result.HasValue() && result.GetSize() <= memoBudget) {
+				auto existing = memo.find(context->fingerprint);
+				if (existing != memo.end()) {
+					memoStats.bytes -= existing->second.result.GetSize();
+					memoLru.erase(existing->second.lruPosition);
+					memo.erase(existing);
+				}
+				MemoEntry& entry = memo[context->fingerprint];
+				entry.result = result;
+				entry.completedAt = context->completedAt;
+				entry.lruPosition = memoLru.insert(memoLru.end(), context->fingerprint);
+				memoStats.bytes += result.GetSize();
+				evictMemo();
+			}
+		}
+
+		for (const std::shared_ptr<TaskContext>& follower : followers) {
+			if (follower->stepsDone.exchange(true)) {
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> resultLock(follower->waitMutex);
+				follower->result = result;
+				follower->failed = context->failed;
+			}
+			completeTask(follower.get());
+		}
+	}
+
+	void TaskSystemExecutorImpl::evictMemo() {
+		const auto now = std::chrono::steady_clock::now();
+		for (auto it = memoLru.begin(); it != memoLru.end();) {
+			auto entry = memo.find(*it);
+			if (now - entry->second.completedAt <= memoTtl && memoStats.bytes <= memoBudget) {
+				++it;
+				continue;
+			}
+			memoStats.bytes -= entry->second.result.GetSize();
+			memoStats.evictions++;
+			memo.erase(entry);
+			it = memoLru.erase(it);
+		}
+	}
+
+	TaskSystemExecutor::MemoStats TaskSystemExecutorImpl::GetMemoStats() {
+		std::lock_guard<std::mutex> memoLock(memoMutex);
+		MemoStats stats = memoStats;
+		stats.entries = memo.size();
+		return stats;
+	}
+
+	void TaskSystemExecutorImpl::SetMemoLimits(size_t byteBudget, std::chrono::milliseconds ttl) {
+		std::lock_guard<std::mutex> memoLock(memoMutex);
+		memoBudget = byteBudget;
+		memoTtl = ttl;
+		evictMemo();
+	}
+
+	std::shared_ptr<TaskSystemExecutorImpl::TaskContext> TaskSystemExecutorImpl::getContext(TaskID task) {
+		std::shared_lock<std::shared_mutex> taskMapReadLock(TaskMapMutex);
+		auto it = idTaskMap.find(task);
+		if (it == idTaskMap.end()) {
+			throw std::invalid_argument("Unknown taskId");
+		}
+		return it->second;
+	}
+
+	std::map<std::string, TaskSystemExecutor::ExecutorStats> TaskSystemExecutorImpl::GetExecutorStats() {
+		std::map<std::string, ExecutorStats> result;
+		std::lock_guard<std::mutex> statsLock(executorStatsMutex);
+		for (const auto& [name, counters] : executorStats) {
+			ExecutorStats& stats = result[name];
+			stats.steps = counters.steps;
+			stats.stepTime = std::chrono::nanoseconds(counters.stepTimeNs.load());
+			stats.tasksCompleted = counters.tasksCompleted;
+			stats.deadlineTasks = counters.deadlineTasks;
+			stats.deadlineMisses = counters.deadlineMisses;
+			stats.memoryBytes = size_t(std::max<int64_t>(counters.memory.bytes, 0));
+			stats.peakMemoryBytes = size_t(counters.memory.peakBytes.load());
+			stats.taskPeakMemoryBytes = size_t(counters.taskPeakBytes.load());
+			if (stats.tasksCompleted > 0) {
+				stats.meanTaskPeakMemoryBytes = size_t(counters.completedPeakBytes / int64_t(stats.tasksCompleted));
+			}
+			for (int b = 0; b < ExecutorStats::StepHistogramBuckets; b++) {
+				stats.stepHistogram[b] = counters.stepHistogram[b];
+			}
+			stats.longSteps = counters.longSteps;
+			stats.maxStepTime = std::chrono::nanoseconds(counters.maxStepNs.load());
+		}
+		return result;
+	}
+
+	std::chrono::nanoseconds TaskSystemExecutorImpl::remainingCost(const TaskContext& context) {
+		int64_t expectedNs;
+		if (context.deadline && context.deadline->estimatedCost) {
+			expectedNs = context.deadline->estimatedCost->count();
+		}
+		else {
+			const uint64_t completed = context.stats->tasksCompleted;
+			if (completed == 0) {
+				return std::chrono::nanoseconds(0);
+			}
+			expectedNs = context.stats->completedTaskTimeNs / int64_t(completed);
+		}
+		return std::chrono::nanoseconds(std::max<int64_t>(expectedNs - context.stepTimeNs, 0));
+	}
+
+	std::optional<std::chrono::steady_clock::time_point> TaskSystemExecutorImpl::PredictCompletion(TaskID task) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		if (context->stepsDone) {
+			return std::nullopt;
+		}
+
+		// Sum remaining cost of all tasks ordered before this one, including itself. Tasks with the same deadline or
+		// priority are ordered by scheduling time, so the ones scheduled later are not counted
+		std::chrono::nanoseconds costAhead(0);
+		{
+			std::shared_lock<std::shared_mutex> pqReadLock(taskPQMutex);
+			for (const std::shared_ptr<TaskContext>& queued : taskPQ.items()) {
+				if (!TaskContext::CMP_priority()(queued, context)) {
+					costAhead += remainingCost(*queued);
+				}
+			}
+		}
+		return std::chrono::steady_clock::now() + costAhead / threadCount;
+	}
+
 	void TaskSystemExecutorImpl::WaitForTask(TaskID task) {
-		std::shared_ptr<TaskContext> cur_task;
-		
 		// Get desired task context
+		std::shared_ptr<TaskContext> cur_task = getContext(task);
+		std::shared_ptr<std::atomic<bool>> callbacksComplete = cur_task->callbacksComplete;
+
+		// Execute work until callbacksComplete is set
+		helpUntil(cur_task.get(), [callbacksComplete] {
+			return callbacksComplete->load();
+		});
+	}
+
+	void TaskSystemExecutorImpl::WaitForAll() {
+		// Tasks executed further up this thread's stack can not complete while we wait
+		const int ownTasks = int(executingStack.size());
+		helpUntil(nullptr, [this, ownTasks] {
+			return pendingTasks.load() <= ownTasks;
+		});
+	}
+
+	void TaskSystemExecutorImpl::OnTaskCompleted(TaskID task, std::function<void(TaskID)>&& callback) {
+		std::shared_ptr<TaskContext> context = getContext(task);
 		{
-			std::shared_lock<std::shared_mutex> taskMapReadLock(TaskMapMutex);
-			if (!idTaskMap.count(task)) {
-				throw std::invalid_argument("Trying to wait for task with invalid taskId");
+			std::lock_guard<std::mutex> callbackLock(context->waitMutex);
+			if (!context->taskComplete->load()) {
+				// Save callback for later calls
+				context->onCompleteCallbacks.push_back(std::move(callback));
+				return;
 			}
-			cur_task = idTaskMap[task];
 		}
 
-		std::shared_ptr<std::atomic<bool>> callbacksComplete = cur_task->callbacksComplete;
-		
-		// Wait for callbacksComplete to be set
+		// Steps have already completed and callback list is no longer read - call now
+		callback(task);
+	}
+
+	void TaskSystemExecutorImpl::OnTaskCompleted(TaskID task, CompletionQueue& queue) {
+		std::shared_ptr<TaskContext> context = getContext(task);
 		{
-			std::unique_lock<std::mutex> waitLock(idTaskMap[task]->waitMutex);
+			std::lock_guard<std::mutex> callbackLock(context->waitMutex);
+			if (!context->taskComplete->load()) {
+				context->completionQueues.push_back(&queue);
+				return;
+			}
+		}
+		queue.Push(makeCompletion(*context));
+	}
 
-			cur_task->cv.wait(waitLock, [callbacksComplete] {
-				logThread("@@@Checking for condition" + callbacksComplete->load(), 999999);
-				return callbacksComplete->load();
-				});
+	TaskResult TaskSystemExecutorImpl::TakeResult(TaskID task) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		std::lock_guard<std::mutex> resultLock(context->waitMutex);
+		return std::move(context->result);
+	}
+
+	TaskResult TaskSystemExecutorImpl::GetResult(TaskID task) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		std::lock_guard<std::mutex> resultLock(context->waitMutex);
+		return context->result;
+	}
+
+	TaskResult TaskSystemExecutorImpl::GetSnapshot(TaskID task) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		std::lock_guard<std::mutex> resultLock(context->waitMutex);
+		// The executor is not recycled before taskComplete is set under waitMutex
+		if (context->taskComplete->load() || !context->exec) {
+			return context->result;
 		}
+		return context->exec->GetSnapshot();
 	}
 
-	void TaskSystemExecutorImpl::OnTaskCompleted(TaskID task, std::function<void(TaskID)>&& callback) {
-		std::unique_lock<std::shared_mutex> TaskMapWriteLock(TaskMapMutex);
+	void TaskSystemExecutorImpl::RequestStop(TaskID task) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		std::lock_guard<std::mutex> resultLock(context->waitMutex);
+		if (!context->taskComplete->load() && context->exec) {
+			context->exec->RequestStop();
+		}
+		else if (!context->exec) {
+			// Deferred tasks get the request once their executor is constructed
+			context->stopRequested = true;
+		}
+	}
+
+	void TaskSystemExecutorImpl::SetTaskPriority(TaskID task, int priority) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		std::unique_lock<std::shared_mutex> taskPQWriteLock(taskPQMutex);
+		context->priority = priority;
+		taskPQ.update();
+		if (!taskPQ.empty()) {
+			setCurExecutedTask(taskPQ.top().get());
+		}
+	}
+
+	TaskID TaskSystemExecutorImpl::BeginExternalTask(const std::string& name) {
+		TaskID tid = { idGen.getId() };
+
+		std::shared_ptr<TaskContext> tc = std::make_shared<TaskContext>();
+		tc->taskComplete = std::make_shared<std::atomic<bool>>(false);
+		tc->callbacksComplete = std::make_shared<std::atomic<bool>>(false);
+		tc->id = tid;
+		tc->scheduledAt = tc->startedAt = std::chrono::steady_clock::now();
+		tc->started = true;
+		tc->stats = getStats(name);
+
+		pendingTasks++;
+
+		// External tasks are only inserted into task map, workers never execute them
+		{
+			std::unique_lock<std::shared_mutex> taskMapWriteLock(TaskMapMutex);
+			idTaskMap[tid] = tc;
+		}
+		return tid;
+	}
+
+	void TaskSystemExecutorImpl::CompleteExternalTask(TaskID task, TaskResult result, bool failed) {
+		std::shared_ptr<TaskContext> context = getContext(task);
+		if (context->executor.IsValid() || context->stepsDone.exchange(true)) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> resultLock(context->waitMutex);
+			context->result = std::move(result);
+			context->failed = failed;
+		}
+		completeTask(context.get());
+	}
+
+	CompletionQueue::Completion TaskSystemExecutorImpl::makeCompletion(const TaskContext& context) {
+		const bool missed = context.deadline && context.completedAt > context.deadline->deadline;
+		return {
+			context.id,
+			context.failed ? CompletionQueue::CS_Failed : missed ? CompletionQueue::CS_DeadlineMissed : CompletionQueue::CS_Completed,
+			context.scheduledAt,
+			context.startedAt,
+			context.completedAt,
+			size_t(context.peakMemoryBytes)
+		};
+	}
+
+	void TaskSystemExecutorImpl::Spawn(TaskGroup& group, Job&& job) {
+		SpawnedJob spawned{ std::move(job), &group };
+		group.pending.fetch_add(1, std::memory_order_relaxed);
+
+		if (currentSlot == -1) {
+			{
+				std::lock_guard<std::mutex> sharedLock(sharedJobsMutex);
+				sharedJobs.push_back(std::move(spawned));
+				sharedJobCount++;
+			}
+			wakeThief();
+			return;
+		}
+
+		JobQueue& queue = *jobQueues[currentSlot];
+		if (!queue.Push(spawned)) {
+			// Queue is full - running the job now keeps the same semantics as if it was never stolen
+			runJob(spawned, currentSlot);
+			return;
+		}
+
+		// The newest job is popped back by the owner when it waits for the group, only wake a thief for the ones
+		// queued before it. Thieves wake further sleeping workers while jobs are left
+		if (queue.Size() > 1) {
+			wakeThief();
+		}
+	}
+
+	void TaskSystemExecutorImpl::wakeThief() {
+		// Pairs with the fence in the workerFun wait predicate, either the worker sees the job or this sees the sleeping worker
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleepingWorkers.load(std::memory_order_relaxed) > 0) {
+			{
+				std::lock_guard<std::mutex> noWorkLock(noWorkMutex);
+			}
+			noWorkCV.notify_one();
+		}
+	}
+
+	void TaskSystemExecutorImpl::WaitForGroup(TaskGroup& group) {
+		// Most jobs are still in the own queue, run them before setting up the wait
+		while (group.pending.load() != 0 && currentSlot != -1 && runOwnJob(currentSlot))
+			;
+		if (group.pending.load() == 0) {
+			return;
+		}
+		helpUntil(nullptr, [&group] {
+			return group.pending.load() == 0;
+		});
+	}
+
+	bool TaskSystemExecutorImpl::StealJob() {
+		return currentSlot != -1 && stealJob(currentSlot);
+	}
+
+	bool TaskSystemExecutorImpl::JobQueue::Push(SpawnedJob& spawned) {
+		const int64_t b = bottom.load(std::memory_order_relaxed);
+		const int64_t t = top.load(std::memory_order_acquire);
+		Cell& cell = cells[b % Capacity];
+		// Full, or a thief has claimed the job in this cell and not moved it out yet
+		if (b - t >= Capacity || cell.full.load(std::memory_order_acquire)) {
+			return false;
+		}
+		cell.spawned = std::move(spawned);
+		cell.full.store(true, std::memory_order_relaxed);
+		bottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool TaskSystemExecutorImpl::JobQueue::Pop(SpawnedJob& spawned) {
+		const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+		if (t == b) {
+			// Last job - thieves may be claiming it too
+			const bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			if (!won) {
+				return false;
+			}
+		}
+		take(b, spawned);
+		return true;
+	}
+
+	bool TaskSystemExecutorImpl::JobQueue::Steal(SpawnedJob& spawned) {
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const int64_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b || !top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			return false;
+		}
+		take(t, spawned);
+		return true;
+	}
+
+	void TaskSystemExecutorImpl::JobQueue::take(int64_t index, SpawnedJob& spawned) {
+		Cell& cell = cells[index % Capacity];
+		spawned = std::move(cell.spawned);
+		cell.full.store(false, std::memory_order_release);
+	}
+
+	bool TaskSystemExecutorImpl::runOwnJob(int slot) {
+		SpawnedJob spawned;
+		if (!jobQueues[slot]->Pop(spawned)) {
+			return false;
+		}
+		runJob(spawned, slot);
+		return true;
+	}
+
+	bool TaskSystemExecutorImpl::stealJob(int slot) {
+		SpawnedJob spawned;
+		bool found = false;
+
+		// Oldest job of the other slots, starting after this one so thieves spread over the queues
+		for (int c = 1; !found && c < slotCount; c++) {
+			found = jobQueues[(slot + c) % slotCount]->Steal(spawned);
+		}
+
+		if (!found && sharedJobCount.load() > 0) {
+			std::lock_guard<std::mutex> sharedLock(sharedJobsMutex);
+			if (!sharedJobs.empty()) {
+				spawned = std::move(sharedJobs.front());
+				sharedJobs.pop_front();
+				sharedJobCount--;
+				found = true;
+			}
+		}
 
-		// TODO: Remove Locking taskMap mutex
- 
-		// Save callback for later calls
-		idTaskMap[task]->onCompleteCallbacks.push_back(callback);
+		if (!found) {
+			return false;
+		}
+		if (hasQueuedJobs()) {
+			wakeThief();
+		}
+		runJob(spawned, slot);
+		return true;
 	}
 
-	void TaskSystemExecutorImpl::Register(const std::string& executorName, ExecutorConstructor constructor) {
-		executorConstructors[executorName] = constructor;
+	void TaskSystemExecutorImpl::runJob(SpawnedJob& spawned, int slot) {
+		spawned.job(slot, slotCount);
+
+		// Group finished - wake threads sleeping in WaitForGroup. The waiter counts itself before checking the
+		// group, so either it sees the group finished or this sees the waiter
+		if (spawned.group->pending.fetch_sub(1) == 1 && taskDoneWaiters.load() > 0) {
+			{
+				std::lock_guard<std::mutex> taskDoneLock(taskDoneMutex);
+			}
+			taskDoneCV.notify_all();
+		}
+	}
+
+	bool TaskSystemExecutorImpl::hasQueuedJobs() const {
+		if (sharedJobCount.load() > 0) {
+			return true;
+		}
+		for (const std::unique_ptr<JobQueue>& queue : jobQueues) {
+			if (!queue->IsEmpty()) {
+				return true;
+			}
+		}
+		return false;
 	}
 
 	void TaskSystemExecutorImpl::Terminate() {
@@ -132,165 +819,348 @@ namespace TaskSystem {
 		self = nullptr;
 
 	}
-	void TaskSystemExecutorImpl::workerFun(int tid) {
-		logThread((std::string)"Started", tid);
-		bool taskChanged = true;
-		std::shared_ptr<TaskContext> context;
-
-		while (1) {
-			if (terminateThreads) {
-				logThread("TerminateThreads has been set - exiting", tid);
-				return;
+	int TaskSystemExecutorImpl::acquireHelperSlot() {
+		for (int c = 0; c < int(helperSlotBusy.size()); c++) {
+			bool expected = false;
+			if (helperSlotBusy[c].compare_exchange_strong(expected, true)) {
+				return threadCount + c;
 			}
+		}
+		return -1;
+	}
 
-			Executor::ExecStatus exec_status;
+	void TaskSystemExecutorImpl::releaseHelperSlot(int slot) {
+		helperSlotBusy[slot - threadCount].store(false);
+	}
 
-			// Get task context for task with highest priority only if previous task has completed
+	bool TaskSystemExecutorImpl::runStep(TaskContext* context, int slot) {
+		context->inFlight++;
 
-			// TODO: signal in some way when a higher priority task is pushed
-			// TODO: If higher priority task is not present - do not get new task from priority queue 
-#ifdef QWERTYUIOPQWERTYUIOPQWERTYUIOP
-			{
+		bool executed = false;
+		if (!context->stepsDone) {
+			executingStack.push_back(context);
+			const auto stepStart = std::chrono::steady_clock::now();
+			if (!context->started.exchange(true)) {
+				context->startedAt = stepStart;
+			}
+			// Helping steps nested in this one use the slot's arena above the mark, their memory is released first
+			ScratchArena& scratch = slotScratch[slot].arena;
+			const ScratchArena::Mark scratchMark = scratch.GetMark();
+			StepContext stepContext(slot, slotCount, scratch, context->taskScratch[slot], &taskScratchPool);
+			const Executor::ExecStatus exec_status = context->step(*context->exec, stepContext);
+			scratch.Rewind(scratchMark);
+			const int64_t stepNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stepStart).count();
+			executingStack.pop_back();
 
-				logThread("Try acquire PQ Read Lock", tid);
-				std::shared_lock<std::shared_mutex> pqReadLock(taskPQMutex);
-				logThread("Successfully acquired", tid);
-				
-				if (taskPQ.empty()) {
-					// Should try loading task again next iteration
-					logThread("Task Priority Queue is Empty: Unlock PQ Read Lock and sleep.", tid);
-					
-					// Unlock read lock and sleep for some time
-					pqReadLock.unlock();
-					//pqReadLock.release();
-
-					// TODO: sleep time
-					std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-					continue;
-				}
+			context->stepTimeNs += stepNs;
+			context->stats->steps++;
+			context->stats->stepTimeNs += stepNs;
+			recordStep(context, stepNs, slot);
 
-				// Acquiring new task with highest priority
-				context = taskPQ.top();
-				logThread("Unlock PQ Read Lock.", tid);
+			// Deferred tasks of the executor may get an estimate from the first memory report
+			if (!context->memoryReported.load(std::memory_order_relaxed) && context->exec->memory.peakBytes.load(std::memory_order_relaxed) > 0) {
+				memoryReportedBy(*context);
 			}
-#endif
 
-			TaskContext* context_ = cur_executed_task;
+			if (exec_status == Executor::ExecStatus::ES_Stop) {
+				finishSteps(context);
+			}
+			executed = true;
+		}
 
-			if (!context_) {
-				logThread("Cur_executed_task is nullptr. Waiting and continuing.", tid);
+		// Last step to leave a finished task completes it
+		if (context->inFlight.fetch_sub(1) == 1 && context->stepsDone) {
+			completeTask(context);
+		}
+		return executed;
+	}
 
-				std::unique_lock<std::mutex> NoWorkLock(noWorkMutex);
+	void TaskSystemExecutorImpl::recordStep(TaskContext* context, int64_t stepNs, int slot) {
+		ExecutorStatsCounters& stats = *context->stats;
+		int bucket = 0;
+		for (int64_t us = stepNs / 1000; us > 0 && bucket < ExecutorStats::StepHistogramBuckets - 1; us >>= 1) {
+			bucket++;
+		}
+		stats.stepHistogram[bucket].fetch_add(1, std::memory_order_relaxed);
+		int64_t longest = stats.maxStepNs.load(std::memory_order_relaxed);
+		while (stepNs > longest && !stats.maxStepNs.compare_exchange_weak(longest, stepNs, std::memory_order_relaxed))
+			;
 
-				std::atomic<bool>& haveWork = this->haveWork;
-				noWorkCV.wait(NoWorkLock, [&haveWork] {
-					return haveWork.load();
-				});
+		const int64_t threshold = longStepThresholdNs.load(std::memory_order_relaxed);
+		if (threshold <= 0 || stepNs <= threshold) {
+			return;
+		}
+		stats.longSteps++;
 
-				continue;
+		// Every long step is counted, but reported at most once per second for each executor
+		const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t lastReport = stats.lastLongStepReportNs.load(std::memory_order_relaxed);
+		if (now - lastReport < 1000000000 || !stats.lastLongStepReportNs.compare_exchange_strong(lastReport, now)) {
+			return;
+		}
+		fprintf(stderr, "Long step: [%s] task %d took %.1fms on slot %d, threshold is %.1fms\n", getExecutor(context->executor).name.c_str(),
+			context->id.id, double(stepNs) / 1e6, slot, double(threshold) / 1e6);
+	}
+
+	void TaskSystemExecutorImpl::SetStepQuantum(std::chrono::nanoseconds quantum) {
+		stepQuantumNs = quantum.count();
+	}
+
+	void TaskSystemExecutorImpl::SetLongStepThreshold(std::chrono::nanoseconds threshold) {
+		longStepThresholdNs = threshold.count();
+	}
+
+	void TaskSystemExecutorImpl::finishSteps(TaskContext* context) {
+		if (context->stepsDone.exchange(true)) {
+			return;
+		}
+
+		// Remove task from task priority queue
+		// Set cur_executed task to be priority queue top or nullptr
+		logThread("Task steps have completed. Trying to lock PQ Write Lock.", currentSlot);
+		std::unique_lock<std::shared_mutex> pqWriteLock(taskPQMutex);
+		logThread("PQ Write Lock has been locked.", currentSlot);
+
+		taskPQ.remove(context);
+
+		if (taskPQ.empty()) {
+			logThread("Task Queue is empty.", currentSlot);
+			setCurExecutedTask(nullptr);
+		}
+		else {
+			setCurExecutedTask(taskPQ.top().get());
+		}
+	}
+
+	std::shared_ptr<Executor> TaskSystemExecutorImpl::takeRecycledExecutor(ExecutorHandle executor) {
+		ExecutorPool& pool = executorPools[executor.index];
+		std::lock_guard<std::mutex> poolLock(pool.mutex);
+		if (pool.executors.empty()) {
+			return nullptr;
+		}
+		std::shared_ptr<Executor> exec = std::move(pool.executors.back());
+		pool.executors.pop_back();
+		return exec;
+	}
+
+	void TaskSystemExecutorImpl::recycleExecutor(ExecutorHandle executor, const std::shared_ptr<Executor>& exec) {
+		ExecutorPool& pool = executorPools[executor.index];
+		std::lock_guard<std::mutex> poolLock(pool.mutex);
+		if (pool.executors.size() < MaxRecycledExecutors) {
+			pool.executors.push_back(exec);
+		}
+	}
+
+	void TaskSystemExecutorImpl::completeTask(TaskContext* context) {
+		if (context->completionStarted.exchange(true)) {
+			return;
+		}
+
+		// Task has completed -> only one thread can enter here only once per task.
+		context->completedAt = std::chrono::steady_clock::now();
+		if (!context->sharedResult) {
+			context->stats->tasksCompleted++;
+			context->stats->completedTaskTimeNs += context->stepTimeNs;
+		}
+		if (context->deadline && !context->sharedResult) {
+			context->stats->deadlineTasks++;
+			if (context->completedAt > context->deadline->deadline) {
+				context->stats->deadlineMisses++;
+				logThread("Task completed after its deadline", currentSlot);
 			}
-			// Execute step from current task context
-			exec_status = context_->exec->ExecuteStep(tid, threadCount);
-			
-			if (exec_status == Executor::ExecStatus::ES_Stop) {
+		}
+
+		// No more callbacks can be added once taskComplete is set.
+		bool haveCallbacks;
+		TaskResult sharedResult;
+		{
+			std::lock_guard<std::mutex> callbackLock(context->waitMutex);
+			if (context->exec) {
+				context->result = std::move(context->exec->result);
+			}
+			if (!context->fingerprint.empty()) {
+				sharedResult = context->result;
+			}
+			context->taskComplete->store(true);
+			haveCallbacks = context->onCompleteCallbacks.size() != 0;
+		}
 
-				if (context_ != cur_executed_task) {
-					continue;
+		// Memory of the task is released, its peak goes to the statistics
+		if (context->exec) {
+			context->peakMemoryBytes = context->exec->memory.peakBytes;
+			context->exec->ReportMemory(0);
+			context->stats->completedPeakBytes += context->peakMemoryBytes;
+			int64_t largest = context->stats->taskPeakBytes;
+			while (context->peakMemoryBytes > largest && !context->stats->taskPeakBytes.compare_exchange_weak(largest, context->peakMemoryBytes))
+				;
+		}
+
+		// No step can start on a completed task, its scratch and executor can be handed to the next tasks
+		if (context->taskScratch) {
+			for (int c = 0; c < slotCount; c++) {
+				if (context->taskScratch[c]) {
+					taskScratchPool.Release(std::move(context->taskScratch[c]));
 				}
-				// Task has completed and should be removed from priority queue and task map
-				// Also cur_executed_task should be changed
-				// Remove task from task priority queue
-				// Set cur_executed task to be priority queue top or nullptr
-				
-				{
-					logThread("Task has completed. Trying to lock PQ Write Lock.", tid);
-					std::unique_lock<std::shared_mutex> pqWriteLock(taskPQMutex);
-					logThread("PQ Write Lock has been locked.", tid);
-
-					// Task queue has been emptied while waiting for Task PQ Write Lock or 
-					// Taks queue top has changed while waiting for Task PQ Write Lock
-					//if (taskPQ.empty() || taskPQ.top().get() != context.get()) {
-					//	logThread("Task Queue is empty or top has changed. Unlocking PQ Write Lock.", tid);
-					//	continue;
-					//}
-
-					//assert(taskPQ.top() == context);
-
-					if (taskPQ.empty()) {
-						logThread("Task Queue is empty. Continuing.", tid);
-						continue;
-					}
-					logThread("Removing top from Task PQ", tid);
+			}
+		}
+		if (context->exec && context->exec->IsRecyclable()) {
+			recycleExecutor(context->executor, context->exec);
+		}
 
-					taskPQ.pop();
+		if (!context->fingerprint.empty()) {
+			finishSharedTask(context, sharedResult);
+		}
 
-					if (taskPQ.empty()) {
-						logThread("Task Queue is empty. Continuing.", tid);
+		if (context->admitted) {
+			{
+				std::lock_guard<std::mutex> admissionLock(admissionMutex);
+				reservedBytes -= int64_t(context->memoryReservation);
+				admittedTasks--;
+				context->stats->admittedTasks--;
+				if (context->memoryReported) {
+					context->stats->reportedTasks--;
+				}
+				context->admitted = false;
+			}
+			admitDeferred();
+		}
 
-						setCurExecutedTask(nullptr);
-					}
-					else {
-						setCurExecutedTask(taskPQ.top().get());
-						//cur_executed_task = taskPQ.top().get();
-					}
+		if (!context->completionQueues.empty()) {
+			const CompletionQueue::Completion completion = makeCompletion(*context);
+			for (CompletionQueue* queue : context->completionQueues) {
+				queue->Push(completion);
+			}
+		}
 
-					context_->taskComplete->store(true);
+		if (haveCallbacks) {
+			// Schedule callbacks task. Callbacks task should set callbacksComplete on finished task once finished.
+			logThread("Scheduling callbacks", currentSlot);
 
-					logThread("Unlocking Task PQ lock", tid);
+			std::unique_ptr<Task> cb_task = std::make_unique<CallbackTaskParams>(getContext(context->id));
+			// Callbacks stay in the scheduling class of the task
+			std::optional<TaskDeadline> callbackDeadline;
+			if (context->deadline) {
+				callbackDeadline = TaskDeadline{ context->deadline->deadline, std::nullopt };
+			}
+			const TaskID callbackTaskId = scheduleTask(callbackExecutor, std::move(cb_task), context->priority + 1, callbackDeadline);
+			context->callbackContext = getContext(callbackTaskId).get();
+		}
+		else {
+			logThread("Nothing to schedule", currentSlot);
 
-				}
-				
-				// Task has completed -> only one worker thread can enter here only once per task.
+			/// No callbacks to schedule. Set callbacksComplate to true.
+			{
+				std::lock_guard<std::mutex> callbackWaitLock(context->waitMutex);
+				context->callbacksComplete->store(true);
+			}
+			context->cv.notify_all();
+		}
 
-				// TODO: Erasing tasks from taskmap causes crash
-				/*logThread("##############Remove from TASKMAP: Trying to lock Task Map Write Lock", tid);
-				{
-					std::unique_lock<std::shared_mutex> TaskMapWriteLock(TaskMapMutex);
-					logThread("Acquired Task Map Write Lock", tid);
+		pendingTasks--;
+		{
+			std::lock_guard<std::mutex> taskDoneLock(taskDoneMutex);
+		}
+		taskDoneCV.notify_all();
+	}
 
-					idTaskMap.erase(context->id);
+	bool TaskSystemExecutorImpl::helpOnce(TaskContext* awaited) {
+		// Jobs of the own queue were spawned by the step that is waiting, usually for them
+		if (runOwnJob(currentSlot)) {
+			return true;
+		}
 
-					logThread("Unlocking Task Map Write Lock", tid);
-				};*/
+		TaskContext* context = nullptr;
 
-				
+		// Prefer the awaited task, then its callbacks, then whatever is on top of the queue
+		if (awaited && awaited->hasExecutor.load(std::memory_order_acquire) && !awaited->stepsDone && !isExecutingOnThisThread(awaited)) {
+			context = awaited;
+		}
+		else if (awaited && awaited->callbackContext && !awaited->callbackContext.load()->stepsDone && !isExecutingOnThisThread(awaited->callbackContext)) {
+			context = awaited->callbackContext;
+		}
+		else {
+			TaskContext* top = cur_executed_task;
+			if (top && !isExecutingOnThisThread(top)) {
+				context = top;
+			}
+		}
 
-				if (context_->onCompleteCallbacks.size() != 0) {
-					// Schedule callbacks task. Callbacks task should set callbacksComplete on finished task once finished.
+		if (context && runStep(context, currentSlot)) {
+			return true;
+		}
 
-					logThread("Scheduling callbacks", tid);
+		// No step to execute - the waiting thread is idle and may steal
+		return stealJob(currentSlot);
+	}
 
-					// Get shared pointer to TaskContext from taskMap and TaskContext id
-					std::shared_ptr<TaskContext> context_shared_ptr;
-					{
-						std::shared_lock<std::shared_mutex> TaskMapReadLock(TaskMapMutex);
-						context_shared_ptr = idTaskMap[context_->id];
-					}
+	void TaskSystemExecutorImpl::helpUntil(TaskContext* awaited, const std::function<bool()>& done) {
+		// Worker threads and nested waits keep their slot, other threads borrow a helper slot
+		const bool borrowSlot = currentSlot == -1;
+		if (borrowSlot) {
+			currentSlot = acquireHelperSlot();
+		}
 
+		while (!done()) {
+			if (currentSlot != -1 && helpOnce(awaited)) {
+				continue;
+			}
 
-					std::unique_ptr<Task> cb_task = std::make_unique<CallbackTaskParams>(context_shared_ptr);
+			// Nothing to execute - sleep until a task completes or new work may be available
+			if (awaited) {
+				std::unique_lock<std::mutex> waitLock(awaited->waitMutex);
+				awaited->cv.wait_for(waitLock, std::chrono::milliseconds(1), done);
+			}
+			else {
+				std::unique_lock<std::mutex> waitLock(taskDoneMutex);
+				taskDoneWaiters++;
+				taskDoneCV.wait_for(waitLock, std::chrono::milliseconds(1), done);
+				taskDoneWaiters--;
+			}
+		}
 
-					TaskSystemExecutor::TaskID callback_task_id = ScheduleTask(std::move(cb_task), context_->priority + 1);
-				}
-				else {
-					logThread("Nothing to schedule", tid);
+		if (borrowSlot) {
+			if (currentSlot != -1) {
+				releaseHelperSlot(currentSlot);
+			}
+			currentSlot = -1;
+		}
+	}
 
-					/// No callbacks to schedule. Set callbacksComplate to true.
-					{
-						std::lock_guard<std::mutex> callbackWaitLock(context_->waitMutex);
+	void TaskSystemExecutorImpl::workerFun(int tid) {
+		logThread((std::string)"Started", tid);
+		currentSlot = tid;
 
-						context_->callbacksComplete->store(true);
-					}
-				}
+		while (1) {
+			if (terminateThreads) {
+				logThread("TerminateThreads has been set - exiting", tid);
+				return;
+			}
+
+			TaskContext* context_ = cur_executed_task;
+
+			// Execute step from current task context. Completion is handled by runStep.
+			if (context_ && runStep(context_, tid)) {
 				continue;
 			}
-			else if (exec_status == Executor::ExecStatus::ES_Continue) {
-				// Top task has not completed - continue
-				logThread("Task has not completed. Continuing", tid);
 
+			// No step to execute - run jobs left in the own queue, then steal jobs spawned by other slots.
+			// Busy workers never steal, so jobs of a lower priority task do not delay steps of the top task
+			if (runOwnJob(tid) || stealJob(tid)) {
 				continue;
 			}
+
+			if (!context_) {
+				logThread("Cur_executed_task is nullptr. Waiting and continuing.", tid);
+
+				std::unique_lock<std::mutex> NoWorkLock(noWorkMutex);
+
+				sleepingWorkers++;
+				noWorkCV.wait(NoWorkLock, [this] {
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					return haveWork.load() || hasQueuedJobs();
+				});
+				sleepingWorkers--;
+			}
 		}
 	}
 };
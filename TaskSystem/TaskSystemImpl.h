@@ -4,12 +4,21 @@
 #include "Executor.h"
 #include "IdGenerator.h"
 #include "TaskSystem.h"
+#include "CompletionQueue.h"
 
 #include <map>
+#include <array>
+#include <algorithm>
 #include <functional>
 #include <atomic>
 #include <shared_mutex>
 #include <queue>
+#include <deque>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <cassert>
 #include <iostream>
 
@@ -21,9 +30,17 @@ namespace TaskSystem {
 	class TaskSystemExecutorImpl : public TaskSystemExecutor {
 	private:
 		TaskSystemExecutorImpl() = delete;
-		TaskSystemExecutorImpl(int threadCount) : TaskSystemExecutor(threadCount), threadCount(threadCount) {
+		TaskSystemExecutorImpl(int threadCount, int helperSlotCount)
+			: TaskSystemExecutor(threadCount), threadCount(threadCount), slotCount(threadCount + helperSlotCount), helperSlotBusy(helperSlotCount) {
+			// One local job queue per slot, threads without a slot use sharedJobs
+			for (int c = 0; c < slotCount; c++) {
+				jobQueues.push_back(std::make_unique<JobQueue>());
+			}
+			slotScratch.reset(new SlotScratch[slotCount]);
+
 			// Load callback executor shared library
 			TS_LOAD_LIBARY("CallbackExecutor", *this);
+			callbackExecutor = GetExecutorHandle("callbackExecutor");
 
 			setCurExecutedTask(nullptr);
 
@@ -37,7 +54,12 @@ namespace TaskSystem {
 		// Non copyable
 		TaskSystemExecutorImpl& operator=(const TaskSystemExecutor&) = delete;
 
-		static void Init(int threadCount) {
+		/// <summary>
+		/// Create the task system instance.
+		/// </summary>
+		/// <param name="threadCount">Number of worker threads to start.</param>
+		/// <param name="helperSlotCount">Number of extra slots for non-worker threads that help while waiting.</param>
+		static void Init(int threadCount, int helperSlotCount = 1) {
 			static std::mutex init_mutex;
 			if (TaskSystemExecutor::self) {
 				return;
@@ -46,7 +68,7 @@ namespace TaskSystem {
 			if (TaskSystemExecutor::self) {
 				return;
 			}
-			TaskSystemExecutor::self = new TaskSystemExecutorImpl(threadCount);
+			TaskSystemExecutor::self = new TaskSystemExecutorImpl(threadCount, helperSlotCount);
 		}
 
 		/// <summary>
@@ -56,20 +78,172 @@ namespace TaskSystem {
 		/// <returns></returns>
 		TaskID ScheduleTask(std::unique_ptr<Task> task, int priority) override;
 
+		/// <summary>
+		/// Schedule task in the deadline scheduling class. Deadline tasks are ordered earliest-deadline-first
+		/// and always run before best-effort tasks.
+		/// </summary>
+		/// <returns></returns>
+		TaskID ScheduleTask(std::unique_ptr<Task> task, int priority, const TaskDeadline& deadline) override;
+
+		/// <summary>
+		/// Schedule task on an executor resolved in advance. Resolving the handle takes no locks.
+		/// </summary>
+		/// <returns></returns>
+		TaskID ScheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority) override;
+
+		/// <summary>
+		/// Schedule task in the deadline scheduling class on an executor resolved in advance.
+		/// </summary>
+		/// <returns></returns>
+		TaskID ScheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority, const TaskDeadline& deadline) override;
+
+		/// <summary>
+		/// Get per executor step, completion and deadline miss counters.
+		/// </summary>
+		/// <returns></returns>
+		std::map<std::string, ExecutorStats> GetExecutorStats() override;
+
+		/// <summary>
+		/// Predict completion time of a task from the remaining cost of all tasks ordered before it.
+		/// Cost of a task is its estimatedCost, or the average step time of completed tasks of the same executor.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <returns></returns>
+		std::optional<std::chrono::steady_clock::time_point> PredictCompletion(TaskID task) override;
+
 		/// <summary>
 		/// Wait for task with given taskid to finish. A task is finished when callbacksComplete is true.
+		/// The waiting thread executes steps of the awaited task (or other ready work) until it finishes.
 		/// </summary>
 		/// <param name="task"></param>
 		void WaitForTask(TaskID task) override;
 
+		/// <summary>
+		/// Wait until every scheduled task has finished, executing ready work meanwhile.
+		/// Tasks currently executed by the calling thread are not waited for.
+		/// </summary>
+		void WaitForAll() override;
+
 		/// <summary>
 		/// Register a callback to be called when normal task steps have been executed.
+		/// Callback is executed immediately if the task steps have already completed.
 		/// </summary>
 		/// <param name="task"></param>
 		/// <param name="callback"></param>
 		void OnTaskCompleted(TaskID task, std::function<void(TaskID)>&& callback) override;
 
-		void Register(const std::string& executorName, ExecutorConstructor constructor) override;
+		/// <summary>
+		/// Register a completion queue to be pushed to when normal task steps have been executed.
+		/// Pushes immediately if the task steps have already completed.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <param name="queue"></param>
+		void OnTaskCompleted(TaskID task, CompletionQueue& queue) override;
+
+		/// <summary>
+		/// Move result out of the task context. Result is taken from the executor when task steps complete.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <returns></returns>
+		TaskResult TakeResult(TaskID task) override;
+
+		/// <summary>
+		/// Get result sharing the value stored in the task context.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <returns></returns>
+		TaskResult GetResult(TaskID task) override;
+
+		/// <summary>
+		/// Get the latest snapshot of the executor, or the result once the task has completed.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <returns></returns>
+		TaskResult GetSnapshot(TaskID task) override;
+
+		/// <summary>
+		/// Set the stop request of the task's executor if the task has not completed.
+		/// </summary>
+		/// <param name="task"></param>
+		void RequestStop(TaskID task) override;
+
+		/// <summary>
+		/// Change task priority and restore the order of the task priority queue.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <param name="priority"></param>
+		void SetTaskPriority(TaskID task, int priority) override;
+
+		/// <summary>
+		/// Create task context without executor. The task is never pushed to the task queue.
+		/// </summary>
+		/// <param name="name"></param>
+		/// <returns></returns>
+		TaskID BeginExternalTask(const std::string& name) override;
+
+		/// <summary>
+		/// Mark external task steps as done and complete it.
+		/// </summary>
+		/// <param name="task"></param>
+		/// <param name="result"></param>
+		/// <param name="failed"></param>
+		void CompleteExternalTask(TaskID task, TaskResult result, bool failed) override;
+
+		/// <summary>
+		/// Push job to the local queue of the calling slot. Threads without a slot use a shared queue.
+		/// </summary>
+		/// <param name="group"></param>
+		/// <param name="job"></param>
+		void Spawn(TaskGroup& group, Job&& job) override;
+
+		/// <summary>
+		/// Execute one job stolen from another slot's queue or from the shared queue.
+		/// </summary>
+		/// <returns>true if a job was executed</returns>
+		bool StealJob() override;
+
+		/// <summary>
+		/// Execute jobs from the local queue, steal from other queues or execute task steps until group has no pending jobs.
+		/// </summary>
+		/// <param name="group"></param>
+		void WaitForGroup(TaskGroup& group) override;
+
+		/// <summary>
+		/// Set the step quantum passed to executors of tasks started from now on.
+		/// </summary>
+		/// <param name="quantum"></param>
+		void SetStepQuantum(std::chrono::nanoseconds quantum) override;
+
+		/// <summary>
+		/// Set the duration above which steps are counted and reported as long.
+		/// </summary>
+		/// <param name="threshold"></param>
+		void SetLongStepThreshold(std::chrono::nanoseconds threshold) override;
+
+		/// <summary>
+		/// Set the memory budget and admit deferred tasks that fit it now.
+		/// </summary>
+		/// <param name="bytes"></param>
+		void SetMemoryBudget(size_t bytes) override;
+
+		/// <summary>
+		/// Get reported memory of all tasks and admission counters.
+		/// </summary>
+		/// <returns></returns>
+		MemoryStats GetMemoryStats() override;
+
+		/// <summary>
+		/// Get counters of tasks sharing work by fingerprint and the size of the memo cache.
+		/// </summary>
+		/// <returns></returns>
+		MemoStats GetMemoStats() override;
+
+		/// <summary>
+		/// Set byte budget and time to live of memoized results, dropping results outside of the new limits.
+		/// </summary>
+		/// <param name="byteBudget"></param>
+		/// <param name="ttl"></param>
+		void SetMemoLimits(size_t byteBudget, std::chrono::milliseconds ttl) override;
 
 		/// <summary>
 		/// Set stop threads and wait for them to exit.
@@ -83,10 +257,168 @@ namespace TaskSystem {
 		/// </summary>
 		void workerFun(int tid);
 	protected:
+		/// <summary>
+		/// Statistics of a single executor, updated by worker threads after each step.
+		/// </summary>
+		struct ExecutorStatsCounters {
+			std::atomic<uint64_t> steps = 0;
+			std::atomic<int64_t> stepTimeNs = 0;
+			std::atomic<uint64_t> tasksCompleted = 0;
+			/// <summary>
+			/// Sum of step time of completed tasks, used to predict cost of new tasks.
+			/// </summary>
+			std::atomic<int64_t> completedTaskTimeNs = 0;
+			std::atomic<uint64_t> deadlineTasks = 0;
+			std::atomic<uint64_t> deadlineMisses = 0;
+
+			/// <summary>
+			/// Memory reported by executors of this name, sum and largest of the peaks of completed tasks.
+			/// </summary>
+			MemoryCounter memory;
+			std::atomic<int64_t> completedPeakBytes = 0;
+			std::atomic<int64_t> taskPeakBytes = 0;
+
+			/// <summary>
+			/// Tasks of this executor admitted under the memory budget and not completed. Guarded by admissionMutex.
+			/// </summary>
+			int admittedTasks = 0;
+			/// <summary>
+			/// Admitted tasks whose executor has reported memory, the memory counter holds their reports. Guarded by admissionMutex.
+			/// </summary>
+			int reportedTasks = 0;
+
+			/// <summary>
+			/// Step duration histogram as in ExecutorStats, long steps and time of the last long step diagnostic.
+			/// </summary>
+			std::array<std::atomic<uint64_t>, ExecutorStats::StepHistogramBuckets> stepHistogram{};
+			std::atomic<uint64_t> longSteps = 0;
+			std::atomic<int64_t> maxStepNs = 0;
+			std::atomic<int64_t> lastLongStepReportNs = 0;
+		};
+
 		struct TaskContext {
 			TaskID id;
 			std::shared_ptr<Executor> exec;
 
+			/// <summary>
+			/// Set once exec is assigned. exec of a deferred task is assigned later under waitMutex, threads that do
+			/// not hold it test this flag before reading exec.
+			/// </summary>
+			std::atomic<bool> hasExecutor = false;
+
+			/// <summary>
+			/// Step function of the executor, resolved when the task is scheduled.
+			/// </summary>
+			ExecutorStepFunction step = &ExecuteStepVirtual;
+
+			/// <summary>
+			/// Handle the executor was created from, used to recycle it.
+			/// </summary>
+			ExecutorHandle executor;
+
+			/// <summary>
+			/// Statistics of this task's executor.
+			/// </summary>
+			ExecutorStatsCounters* stats = nullptr;
+
+			/// <summary>
+			/// Total time spent in steps of this task, on all threads.
+			/// </summary>
+			std::atomic<int64_t> stepTimeNs = 0;
+
+			/// <summary>
+			/// Set for tasks in the deadline scheduling class.
+			/// </summary>
+			std::optional<TaskDeadline> deadline;
+
+			/// <summary>
+			/// Time of scheduling, first step and completion of steps.
+			/// </summary>
+			std::chrono::steady_clock::time_point scheduledAt, startedAt, completedAt;
+			std::atomic<bool> started = false;
+
+			/// <summary>
+			/// Result published by the executor. Guarded by waitMutex.
+			/// </summary>
+			TaskResult result;
+
+			/// <summary>
+			/// Set for external tasks that could not be executed.
+			/// </summary>
+			bool failed = false;
+
+			/// <summary>
+			/// Fingerprint of a task executed for all identical tasks, empty for tasks that do not share their result.
+			/// </summary>
+			std::string fingerprint;
+
+			/// <summary>
+			/// Identical tasks attached while this one runs, completed with its result. Guarded by memoMutex.
+			/// </summary>
+			std::vector<std::shared_ptr<TaskContext>> followers;
+
+			/// <summary>
+			/// Completed with the result of another task. Not counted in executor statistics.
+			/// </summary>
+			bool sharedResult = false;
+
+			/// <summary>
+			/// Completion queues to push to on task complete. Guarded by waitMutex.
+			/// </summary>
+			std::vector<CompletionQueue*> completionQueues;
+
+			/// <summary>
+			/// Set by the first step returning ES_Stop. No new steps are started after that.
+			/// </summary>
+			std::atomic<bool> stepsDone = false;
+
+			/// <summary>
+			/// Number of steps currently executing. Task completes when steps are done and this reaches 0.
+			/// </summary>
+			std::atomic<int> inFlight = 0;
+
+			/// <summary>
+			/// Scratch arena of the task per slot, created by the first step using it and returned to the pool on completion.
+			/// </summary>
+			std::unique_ptr<std::unique_ptr<ScratchArena>[]> taskScratch;
+
+			/// <summary>
+			/// Task waiting for memory, its executor is constructed when it is admitted. Guarded by admissionMutex.
+			/// </summary>
+			std::unique_ptr<Task> deferredTask;
+
+			/// <summary>
+			/// Memory reserved for the task, set if it was admitted under the memory budget. admitted is cleared
+			/// when the reservation is released. Guarded by admissionMutex.
+			/// </summary>
+			size_t memoryReservation = 0;
+			bool admitted = false;
+
+			/// <summary>
+			/// Set under admissionMutex after the first step that found memory reported by the executor.
+			/// </summary>
+			std::atomic<bool> memoryReported = false;
+
+			/// <summary>
+			/// Stop requested before the executor was constructed. Guarded by waitMutex.
+			/// </summary>
+			bool stopRequested = false;
+
+			/// <summary>
+			/// Most memory reported by the executor, set on completion.
+			/// </summary>
+			int64_t peakMemoryBytes = 0;
+
+			/// <summary>
+			/// Guards completeTask so it runs exactly once.
+			/// </summary>
+			std::atomic<bool> completionStarted = false;
+
+			/// <summary>
+			/// Context of the task executing the callbacks, if any were registered.
+			/// </summary>
+			std::atomic<TaskContext*> callbackContext = nullptr;
+
 			/// <summary>
 			/// Callbacks function that should be called on task complete
 			/// </summary>
@@ -105,12 +437,26 @@ namespace TaskSystem {
 			/// </summary>
 			std::condition_variable cv;
 
-			int priority = 0;
+			/// <summary>
+			/// Priority of best-effort tasks. Changed under taskPQMutex.
+			/// </summary>
+			std::atomic<int> priority = 0;
 
 			struct CMP_priority {
 				bool operator() (const std::shared_ptr<TaskContext>& lhs, const std::shared_ptr<TaskContext>& rhs) const
 				{
-					return lhs->priority < rhs->priority;
+					// Deadline tasks come before best-effort tasks, earliest deadline first
+					if (lhs->deadline.has_value() != rhs->deadline.has_value()) {
+						return rhs->deadline.has_value();
+					}
+					if (lhs->deadline && lhs->deadline->deadline != rhs->deadline->deadline) {
+						return lhs->deadline->deadline > rhs->deadline->deadline;
+					}
+					if (!lhs->deadline && lhs->priority != rhs->priority) {
+						return lhs->priority < rhs->priority;
+					}
+					// Equal keys run in scheduling order
+					return lhs->scheduledAt > rhs->scheduledAt;
 				}
 
 			};
@@ -130,8 +476,232 @@ namespace TaskSystem {
 			virtual std::string GetExecutorName() const { return "callbackExecutor"; }
 		};
 
+		/// <summary>
+		/// Priority queue that supports removing a task which is not on top (e.g. completed while preempted).
+		/// </summary>
+		struct TaskPriorityQueue : std::priority_queue<std::shared_ptr<TaskContext>, std::vector<std::shared_ptr<TaskContext>>, TaskContext::CMP_priority> {
+			bool remove(const TaskContext* context) {
+				auto it = std::find_if(c.begin(), c.end(), [context](const std::shared_ptr<TaskContext>& tc) { return tc.get() == context; });
+				if (it == c.end()) {
+					return false;
+				}
+				c.erase(it);
+				std::make_heap(c.begin(), c.end(), comp);
+				return true;
+			}
+
+			/// <summary>
+			/// Restore heap order after the priority of a queued task has changed.
+			/// </summary>
+			void update() {
+				std::make_heap(c.begin(), c.end(), comp);
+			}
+
+			const container_type& items() const {
+				return c;
+			}
+		};
+
+		/// <summary>
+		/// Statistics per executor name. Entries are never removed so pointers to them stay valid.
+		/// </summary>
+		std::map<std::string, ExecutorStatsCounters> executorStats;
+		std::mutex executorStatsMutex;
+
+		/// <summary>
+		/// Statistics of each executor handle, filled on first use so scheduling by handle does not lock executorStatsMutex.
+		/// </summary>
+		std::array<std::atomic<ExecutorStatsCounters*>, MaxExecutorCount> handleStats{};
+
+		/// <summary>
+		/// Handle of the callback executor, resolved once at construction.
+		/// </summary>
+		ExecutorHandle callbackExecutor;
+
+		/// <summary>
+		/// Finished recyclable executors of one executor handle, reused by the next tasks scheduled on it.
+		/// </summary>
+		struct ExecutorPool {
+			std::mutex mutex;
+			std::vector<std::shared_ptr<Executor>> executors;
+		};
+		std::array<ExecutorPool, MaxExecutorCount> executorPools;
+		static const size_t MaxRecycledExecutors = 4;
+
+		/// <summary>
+		/// Result of a completed task kept for identical tasks scheduled later.
+		/// </summary>
+		struct MemoEntry {
+			TaskResult result;
+			std::chrono::steady_clock::time_point completedAt;
+			std::list<std::string>::iterator lruPosition;
+		};
+
+		/// <summary>
+		/// Memoized results by fingerprint, with fingerprints from least to most recently used.
+		/// </summary>
+		std::map<std::string, MemoEntry> memo;
+		std::list<std::string> memoLru;
+
+		/// <summary>
+		/// Tasks executing for a fingerprint, identical tasks attach to them.
+		/// </summary>
+		std::map<std::string, std::shared_ptr<TaskContext>> sharedTasks;
+
+		size_t memoBudget = size_t(256) << 20;
+		std::chrono::milliseconds memoTtl{ 60000 };
+		MemoStats memoStats;
+
+		/// <summary>
+		/// Guards memo, memoLru, sharedTasks, followers of tasks in it, the limits and memoStats.
+		/// </summary>
+		std::mutex memoMutex;
+
+		/// <summary>
+		/// Step quantum of new executors and long step threshold, in nanoseconds.
+		/// </summary>
+		std::atomic<int64_t> stepQuantumNs = 1000000;
+		std::atomic<int64_t> longStepThresholdNs = 100000000;
+
+		/// <summary>
+		/// Memory reported by all executors.
+		/// </summary>
+		MemoryCounter memoryTotal;
+
+		/// <summary>
+		/// Tasks waiting for memory in order of scheduling.
+		/// </summary>
+		std::vector<std::shared_ptr<TaskContext>> deferredTasks;
+
+		/// <summary>
+		/// Memory budget, 0 if unlimited. Reservations and count of admitted tasks that have not completed.
+		/// </summary>
+		size_t memoryBudget = 0;
+		int64_t reservedBytes = 0;
+		int admittedTasks = 0;
+
+		/// <summary>
+		/// Guards deferredTasks, the budget, reservations and admission counters.
+		/// </summary>
+		std::mutex admissionMutex;
+
+		/// <summary>
+		/// Number of worker threads.
+		/// </summary>
 		int threadCount;
 
+		/// <summary>
+		/// Number of slots passed to executors as threadCount: worker threads + helper slots.
+		/// </summary>
+		int slotCount;
+
+		/// <summary>
+		/// Helper slots [threadCount, slotCount) used by threads waiting for tasks.
+		/// </summary>
+		std::vector<std::atomic<bool>> helperSlotBusy;
+
+		/// <summary>
+		/// Step scratch arena of a slot, padded so that slots don't share a cache line.
+		/// </summary>
+		struct alignas(64) SlotScratch {
+			ScratchArena arena;
+		};
+
+		/// <summary>
+		/// Step scratch arenas indexed by slot, rewound after each step.
+		/// </summary>
+		std::unique_ptr<SlotScratch[]> slotScratch;
+
+		/// <summary>
+		/// Task scratch arenas of completed tasks, reused by the next tasks.
+		/// </summary>
+		ScratchArenaPool taskScratchPool;
+
+		/// <summary>
+		/// Job created by Spawn.
+		/// </summary>
+		struct SpawnedJob {
+			Job job;
+			TaskGroup* group = nullptr;
+		};
+
+		/// <summary>
+		/// Job queue of a single slot, a fixed size Chase-Lev deque. Only the thread holding the slot pushes and pops
+		/// at the bottom, without locks. Thieves claim the top job with a CAS and move it out afterwards, its cell
+		/// stays full until then so the owner never overwrites a job being stolen.
+		/// </summary>
+		struct JobQueue {
+			static const int64_t Capacity = 256;
+
+			struct Cell {
+				SpawnedJob spawned;
+				std::atomic<bool> full = false;
+			};
+
+			/// <summary>
+			/// Owner only. Returns false if the queue is full, the job is left in spawned then.
+			/// </summary>
+			bool Push(SpawnedJob& spawned);
+
+			/// <summary>
+			/// Owner only. Takes the newest job.
+			/// </summary>
+			bool Pop(SpawnedJob& spawned);
+
+			/// <summary>
+			/// Any thread. Takes the oldest job, fails if the queue is empty or another thread took the job first.
+			/// </summary>
+			bool Steal(SpawnedJob& spawned);
+
+			bool IsEmpty() const {
+				return Size() == 0;
+			}
+
+			int64_t Size() const {
+				return std::max<int64_t>(bottom.load(std::memory_order_acquire) - top.load(std::memory_order_acquire), 0);
+			}
+
+		private:
+			void take(int64_t index, SpawnedJob& spawned);
+
+			alignas(64) std::atomic<int64_t> top = 0;
+			alignas(64) std::atomic<int64_t> bottom = 0;
+			alignas(64) Cell cells[Capacity];
+		};
+
+		/// <summary>
+		/// Job queues indexed by slot.
+		/// </summary>
+		std::vector<std::unique_ptr<JobQueue>> jobQueues;
+
+		/// <summary>
+		/// Jobs spawned by threads without a slot, only stolen.
+		/// </summary>
+		std::deque<SpawnedJob> sharedJobs;
+		std::mutex sharedJobsMutex;
+		std::atomic<int> sharedJobCount = 0;
+
+		/// <summary>
+		/// Workers sleeping in workerFun. Spawn only wakes them when there are any, so the busy path stays lock free.
+		/// </summary>
+		std::atomic<int> sleepingWorkers = 0;
+
+		/// <summary>
+		/// Number of tasks whose steps have not completed yet.
+		/// </summary>
+		std::atomic<int> pendingTasks = 0;
+
+		/// <summary>
+		/// Notified every time a task completes. Used by WaitForAll.
+		/// </summary>
+		std::condition_variable taskDoneCV;
+		std::mutex taskDoneMutex;
+
+		/// <summary>
+		/// Threads sleeping on taskDoneCV. Finished groups only notify when there are any.
+		/// </summary>
+		std::atomic<int> taskDoneWaiters = 0;
+
 		/// <summary>
 		/// TaskContext map (Task Map) used for context lookup based on TaskID.
 		/// </summary>
@@ -154,7 +724,7 @@ namespace TaskSystem {
 		/// <summary>
 		// Task priority queue. Provide access to task with highest priority.
 		/// </summary>
-		std::priority_queue<std::shared_ptr<TaskContext>, std::vector<std::shared_ptr<TaskContext>>, TaskContext::CMP_priority> taskPQ;
+		TaskPriorityQueue taskPQ;
 
 		/// <summary>
 		/// Mutex for Task Priority queue.
@@ -169,10 +739,179 @@ namespace TaskSystem {
 		std::mutex noWorkMutex;
 		std::atomic<bool> haveWork = false;
 		void setCurExecutedTask(TaskContext* task) {
-			haveWork = task?true:false;
-			this->cur_executed_task = task;
+			{
+				std::lock_guard<std::mutex> noWorkLock(noWorkMutex);
+				haveWork = task?true:false;
+				this->cur_executed_task = task;
+			}
 			noWorkCV.notify_all();
 		}
 		friend struct CallBackExecutor;
+		friend struct CallbackBody;
+
+	private:
+		/// <summary>
+		/// Create executor and task context and push it to the task queue.
+		/// </summary>
+		TaskID scheduleTask(ExecutorHandle executor, std::unique_ptr<Task> task, int priority, const std::optional<TaskDeadline>& deadline);
+
+		/// <summary>
+		/// Add a step to the duration histogram of its executor and report it if it is longer than the threshold.
+		/// </summary>
+		void recordStep(TaskContext* context, int64_t stepNs, int slot);
+
+		/// <summary>
+		/// Construct or recycle the executor of an admitted task and push the task to the task priority queue.
+		/// </summary>
+		void startTask(const std::shared_ptr<TaskContext>& tc, std::unique_ptr<Task> task);
+
+		/// <summary>
+		/// Admit a task if its memory estimate fits the budget, otherwise keep task in the context and defer it.
+		/// </summary>
+		/// <returns>True if the task was admitted and should be started.</returns>
+		bool admitTask(const std::shared_ptr<TaskContext>& context, std::unique_ptr<Task>& task);
+
+		/// <summary>
+		/// Start deferred tasks while they fit the budget.
+		/// </summary>
+		void admitDeferred();
+
+		/// <summary>
+		/// Memory a task is expected to hold: its own estimate, the mean peak of its executor or what its running tasks
+		/// report on average. Empty if none of them is known yet. Called with admissionMutex locked.
+		/// </summary>
+		std::optional<size_t> estimateMemory(const TaskContext& context, const Task& task);
+
+		/// <summary>
+		/// Check estimate against the budget. Called with admissionMutex locked.
+		/// </summary>
+		bool fitsMemoryBudget(size_t estimate) const;
+
+		/// <summary>
+		/// Estimate the memory of a task into its reservation and check it against the budget. A task without an
+		/// estimate is only admitted while no other task of its executor is, so a burst of new tasks can not all
+		/// pass with an estimate of 0. Called with admissionMutex locked.
+		/// </summary>
+		bool canAdmit(TaskContext& context, const Task& task);
+
+		/// <summary>
+		/// Called after the first step of a task that found memory reported by its executor. A task admitted without
+		/// an estimate reserves what it reported, and deferred tasks of the executor get an estimate from it.
+		/// </summary>
+		void memoryReportedBy(TaskContext& context);
+
+		/// <summary>
+		/// Reserve memory of an admitted task. Called with admissionMutex locked.
+		/// </summary>
+		void reserveMemory(TaskContext& context);
+
+		/// <summary>
+		/// Serve a task with a fingerprint from an identical running task or a memoized result. Otherwise register
+		/// context as the task executing for the fingerprint.
+		/// </summary>
+		/// <returns>Id of a task completed by the shared work, empty if the task has to be executed.</returns>
+		std::optional<TaskID> shareTask(const std::string& fingerprint, const std::string& executorName, const std::shared_ptr<TaskContext>& context);
+
+		/// <summary>
+		/// Memoize the result of a completed task with a fingerprint and complete the tasks attached to it.
+		/// </summary>
+		void finishSharedTask(TaskContext* context, const TaskResult& result);
+
+		/// <summary>
+		/// Drop expired results, then least recently used ones while above the budget. Called with memoMutex locked.
+		/// </summary>
+		void evictMemo();
+
+		/// <summary>
+		/// Statistics counters of an executor by name.
+		/// </summary>
+		ExecutorStatsCounters* getStats(const std::string& name);
+
+		/// <summary>
+		/// Take a finished executor for reuse, nullptr if none was recycled.
+		/// </summary>
+		std::shared_ptr<Executor> takeRecycledExecutor(ExecutorHandle executor);
+
+		/// <summary>
+		/// Keep a finished recyclable executor, unless enough are already kept.
+		/// </summary>
+		void recycleExecutor(ExecutorHandle executor, const std::shared_ptr<Executor>& exec);
+
+		/// <summary>
+		/// Build completion queue entry for a task whose steps have completed.
+		/// </summary>
+		static CompletionQueue::Completion makeCompletion(const TaskContext& context);
+
+		/// <summary>
+		/// Expected remaining step time of a task, 0 when unknown.
+		/// </summary>
+		std::chrono::nanoseconds remainingCost(const TaskContext& context);
+
+		/// <summary>
+		/// Get task context by id. Throws std::invalid_argument for unknown ids.
+		/// </summary>
+		std::shared_ptr<TaskContext> getContext(TaskID task);
+
+		/// <summary>
+		/// Execute one step of the task on the given slot and handle task completion.
+		/// </summary>
+		/// <returns>false if the task steps had already completed and nothing was executed.</returns>
+		bool runStep(TaskContext* context, int slot);
+
+		/// <summary>
+		/// Called once a step has returned ES_Stop. Removes the task from the priority queue.
+		/// </summary>
+		void finishSteps(TaskContext* context);
+
+		/// <summary>
+		/// Called once after steps have completed and no step is in flight. Schedules callbacks.
+		/// </summary>
+		void completeTask(TaskContext* context);
+
+		/// <summary>
+		/// Execute the newest job of the slot's own queue.
+		/// </summary>
+		/// <returns>true if a job was executed</returns>
+		bool runOwnJob(int slot);
+
+		/// <summary>
+		/// Execute the oldest job of another slot's queue or of the shared queue. Only called by idle threads.
+		/// </summary>
+		/// <returns>true if a job was executed</returns>
+		bool stealJob(int slot);
+
+		/// <summary>
+		/// Execute a job on slot and wake threads waiting for its group once the group has finished.
+		/// </summary>
+		void runJob(SpawnedJob& spawned, int slot);
+
+		/// <summary>
+		/// Wake a sleeping worker, if any, to steal a queued job.
+		/// </summary>
+		void wakeThief();
+
+		/// <summary>
+		/// Returns true if any queue has jobs to steal.
+		/// </summary>
+		bool hasQueuedJobs() const;
+
+		/// <summary>
+		/// Execute a job of the slot's own queue, a single step of the awaited task or of the current top task, or
+		/// a stolen job when there is nothing else, on the calling thread's slot.
+		/// </summary>
+		/// <returns>true if a step was executed</returns>
+		bool helpOnce(TaskContext* awaited);
+
+		/// <summary>
+		/// Execute ready work on the calling thread until done returns true.
+		/// Non-worker threads borrow a helper slot for the duration of the wait.
+		/// </summary>
+		void helpUntil(TaskContext* awaited, const std::function<bool()>& done);
+
+		/// <summary>
+		/// Returns index of a free helper slot or -1 if all are taken.
+		/// </summary>
+		int acquireHelperSlot();
+		void releaseHelperSlot(int slot);
 	};
 };
\ No newline at end of file
@@ -1,8 +1,11 @@
 #include "TaskSystem.h"
 #include "TaskSystemImpl.h"
+#include "ProcessWorkerPool.h"
+#include "ParallelRange.h"
 #include <cassert>
 #include <chrono>
 #include <thread>
+#include <atomic>
 
 
 using namespace TaskSystem;
@@ -30,14 +33,55 @@ struct PrinterParams : Task {
 
 struct RaytracerParams : Task {
     std::string sceneName;
+    bool writeImage;
+    /// Enables adaptive sampling when above 0
+    double noiseTarget = 0;
+    /// Render in passes of one sample per pixel, publishing a snapshot after each. passes defaults to the scene's spp
+    bool progressive = false;
+    int passes = 0;
+    /// Filter the frame with the denoiser before it is published and written
+    bool denoise = false;
+    /// Render this many frames orbiting the scene, onFrame is called with each of them
+    int frames = 0;
+    int outputPriority = 0;
+    std::function<void(int, TaskResult)> onFrame;
 
-    RaytracerParams(const std::string &sceneName): sceneName(sceneName) {}
+    RaytracerParams(const std::string &sceneName, bool writeImage = true, double noiseTarget = 0)
+        : sceneName(sceneName), writeImage(writeImage), noiseTarget(noiseTarget) {}
     virtual std::optional<std::string> GetStringParam(const std::string &name) const {
         if (name == "sceneName") {
             return sceneName;
         }
         return std::nullopt;
     }
+    virtual std::optional<int> GetIntParam(const std::string &name) const {
+        if (name == "writeImage") {
+            return writeImage;
+        } else if (name == "progressive") {
+            return progressive;
+        } else if (name == "passes" && passes > 0) {
+            return passes;
+        } else if (name == "denoise") {
+            return denoise;
+        } else if (name == "frames" && frames > 0) {
+            return frames;
+        } else if (name == "outputPriority") {
+            return outputPriority;
+        }
+        return std::nullopt;
+    }
+    virtual std::optional<double> GetDoubleParam(const std::string &name) const {
+        if (name == "noiseTarget" && noiseTarget > 0) {
+            return noiseTarget;
+        }
+        return std::nullopt;
+    }
+    virtual std::optional<void *> GetAnyParam(const std::string &name) const {
+        if (name == "onFrame" && onFrame) {
+            return const_cast<std::function<void(int, TaskResult)> *>(&onFrame);
+        }
+        return std::nullopt;
+    }
     virtual std::string GetExecutorName() const { return "raytracer"; }
 };
 
@@ -53,9 +97,98 @@ void testRenderer() {
         printf("Task finished:%d\n", id.id);
         });
     ts.WaitForTask(id);
+    // The image file is written by an output task scheduled when rendering completes
+    ts.WaitForAll();
     //ts.Terminate();
 }
 
+void testRendererThroughput() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // Renderer prints rays per second of each scene once it completes
+    for (const char *sceneName : { "Example", "HeavyMesh", "ManySimpleMeshes", "ManyHeavyMeshes" }) {
+        TaskSystemExecutor::TaskID id = ts.ScheduleTask(std::make_unique<RaytracerParams>(sceneName, false), 1);
+        ts.WaitForTask(id);
+    }
+}
+
+void testAdaptiveSampling() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // Renderer prints time, average samples per pixel and noise, compare fixed samples with adaptive ones
+    for (const char *sceneName : { "Example", "HeavyMesh", "ManySimpleMeshes", "ManyHeavyMeshes" }) {
+        for (const double noiseTarget : { 0.0, 0.1, 0.05 }) {
+            TaskSystemExecutor::TaskID id = ts.ScheduleTask(std::make_unique<RaytracerParams>(sceneName, false, noiseTarget), 1);
+            ts.WaitForTask(id);
+        }
+    }
+}
+
+void testProgressiveRenderer() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    std::unique_ptr<RaytracerParams> params = std::make_unique<RaytracerParams>("ManySimpleMeshes");
+    params->progressive = true;
+    params->passes = 256;
+    const auto start = std::chrono::steady_clock::now();
+    TaskSystemExecutor::TaskID id = ts.ScheduleTask(std::move(params), 1);
+
+    // The task being viewed is raised above other work
+    ts.SetTaskPriority(id, 10);
+
+    // Poll snapshots like a viewer would and stop the render after a while
+    bool firstSnapshot = true;
+    while (std::chrono::steady_clock::now() - start < std::chrono::seconds(2)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (firstSnapshot && ts.GetSnapshot(id).HasValue()) {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            printf("First snapshot after %.3fs\n", elapsed.count());
+            firstSnapshot = false;
+        }
+    }
+    ts.RequestStop(id);
+    ts.WaitForTask(id);
+    ts.WaitForAll();
+}
+
+void testFrameSequence() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // One task renders all frames with one scene setup, each frame is written while the next ones render
+    std::unique_ptr<RaytracerParams> params = std::make_unique<RaytracerParams>("ManySimpleMeshes");
+    params->frames = 8;
+    params->outputPriority = 2;
+    params->onFrame = [](int frame, TaskResult result) {
+        printf("Frame %d ready, %zu bytes\n", frame, result.GetSize());
+    };
+    TaskSystemExecutor::TaskID id = ts.ScheduleTask(std::move(params), 1);
+    ts.WaitForTask(id);
+    ts.WaitForAll();
+}
+
+void testDenoiser() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // A noise target no tile misses keeps every pixel at the minimum of 2 samples, compare the written images
+    for (const bool denoise : { false, true }) {
+        std::unique_ptr<RaytracerParams> params = std::make_unique<RaytracerParams>("Example", true, 1e9);
+        params->denoise = denoise;
+        TaskSystemExecutor::TaskID id = ts.ScheduleTask(std::move(params), 1);
+        ts.WaitForTask(id);
+        ts.WaitForAll();
+    }
+}
+
 void testPrinter() {
     TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
     TaskSystem::TS_LOAD_LIBARY("PrinterExecutor", ts);
@@ -78,14 +211,15 @@ void testPrinter() {
         printf("Task 2 finished 2 id: %d\n", id.id);
     });
 
-    // Schedule task 3 after task 2 finishes.
-    // TODO: no real way to wait for task3 once it has been scheduled in task2 callback
-    // Possible to wait in worker?
-    /*ts.OnTaskCompleted(id2, [&ts](TaskSystemExecutor::TaskID id) {
+    // Schedule task 3 after task 2 finishes and wait for it from the callback. The callback runs on a worker,
+    // which executes steps of task 3 while waiting, so waiting for task 2 also waits for task 3
+    ts.OnTaskCompleted(id2, [&ts](TaskSystemExecutor::TaskID id) {
         printf("Task 2 Finish: Scheduling task 3 id: %d\n", id.id);
         std::unique_ptr<Task> p3 = std::make_unique<PrinterParams>(5, 3000, 3);
-        ts.ScheduleTask(std::move(p3), 200);
-    });*/
+        TaskSystemExecutor::TaskID id3 = ts.ScheduleTask(std::move(p3), 200);
+        ts.WaitForTask(id3);
+        printf("Task 3 finished id: %d\n", id3.id);
+    });
     
     ts.OnTaskCompleted(id1, [](TaskSystemExecutor::TaskID id) {
         printf("Task 1 finished id: %d\n", id.id);
@@ -98,14 +232,317 @@ void testPrinter() {
     //ts.Terminate();
 }
 
+void testProcessWorkers(const char *executablePath) {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    ProcessWorkerPool pool(ts);
+    const bool started = pool.Start(3, { "PrinterExecutor" }, executablePath);
+    assert(started);
+
+    CompletionQueue completions;
+    std::vector<TaskSystemExecutor::TaskID> ids;
+    for (int c = 0; c < 6; c++) {
+        TaskDescriptor printer("printer");
+        printer.intParams["max"] = 5;
+        printer.intParams["sleep"] = 100;
+        printer.intParams["taskId"] = 100 + c;
+        ids.push_back(pool.ScheduleTask(printer, c));
+        ts.OnTaskCompleted(ids.back(), completions);
+    }
+
+    for (TaskSystemExecutor::TaskID id : ids) {
+        ts.WaitForTask(id);
+    }
+    std::vector<CompletionQueue::Completion> done;
+    completions.Drain(done);
+    for (const CompletionQueue::Completion &completion : done) {
+        const std::chrono::duration<double> runTime = completion.completed - completion.scheduled;
+        printf("Remote task %d %s after %.3fs\n", completion.id.id,
+            completion.status == CompletionQueue::CS_Failed ? "failed" : "finished", runTime.count());
+    }
+    pool.Stop();
+}
+
+struct NoopParams : Task {
+    std::string executorName;
+    int steps;
+
+    NoopParams(const std::string &executorName, int steps): executorName(executorName), steps(steps) {}
+    virtual std::optional<int> GetIntParam(const std::string &name) const {
+        if (name == "steps") {
+            return steps;
+        }
+        return std::nullopt;
+    }
+    virtual std::string GetExecutorName() const { return executorName; }
+};
+
+/// Executor with empty steps, measures the cost of scheduling and dispatching a step
+struct NoopExecutor : Executor {
+    NoopExecutor(std::unique_ptr<Task> taskToExecute) : Executor(std::move(taskToExecute)) {
+        remaining = task->GetIntParam("steps").value();
+    }
+
+    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) override {
+        return remaining.fetch_sub(1) > 1 ? ES_Continue : ES_Stop;
+    }
+
+    std::atomic<int> remaining;
+};
+
+/// Noop steps taking a temporary buffer from the step scratch and counting steps in a per-slot task local
+struct ScratchNoopExecutor : NoopExecutor {
+    ScratchNoopExecutor(std::unique_ptr<Task> taskToExecute) : NoopExecutor(std::move(taskToExecute)) {}
+
+    virtual ExecStatus ExecuteStep(StepContext &context) override {
+        float *temporary = context.Scratch().AllocateArray<float>(256);
+        temporary[0] = 0.f;
+        context.TaskLocal<int64_t>()++;
+        return NoopExecutor::ExecuteStep(context.threadIndex, context.threadCount);
+    }
+};
+
+void testStepOverhead() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    // Dynamic libraries are opened here, executors built with TS_STATIC_EXECUTORS are only registered
+    const auto loadStart = std::chrono::steady_clock::now();
+    TaskSystem::TS_LOAD_LIBARY("PrinterExecutor", ts);
+    const std::chrono::duration<double, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+    printf("Loaded executors in %.3fms\n", loadTime.count());
+
+    const TaskSystemExecutor::ExecutorHandle handles[] = {
+        ts.Register("noopVirtual", &ConstructExecutor<NoopExecutor>),
+        ts.RegisterExecutor<NoopExecutor>("noopDirect"),
+        ts.RegisterExecutor<ScratchNoopExecutor>("noopScratch"),
+    };
+
+    const int steps = 1000000;
+    for (TaskSystemExecutor::ExecutorHandle handle : handles) {
+        const std::string &name = ts.GetExecutorName(handle);
+        const auto start = std::chrono::steady_clock::now();
+        TaskSystemExecutor::TaskID id = ts.ScheduleTask(handle, std::make_unique<NoopParams>(name, steps), 1);
+        ts.WaitForTask(id);
+        const std::chrono::duration<double, std::nano> taskTime = std::chrono::steady_clock::now() - start;
+
+        const TaskSystemExecutor::ExecutorStats stats = ts.GetExecutorStats()[name];
+        printf("[%s] %.1fns per step, %.1fns inside steps\n", name.c_str(), taskTime.count() / steps,
+            double(stats.stepTime.count()) / stats.steps);
+    }
+}
+
+struct SpawnParams : NoopParams {
+    int batch;
+
+    SpawnParams(int jobs, int batch): NoopParams("spawn", jobs), batch(batch) {}
+    virtual std::optional<int> GetIntParam(const std::string &name) const {
+        if (name == "batch") {
+            return batch;
+        }
+        return NoopParams::GetIntParam(name);
+    }
+};
+
+/// Single step spawning empty jobs in batches and joining each batch, measures the cost of Spawn and WaitForGroup
+/// against calling the same jobs directly
+struct SpawnExecutor : Executor {
+    SpawnExecutor(std::unique_ptr<Task> taskToExecute) : Executor(std::move(taskToExecute)) {}
+
+    virtual ExecStatus ExecuteStep(int threadIndex, int threadCount) override {
+        if (claimed.exchange(true)) {
+            return ES_Stop;
+        }
+        const int jobs = task->GetIntParam("steps").value();
+        const int batch = task->GetIntParam("batch").value();
+        std::atomic<int> stolen = 0;
+        auto job = [threadIndex, &stolen](int jobThreadIndex, int) {
+            if (jobThreadIndex != threadIndex) {
+                stolen.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+
+        // Called through a volatile pointer so the calls are not inlined and removed
+        TaskSystemExecutor::Job directJob(job);
+        TaskSystemExecutor::Job *volatile direct = &directJob;
+        const auto directStart = std::chrono::steady_clock::now();
+        for (int c = 0; c < jobs; c++) {
+            (*direct)(threadIndex, threadCount);
+        }
+        const std::chrono::duration<double, std::nano> directTime = std::chrono::steady_clock::now() - directStart;
+
+        TaskSystemExecutor::TaskGroup group;
+        const auto spawnStart = std::chrono::steady_clock::now();
+        for (int c = 0; c < jobs; c += batch) {
+            for (int b = 0; b < batch; b++) {
+                taskSystem->Spawn(group, job);
+            }
+            taskSystem->WaitForGroup(group);
+        }
+        const std::chrono::duration<double, std::nano> spawnTime = std::chrono::steady_clock::now() - spawnStart;
+
+        printf("[spawn batch %d] %.1fns per spawned job, %.1fns per direct call, %d of %d jobs stolen\n", batch,
+            spawnTime.count() / jobs, directTime.count() / jobs, stolen.load(), jobs);
+        return ES_Stop;
+    }
+
+    std::atomic<bool> claimed = false;
+};
+
+void testSpawnOverhead() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+    const TaskSystemExecutor::ExecutorHandle handle = ts.RegisterExecutor<SpawnExecutor>("spawn");
+
+    // Other workers are idle and steal from larger batches, single jobs are usually popped back before that
+    for (int batch : { 1, 16, 256 }) {
+        ts.WaitForTask(ts.ScheduleTask(handle, std::make_unique<SpawnParams>(1 << 20, batch), 1));
+    }
+}
+
+struct SquareBody {
+    void operator()(int64_t index, int64_t &partial) const {
+        partial += index * index;
+    }
+};
+
+struct SumReducer {
+    int64_t operator()(int64_t accumulated, int64_t partial) const {
+        return accumulated + partial;
+    }
+};
+
+/// Sums the squares of [0, steps) and publishes the sum as int64_t
+struct SumOfSquaresExecutor : ParallelReduceExecutor<int64_t, SquareBody, SumReducer> {
+    SumOfSquaresExecutor(std::unique_ptr<Task> taskToExecute)
+        : ParallelReduceExecutor(std::move(taskToExecute), 0, 0, 1, 0, SquareBody{}, SumReducer{}) {
+        range.Reset(0, task->GetIntParam("steps").value(), 4096);
+    }
+};
+
+void testParallelReduce() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+    const TaskSystemExecutor::ExecutorHandle handle = ts.RegisterExecutor<SumOfSquaresExecutor>("sumOfSquares");
+
+    const int64_t count = 1 << 20;
+    TaskSystemExecutor::TaskID id = ts.ScheduleTask(handle, std::make_unique<NoopParams>("sumOfSquares", int(count)), 1);
+    ts.WaitForTask(id);
+
+    std::unique_ptr<int64_t> sum = ts.TakeResult(id).Take<int64_t>();
+    const int64_t expected = (count - 1) * count * (2 * count - 1) / 6;
+    printf("Sum of squares below %lld is %lld, expected %lld\n", (long long)count, sum ? (long long)*sum : -1LL, (long long)expected);
+}
+
+void testMemoryBudget() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // A burst of renders under a budget of about two frames: the rest wait without an executor until memory is released
+    ts.SetMemoryBudget(size_t(12) << 20);
+    std::vector<TaskSystemExecutor::TaskID> ids;
+    for (int c = 0; c < 6; c++) {
+        ids.push_back(ts.ScheduleTask(std::make_unique<RaytracerParams>("Example", false), 1));
+    }
+    const TaskSystemExecutor::MemoryStats burst = ts.GetMemoryStats();
+    printf("Admitted %d renders, %d deferred\n", burst.admittedTasks, burst.deferredTasks);
+
+    for (TaskSystemExecutor::TaskID id : ids) {
+        ts.WaitForTask(id);
+    }
+    const TaskSystemExecutor::ExecutorStats stats = ts.GetExecutorStats()["raytracer"];
+    printf("Peak memory %zu bytes, %zu bytes per render\n", ts.GetMemoryStats().peakMemoryBytes, stats.taskPeakMemoryBytes);
+    ts.SetMemoryBudget(0);
+}
+
+void testTaskCoalescing() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // Identical requests scheduled together render once, a later one completes from the memoized image
+    auto makeRequest = []() {
+        std::unique_ptr<TaskDescriptor> request = std::make_unique<TaskDescriptor>("raytracer");
+        request->stringParams["sceneName"] = "Example";
+        request->intParams["writeImage"] = 0;
+        request->shareable = true;
+        return request;
+    };
+
+    std::vector<TaskSystemExecutor::TaskID> ids;
+    for (int c = 0; c < 4; c++) {
+        ids.push_back(ts.ScheduleTask(makeRequest(), 1 + c));
+    }
+    for (TaskSystemExecutor::TaskID id : ids) {
+        ts.WaitForTask(id);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    TaskSystemExecutor::TaskID id = ts.ScheduleTask(makeRequest(), 1);
+    ts.WaitForTask(id);
+    const std::chrono::duration<double, std::milli> memoTime = std::chrono::steady_clock::now() - start;
+
+    const TaskSystemExecutor::MemoStats stats = ts.GetMemoStats();
+    printf("Memo: %llu hits, %llu misses, %llu coalesced, %zu bytes, repeated request took %.3fms\n",
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.coalesced,
+        stats.bytes, memoTime.count());
+}
+
+void testStepProfile() {
+    TaskSystemExecutor &ts = TaskSystemExecutor::GetInstance();
+
+    TaskSystem::TS_LOAD_LIBARY("RaytracerExecutor", ts);
+
+    // Tiles taking longer than 20ms are counted and reported, at most once per second per executor
+    ts.SetLongStepThreshold(std::chrono::milliseconds(20));
+    ts.WaitForTask(ts.ScheduleTask(std::make_unique<RaytracerParams>("Example", false), 1));
+
+    for (const auto &entry : ts.GetExecutorStats()) {
+        const TaskSystemExecutor::ExecutorStats &stats = entry.second;
+        printf("%s: %llu steps, p50 < %.3fms, p99 < %.3fms, max %.3fms, %llu long steps\n", entry.first.c_str(),
+            (unsigned long long)stats.steps, stats.StepTimePercentile(0.5).count() / 1e6, stats.StepTimePercentile(0.99).count() / 1e6,
+            stats.maxStepTime.count() / 1e6, (unsigned long long)stats.longSteps);
+    }
+}
+
 int main(int argc, char *argv[]) {
+    // Worker processes started by ProcessWorkerPool execute tasks and exit
+    if (ProcessWorkerPool::RunWorkerIfRequested(argc, argv)) {
+        return 0;
+    }
+
     // Init task system implementation
     TaskSystemExecutorImpl::Init(4);
 
+    // Load all executor libraries installed next to the application in parallel
+    //TaskSystemExecutor::GetInstance().LoadAllLibraries();
+
     testPrinter();
 
     //testRenderer();
 
+    //testRendererThroughput();
+
+    //testAdaptiveSampling();
+
+    //testProgressiveRenderer();
+
+    //testDenoiser();
+
+    //testFrameSequence();
+
+    //testTaskCoalescing();
+
+    //testMemoryBudget();
+
+    //testProcessWorkers(argv[0]);
+
+    //testStepOverhead();
+
+    //testSpawnOverhead();
+
+    //testParallelReduce();
+
+    //testStepProfile();
+
     TaskSystemExecutor::GetInstance().Terminate();
     return 0;
 }
\ No newline at end of file